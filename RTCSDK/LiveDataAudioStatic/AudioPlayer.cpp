@@ -1,7 +1,24 @@
 #include "AudioPlayer.h"
+#include "Resampler.h"
 #include "framework.h"
 
 #include <algorithm>
+#include <chrono>
+
+namespace
+{
+    const long long kIdleTimeout = 10000;      // no packets for this long: drop the stream
+    const long long kEvictInterval = 1000;
+    const size_t kMaxSpareDecoders = 8;
+    const int32_t kReadyDuration = 100;        // ms buffered before a stream starts or resumes
+    const int32_t kMaxPacketFrames = 6;        // Opus packets carry at most 120 ms
+    const int32_t kMixChannels = 2;
+
+    long long NowInMilliseconds()
+    {
+        return chrono::steady_clock::now().time_since_epoch().count() / 1000000;
+    }
+}
 
 AudioPlayer::AudioPlayer():
 hTimer(NULL),
@@ -50,9 +67,22 @@ AudioPlayer::~AudioPlayer()
 void AudioPlayer::TimerProc(PVOID lpParameter, BOOLEAN TimerOrWaitFired)
 {
 	AudioPlayer* thiz = (AudioPlayer*)lpParameter;
-    static const size_t sizeInByte = thiz->sampleRate * 20 * thiz->renderer->BytesPerSample() * thiz->renderer->ChannelCount() / 1000;
-    static shared_ptr<BYTE> tmpOutput = shared_ptr<BYTE>(new BYTE[sizeInByte]);
-    static shared_ptr<BYTE> outputData = shared_ptr<BYTE>(new BYTE[sizeInByte]);
+    const size_t frameSize = thiz->sampleRate * 20 / 1000;
+    const size_t channels = kMixChannels;
+    const size_t deviceChannels = thiz->renderer->ChannelCount();
+    const size_t bytesPerFrame = thiz->renderer->BytesPerSample() * deviceChannels;
+    vector<float> mixData(frameSize * channels);
+    vector<float> resampleData;
+    size_t outputFrames = frameSize;
+    if (thiz->needResample)
+    {
+        outputFrames = thiz->resampler->MaxOutputFrames(frameSize);
+        resampleData.resize(outputFrames * channels);
+    }
+    vector<float> outputData(outputFrames * deviceChannels);
+    vector<StreamPtr> streams;
+    vector<StreamPtr> retired;
+    long long lastEvictTime = NowInMilliseconds();
     
     HANDLE tEvent = CreateEvent(nullptr, true, false, nullptr);
     HANDLE hTimer = NULL;
@@ -62,67 +92,112 @@ void AudioPlayer::TimerProc(PVOID lpParameter, BOOLEAN TimerOrWaitFired)
 
     while (thiz->running)
     {
-        memset(tmpOutput.get(), 0, sizeInByte);
-        memset(outputData.get(), 0, sizeInByte);
-        for (auto& item : thiz->mJitterBuffer)
+        memset(mixData.data(), 0, mixData.size() * sizeof(float));
+        thiz->Snapshot(streams);
+        for (auto& stream : streams)
         {
-            unique_lock<mutex> lck(item.second.bufferMutex);
-            if (!item.second.isReady)
+            unique_lock<mutex> lck(stream->bufferMutex);
+            if (!stream->isReady)
+            {
+                stream->meter.ProcessSilence();
                 continue;
-            long long uid = item.first;
-            auto& userData = item.second.uidData;
-            int err = OPUS_OK;
-            auto iter = thiz->mDecoderHandlers.find(uid);
-            if (iter == thiz->mDecoderHandlers.end())
+            }
+            auto& packets = stream->packets;
+            if (stream->delayAdjust > 0)
+            {
+                // hold this stream for one tick so one more frame queues up
+                stream->delayAdjust--;
+                continue;
+            }
+            if (stream->delayAdjust < 0)
             {
-                int error = OPUS_OK;
-                thiz->mDecoderHandlers.insert(make_pair(uid, opus_decoder_create(thiz->sampleRate, thiz->renderer->ChannelCount(), &error)));
-                if (error != OPUS_OK)
+                if (stream->pcmOffset < stream->pcmFrames)
                 {
-                    thiz->mDecoderHandlers.erase(uid);
-                    fprintf(stderr, "create decoder error uid: %lld\n", uid);
-                    break;
+                    stream->pcmOffset += frameSize;
+                    stream->delayAdjust++;
+                }
+                else if (packets.Size() > 1)
+                {
+                    AudioPacket* packet = packets.PopFront();
+                    stream->queuedDuration -= packet->duration;
+                    thiz->packetPool.Release(packet);
+                    stream->delayAdjust++;
                 }
             }
+            if (stream->decoder == nullptr)
+            {
+                stream->decoder = thiz->TakeDecoder();
+                if (stream->decoder == nullptr)
+                {
+                    fprintf(stderr, "create decoder error uid: %lld\n", stream->uid);
+                    continue;
+                }
+                stream->pcm.resize(frameSize * kMaxPacketFrames * channels);
+            }
 
-            if (userData.size() > 0)
+            // packets may be 20, 40 or 60 ms; decode a whole one and play it out 20 ms per tick
+            if (stream->pcmOffset >= stream->pcmFrames && packets.Size() > 0)
             {
-                int result = opus_decode_float(thiz->mDecoderHandlers[uid], userData.front().second.data(), userData.front().second.size(), (float*)tmpOutput.get(), thiz->sampleRate / 1000 * 20, 0);
+                AudioPacket* packet = packets.PopFront();
+                stream->queuedDuration -= packet->duration;
+                int result = opus_decode_float(stream->decoder, packet->data, packet->length, stream->pcm.data(), frameSize * kMaxPacketFrames, 0);
                 if (result < OPUS_OK)
                 {
-                    fprintf(stderr, "opus decode erro uid: %lld!\n", uid);
+                    fprintf(stderr, "opus decode erro uid: %lld!\n", stream->uid);
+                    memset(stream->pcm.data(), 0, frameSize * channels * sizeof(float));
+                    result = frameSize;
                 }
-                MixAudio((float*)outputData.get(), (float*)tmpOutput.get(), thiz->sampleRate * 20 * thiz->renderer->ChannelCount() / 1000);
-                item.second.timestamp = userData.front().first;
-                userData.pop_front();
+                stream->pcmOffset = 0;
+                stream->pcmFrames = result;
+                // the sender stamps a packet when its last 20 ms frame is done
+                stream->pcmTimestamp = packet->timestamp - (long long)(result - frameSize) * 1000 / thiz->sampleRate;
+                thiz->packetPool.Release(packet);
+            }
+
+            if (stream->pcmOffset < stream->pcmFrames)
+            {
+                size_t frames = min(frameSize, stream->pcmFrames - stream->pcmOffset);
+                const float* block = stream->pcm.data() + stream->pcmOffset * channels;
+                MixAudio(mixData.data(), block, frames * channels);
+                stream->meter.Process(block, frames * channels);
+                stream->timestamp = stream->pcmTimestamp + (long long)stream->pcmOffset * 1000 / thiz->sampleRate;
+                stream->playTime = NowInMilliseconds();
+                stream->pcmOffset += frames;
             }
 
-            if (userData.size() == 0)
+            if (stream->pcmOffset >= stream->pcmFrames && packets.Size() == 0)
             {
-                item.second.isReady = false;
+                stream->isReady = false;
             }
         }
+        streams.clear();
+
+        long long now = NowInMilliseconds();
+        if (now - lastEvictTime >= kEvictInterval)
+        {
+            thiz->EvictIdleStreams(now);
+            lastEvictTime = now;
+        }
+        {
+            unique_lock<mutex> lck(thiz->retiredMutex);
+            retired.swap(thiz->mRetiredStreams);
+        }
+        for (auto& stream : retired)
+            thiz->RecycleStream(stream);
+        retired.clear();
 
         if (thiz->renderer)
         {
             if (thiz->needResample)
             {
-                SRC_DATA srcData;
-                srcData.data_in = (float*)outputData.get();
-                srcData.input_frames = thiz->sampleRate * 20 / 1000;
-                int32_t resampleSize = sizeInByte * (thiz->renderer->SamplesPerSecond() + 1000) / thiz->sampleRate;
-                static shared_ptr<BYTE> resampleData = shared_ptr<BYTE>(new BYTE[resampleSize]);
-                srcData.output_frames = (thiz->renderer->SamplesPerSecond() + 1000) * 20 / 1000;
-                srcData.data_out = (float*)resampleData.get();
-                srcData.end_of_input = 0;
-                srcData.src_ratio = double(thiz->renderer->SamplesPerSecond()) / thiz->sampleRate;
-                src_process(thiz->resampler, &srcData);
-
-                thiz->renderer->PutAudioData(resampleData.get(), srcData.output_frames_gen * thiz->renderer->BytesPerSample() * thiz->renderer->ChannelCount());
+                size_t generated = thiz->resampler->Process(mixData.data(), frameSize, resampleData.data(), outputFrames);
+                MapChannels(resampleData.data(), outputData.data(), generated, deviceChannels);
+                thiz->renderer->PutAudioData((BYTE*)outputData.data(), generated * bytesPerFrame);
             }
             else
             {
-                thiz->renderer->PutAudioData(outputData.get(), sizeInByte);
+                MapChannels(mixData.data(), outputData.data(), frameSize, deviceChannels);
+                thiz->renderer->PutAudioData((BYTE*)outputData.data(), frameSize * bytesPerFrame);
             }
         }
         WaitForSingleObject(tEvent, INFINITE);
@@ -133,42 +208,302 @@ void AudioPlayer::TimerProc(PVOID lpParameter, BOOLEAN TimerOrWaitFired)
     CloseHandle(tEvent);
 }
 
+// Streams are decoded and mixed in stereo; Opus upmixes mono packets in the
+// decoder. The mix is folded to mono or spread onto the front pair here.
+void AudioPlayer::MapChannels(const float* input, float* output, size_t frames, size_t channels)
+{
+    if (channels == 2)
+    {
+        memcpy(output, input, frames * 2 * sizeof(float));
+    }
+    else if (channels == 1)
+    {
+        const __m128 half = _mm_set1_ps(0.5f);
+        size_t i = 0;
+        for (; i + 4 <= frames; i += 4)
+        {
+            __m128 a = _mm_loadu_ps(input + i * 2);
+            __m128 b = _mm_loadu_ps(input + i * 2 + 4);
+            __m128 left = _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0));
+            __m128 right = _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1));
+            _mm_storeu_ps(output + i, _mm_mul_ps(_mm_add_ps(left, right), half));
+        }
+        for (; i < frames; i++)
+            output[i] = (input[i * 2] + input[i * 2 + 1]) * 0.5f;
+    }
+    else
+    {
+        memset(output, 0, frames * channels * sizeof(float));
+        for (size_t i = 0; i < frames; i++)
+        {
+            output[i * channels] = input[i * 2];
+            output[i * channels + 1] = input[i * 2 + 1];
+        }
+    }
+}
+
+AudioPlayer::StreamPtr AudioPlayer::FindStream(long long uid)
+{
+    auto& shard = ShardFor(uid);
+    unique_lock<mutex> lck(shard.shardMutex);
+    auto iter = shard.streams.find(uid);
+    if (iter != shard.streams.end())
+        return iter->second;
+    return nullptr;
+}
+
+void AudioPlayer::Snapshot(vector<StreamPtr>& streams)
+{
+    for (auto& shard : mStreamShards)
+    {
+        unique_lock<mutex> lck(shard.shardMutex);
+        for (auto& item : shard.streams)
+            streams.push_back(item.second);
+    }
+}
+
+void AudioPlayer::RetireStream(long long uid, const StreamPtr& stream)
+{
+    StreamPtr removed;
+    {
+        auto& shard = ShardFor(uid);
+        unique_lock<mutex> lck(shard.shardMutex);
+        auto iter = shard.streams.find(uid);
+        if (iter == shard.streams.end() || (stream && iter->second != stream))
+            return;
+        removed = iter->second;
+        shard.streams.erase(iter);
+    }
+    unique_lock<mutex> lck(retiredMutex);
+    mRetiredStreams.push_back(removed);
+}
+
+// Timer thread (or Stop after the thread has joined) only: decoders are not
+// shared with network threads.
+void AudioPlayer::RecycleStream(const StreamPtr& stream)
+{
+    unique_lock<mutex> lck(stream->bufferMutex);
+    stream->retired = true;
+    stream->isReady = false;
+    stream->packets.Clear(packetPool);
+    stream->queuedDuration = 0;
+    stream->pcmOffset = 0;
+    stream->pcmFrames = 0;
+    if (stream->decoder)
+    {
+        if (mSpareDecoders.size() < kMaxSpareDecoders)
+        {
+            opus_decoder_ctl(stream->decoder, OPUS_RESET_STATE);
+            mSpareDecoders.push_back(stream->decoder);
+        }
+        else
+        {
+            opus_decoder_destroy(stream->decoder);
+        }
+        stream->decoder = nullptr;
+    }
+}
+
+void AudioPlayer::EvictIdleStreams(long long now)
+{
+    for (auto& shard : mStreamShards)
+    {
+        vector<StreamPtr> idle;
+        {
+            unique_lock<mutex> lck(shard.shardMutex);
+            for (auto iter = shard.streams.begin(); iter != shard.streams.end();)
+            {
+                unique_lock<mutex> bufferLck(iter->second->bufferMutex);
+                if (!iter->second->isReady && now - iter->second->putTime > kIdleTimeout)
+                {
+                    bufferLck.unlock();
+                    idle.push_back(iter->second);
+                    iter = shard.streams.erase(iter);
+                }
+                else
+                {
+                    iter++;
+                }
+            }
+        }
+        if (idle.size() > 0)
+        {
+            unique_lock<mutex> lck(retiredMutex);
+            mRetiredStreams.insert(mRetiredStreams.end(), idle.begin(), idle.end());
+        }
+    }
+}
+
+OpusDecoder* AudioPlayer::TakeDecoder()
+{
+    if (mSpareDecoders.size() > 0)
+    {
+        OpusDecoder* decoder = mSpareDecoders.back();
+        mSpareDecoders.pop_back();
+        return decoder;
+    }
+    int error = OPUS_OK;
+    OpusDecoder* decoder = opus_decoder_create(sampleRate, kMixChannels, &error);
+    if (error != OPUS_OK)
+        return nullptr;
+    return decoder;
+}
+
+void AudioPlayer::ClearStreams()
+{
+    vector<StreamPtr> streams;
+    for (auto& shard : mStreamShards)
+    {
+        unique_lock<mutex> lck(shard.shardMutex);
+        for (auto& item : shard.streams)
+            streams.push_back(item.second);
+        shard.streams.clear();
+    }
+    {
+        unique_lock<mutex> lck(retiredMutex);
+        streams.insert(streams.end(), mRetiredStreams.begin(), mRetiredStreams.end());
+        mRetiredStreams.clear();
+    }
+    for (auto& stream : streams)
+        RecycleStream(stream);
+    for (auto decoder : mSpareDecoders)
+        opus_decoder_destroy(decoder);
+    mSpareDecoders.clear();
+}
+
 AudioPlayer* AudioPlayer::GetInstance()
 {
     static auto a = new AudioPlayer();
 	return a;
 }
 
-void AudioPlayer::PutAudioData(long long uid, long long timestamp, char* data, size_t length)
+void AudioPlayer::PutAudioData(long long uid, long long timestamp, const char* data, size_t length)
 {
     if (hTimer)
     {
-        unique_lock<mutex> lck(mJitterBuffer[uid].bufferMutex);
-        auto iter = upper_bound(mJitterBuffer[uid].uidData.begin(), mJitterBuffer[uid].uidData.end(), timestamp,
-            [](const long long a, const pair<long long, vector<BYTE>>& b) {return a < b.first; });
+        int samples = opus_packet_get_nb_samples((const unsigned char*)data, length, 48000);
+        if (samples <= 0)
+        {
+            fprintf(stderr, "invalid audio packet uid: %lld length: %zu\n", uid, length);
+            return;
+        }
+        AudioPacket* packet = packetPool.Acquire(timestamp, data, length);
+        if (packet == nullptr)
+        {
+            fprintf(stderr, "audio packet too large uid: %lld length: %zu\n", uid, length);
+            return;
+        }
+        packet->duration = samples / 48;
+
+        StreamPtr stream;
+        {
+            auto& shard = ShardFor(uid);
+            unique_lock<mutex> lck(shard.shardMutex);
+            auto& entry = shard.streams[uid];
+            if (!entry)
+            {
+                entry = make_shared<JitterBufferData>();
+                entry->uid = uid;
+            }
+            stream = entry;
+        }
 
-        vector<BYTE> pack(length, 0);
-        memcpy_s(pack.data(), pack.size(), data, length);
-        mJitterBuffer[uid].uidData.emplace(iter, make_pair(timestamp, pack));
+        unique_lock<mutex> lck(stream->bufferMutex);
+        if (stream->retired)
+        {
+            // lost the race with RemoveUser/eviction
+            packetPool.Release(packet);
+            return;
+        }
+        AudioPacket* evicted = stream->packets.Insert(packet);
+        if (evicted)
+        {
+            stream->queuedDuration -= evicted->duration;
+            packetPool.Release(evicted);
+        }
+        stream->queuedDuration += packet->duration;
+        stream->putTime = NowInMilliseconds();
 
-        if (mJitterBuffer[uid].uidData.size() >= 5)
+        if (stream->queuedDuration >= kReadyDuration)
         {
-            mJitterBuffer[uid].isReady = true;
+            stream->isReady = true;
         }
     }
 }
 
 long long AudioPlayer::GetUserTimestamp(long long uid)
 {
-    auto iter = mJitterBuffer.find(uid);
-    if (iter != mJitterBuffer.end())
+    StreamPtr stream = FindStream(uid);
+    if (stream)
     {
-        unique_lock<mutex> lck(iter->second.bufferMutex);
-        return iter->second.timestamp;
+        unique_lock<mutex> lck(stream->bufferMutex);
+        return stream->timestamp;
     }
     return 0;
 }
 
+bool AudioPlayer::GetUserPlayout(long long uid, long long& timestamp, long long& playTime)
+{
+    StreamPtr stream = FindStream(uid);
+    if (stream)
+    {
+        unique_lock<mutex> lck(stream->bufferMutex);
+        if (stream->playTime == 0)
+            return false;
+        timestamp = stream->timestamp;
+        playTime = stream->playTime;
+        return true;
+    }
+    return false;
+}
+
+void AudioPlayer::AdjustUserDelay(long long uid, int32_t frames)
+{
+    StreamPtr stream = FindStream(uid);
+    if (stream)
+    {
+        unique_lock<mutex> lck(stream->bufferMutex);
+        stream->delayAdjust += frames;
+    }
+}
+
+bool AudioPlayer::GetUserLevel(long long uid, AudioLevel& level)
+{
+    StreamPtr stream = FindStream(uid);
+    if (stream)
+    {
+        level = stream->meter.GetLevel();
+        return true;
+    }
+    return false;
+}
+
+void AudioPlayer::GetUserLevels(vector<pair<long long, AudioLevel>>& levels)
+{
+    for (auto& shard : mStreamShards)
+    {
+        unique_lock<mutex> lck(shard.shardMutex);
+        for (auto& item : shard.streams)
+            levels.emplace_back(item.first, item.second->meter.GetLevel());
+    }
+}
+
+void AudioPlayer::RemoveUser(long long uid)
+{
+    RetireStream(uid, nullptr);
+}
+
+size_t AudioPlayer::StreamCount()
+{
+    size_t count = 0;
+    for (auto& shard : mStreamShards)
+    {
+        unique_lock<mutex> lck(shard.shardMutex);
+        count += shard.streams.size();
+    }
+    return count;
+}
+
 void AudioPlayer::Start()
 {
     unique_lock<mutex> lck(startedMutex);
@@ -182,8 +517,7 @@ void AudioPlayer::Start()
             {
                 sampleRate = 48000;
                 needResample = true;
-                int err = 0;
-                resampler = src_new(SRC_SINC_FASTEST, renderer->ChannelCount(), &err);
+                resampler = new Resampler(sampleRate, renderer->SamplesPerSecond(), kMixChannels, kMixChannels);
             }
             else if (sampleRate != 48000 && sampleRate != 8000 && sampleRate != 16000 && sampleRate != 32000)
             {
@@ -219,17 +553,11 @@ void AudioPlayer::Stop()
             hTimer = nullptr;
         }
 
-        mJitterBuffer.clear();
-        for (auto item : mDecoderHandlers)
-        {
-            if (item.second)
-                opus_decoder_destroy(item.second);
-        }
-        mDecoderHandlers.clear();
+        ClearStreams();
 
         if (needResample)
         {
-            src_delete(resampler);
+            delete resampler;
             resampler = nullptr;
             needResample = false;
         }
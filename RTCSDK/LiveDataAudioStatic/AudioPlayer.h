@@ -1,12 +1,16 @@
 #pragma once
 #include "WASAPIRenderer.h"
+#include "PacketPool.h"
+#include "LevelMeter.h"
 #include <unordered_map>
 #include <list>
 #include <vector>
+#include <memory>
+#include <xmmintrin.h>
 
 
 struct OpusDecoder;
-typedef struct SRC_STATE_tag SRC_STATE;
+class Resampler;
 
 using namespace std;
 
@@ -14,27 +18,61 @@ class AudioPlayer
 {
 	struct JitterBufferData
 	{
-		list<pair<long long, vector<BYTE>>> uidData;
-		long long timestamp;
-		bool isReady;
+		PacketRing packets;
+		int32_t queuedDuration = 0;	// ms of audio in packets
+		vector<float> pcm;			// decoded packet not played out yet
+		size_t pcmOffset = 0;
+		size_t pcmFrames = 0;
+		long long pcmTimestamp = 0;
+		long long uid = 0;
+		long long timestamp = 0;
+		long long playTime = 0;
+		long long putTime = 0;
+		int32_t delayAdjust = 0;
+		bool isReady = false;
+		bool retired = false;
+		OpusDecoder* decoder = nullptr;	// owned by the timer thread
+		LevelMeter meter;
 		mutex bufferMutex;
 	};
+	typedef shared_ptr<JitterBufferData> StreamPtr;
+
+	// streams are sharded by uid so network threads only contend with the
+	// timer thread's snapshot on the shard they hit
+	static const size_t kShardCount = 16;
+	struct StreamShard
+	{
+		unordered_map<long long, StreamPtr> streams;
+		mutex shardMutex;
+	};
+
 	CWASAPIRenderer* renderer;
 	std::thread* hTimer;
 	bool running = false;
-	unordered_map<long long, JitterBufferData> mJitterBuffer;
-	unordered_map<long long, OpusDecoder*> mDecoderHandlers;
+	PacketPool packetPool;
+	StreamShard mStreamShards[kShardCount];
+	vector<StreamPtr> mRetiredStreams;
+	mutex retiredMutex;
+	vector<OpusDecoder*> mSpareDecoders;
 	int32_t sampleRate;
 	bool needResample = false;
 
 	bool started = false;
 	mutex startedMutex;
 
-	SRC_STATE* resampler;
+	Resampler* resampler;
 
-	static inline void MixAudio(float* output, float* input, size_t frameSize)
+	static inline void MixAudio(float* output, const float* input, size_t count)
 	{
-		for (int i = 0; i != frameSize; i++)
+		const __m128 upper = _mm_set1_ps(1.0f);
+		const __m128 lower = _mm_set1_ps(-1.0f);
+		size_t i = 0;
+		for (; i + 4 <= count; i += 4)
+		{
+			__m128 sum = _mm_add_ps(_mm_loadu_ps(output + i), _mm_loadu_ps(input + i));
+			_mm_storeu_ps(output + i, _mm_max_ps(_mm_min_ps(sum, upper), lower));
+		}
+		for (; i < count; i++)
 		{
 			output[i] += input[i];
 			if (output[i] > 1.0f)
@@ -47,6 +85,16 @@ class AudioPlayer
 			}
 		}
 	}
+	static void MapChannels(const float* input, float* output, size_t frames, size_t channels);
+
+	StreamShard& ShardFor(long long uid) { return mStreamShards[(unsigned long long)uid % kShardCount]; }
+	StreamPtr FindStream(long long uid);
+	void Snapshot(vector<StreamPtr>& streams);
+	void RetireStream(long long uid, const StreamPtr& stream);
+	void RecycleStream(const StreamPtr& stream);
+	void EvictIdleStreams(long long now);
+	OpusDecoder* TakeDecoder();
+	void ClearStreams();
 
 	static void WINAPI TimerProc(PVOID lpParameter, BOOLEAN TimerOrWaitFired);
 public:
@@ -55,8 +103,15 @@ public:
 	virtual ~AudioPlayer();
 
 	static AudioPlayer* GetInstance();
-	void PutAudioData(long long uid, long long timestamp, char* data, size_t length);
+	void PutAudioData(long long uid, long long timestamp, const char* data, size_t length);
 	long long GetUserTimestamp(long long uid);
+	bool GetUserPlayout(long long uid, long long& timestamp, long long& playTime);
+	void AdjustUserDelay(long long uid, int32_t frames);
+	bool GetUserLevel(long long uid, AudioLevel& level);
+	// every stream playing right now
+	void GetUserLevels(vector<pair<long long, AudioLevel>>& levels);
+	void RemoveUser(long long uid);
+	size_t StreamCount();
 	void Start();
 	void Stop();
 };
@@ -1,14 +1,22 @@
 #include "AudioRecorder.h"
+#include "Resampler.h"
 
 #include "framework.h"
 
 #include <opus.h>
+#include <algorithm>
+
+namespace
+{
+    const int32_t kMusicBitrate = 64000;       // per channel
+}
 
 AudioRecorder::AudioRecorder():
 hTimer(NULL),
 OnAudioReady(nullptr),
 capture(nullptr),
 encoder(nullptr),
+repacketizer(nullptr),
 resampler(nullptr)
 {
     HRESULT hr;
@@ -53,9 +61,33 @@ AudioRecorder::~AudioRecorder()
 void AudioRecorder::TimerProc(PVOID lpParameter, BOOLEAN TimerOrWaitFired)
 {
     AudioRecorder* thiz = (AudioRecorder*)lpParameter;
-    size_t sizeInByte = thiz->capture->SamplesPerSecond() * 20 * thiz->capture->BytesPerSample() * thiz->capture->ChannelCount() / 1000;
-    static shared_ptr<BYTE> pcmData = shared_ptr<BYTE>(new BYTE[sizeInByte]);
-    static shared_ptr<BYTE> tmpData = shared_ptr<BYTE>(new BYTE[4000]);
+    const size_t captureFrames = thiz->capture->SamplesPerSecond() * 20 / 1000;
+    const size_t frameSize = thiz->sampleRate * 20 / 1000;
+    size_t sizeInByte = captureFrames * thiz->capture->BytesPerSample() * thiz->capture->ChannelCount();
+    vector<BYTE> pcmData(sizeInByte);
+    const size_t maxFrameBytes = 4000;
+    vector<BYTE> frameData(maxFrameBytes * 3);
+    int32_t bufferedFrames = 0;
+    vector<float> resampleData;
+    if (thiz->needResample)
+        resampleData.resize(thiz->resampler->MaxOutputFrames(captureFrames) * thiz->resampler->OutputChannels());
+
+    auto sendPacket = [&]() {
+        // repacketize straight into a pooled buffer that is handed on as is
+        shared_ptr<vector<BYTE>> data = thiz->bufferPool->Acquire(maxFrameBytes * 3);
+        int length = opus_repacketizer_out(thiz->repacketizer, data->data(), data->size());
+        if (length < OPUS_OK)
+        {
+            fprintf(stderr, "opus repacketizer erro err: %d!\n", length);
+            return;
+        }
+        data->resize(length);
+
+        if (thiz->OnAudioReady && length > 0)
+        {
+            thiz->OnAudioReady(data);
+        }
+    };
 
     HANDLE tEvent = CreateEvent(nullptr, true, false, nullptr);
     HANDLE hTimer = NULL;
@@ -68,32 +100,28 @@ void AudioRecorder::TimerProc(PVOID lpParameter, BOOLEAN TimerOrWaitFired)
         size_t readed = 0;
         int length = 0;
         if (thiz->capture)
-            readed = thiz->capture->GetAudioData(pcmData.get(), sizeInByte);
+            readed = thiz->capture->GetAudioData(pcmData.data(), sizeInByte);
         // resample
         if (readed != sizeInByte)
             continue;
 
+        // every 20 ms frame gets its own slot; the repacketizer keeps pointers into it
+        BYTE* frame = frameData.data() + bufferedFrames * maxFrameBytes;
         if (thiz->needResample)
         {
-            SRC_DATA srcData;
-            srcData.data_in = (float*)pcmData.get();
-            srcData.input_frames = thiz->capture->SamplesPerSecond() * 20 / 1000;
-            int32_t resampleSize = sizeInByte * thiz->sampleRate / thiz->capture->SamplesPerSecond();
-            static shared_ptr<BYTE> resampleData = shared_ptr<BYTE>(new BYTE[resampleSize]);
-            srcData.output_frames = thiz->sampleRate * 20 / 1000;
-            srcData.data_out = (float*)resampleData.get();
-            srcData.end_of_input = 0;
-            srcData.src_ratio = double(thiz->sampleRate) / double(thiz->capture->SamplesPerSecond());
-            src_process(thiz->resampler, &srcData);
-
-            if (srcData.output_frames_gen > 0)
-                length = opus_encode_float(thiz->encoder, (float*)resampleData.get(), srcData.output_frames_gen, tmpData.get(), 4000);
+            size_t generated = thiz->resampler->Process((float*)pcmData.data(), captureFrames, resampleData.data(), frameSize);
+            if (generated == frameSize)
+            {
+                thiz->meter.Process(resampleData.data(), frameSize * thiz->channels);
+                length = opus_encode_float(thiz->encoder, resampleData.data(), frameSize, frame, maxFrameBytes);
+            }
             else
                 continue;
         }
         else
         {
-            length = opus_encode_float(thiz->encoder, (float*)pcmData.get(), thiz->sampleRate * 20 / 1000, tmpData.get(), 4000);
+            thiz->meter.Process((float*)pcmData.data(), frameSize * thiz->channels);
+            length = opus_encode_float(thiz->encoder, (float*)pcmData.data(), frameSize, frame, maxFrameBytes);
         }
 
         if (length < OPUS_OK)
@@ -102,12 +130,24 @@ void AudioRecorder::TimerProc(PVOID lpParameter, BOOLEAN TimerOrWaitFired)
             continue;
         }
 
-        shared_ptr<vector<BYTE>> data = make_shared<vector<BYTE>>(length, 0);
-        memcpy_s(data->data(), data->size(), tmpData.get(), length);
-
-        if (thiz->OnAudioReady && length > 0)
+        if (bufferedFrames == 0)
+            opus_repacketizer_init(thiz->repacketizer);
+        if (opus_repacketizer_cat(thiz->repacketizer, frame, length) != OPUS_OK)
         {
-            thiz->OnAudioReady(data);
+            // encoder switched mode or bandwidth, frames can't share a packet
+            if (bufferedFrames > 0)
+                sendPacket();
+            memmove(frameData.data(), frame, length);
+            frame = frameData.data();
+            opus_repacketizer_init(thiz->repacketizer);
+            opus_repacketizer_cat(thiz->repacketizer, frame, length);
+            bufferedFrames = 0;
+        }
+        bufferedFrames++;
+        if (bufferedFrames * 20 >= thiz->packetDuration)
+        {
+            sendPacket();
+            bufferedFrames = 0;
         }
         WaitForSingleObject(tEvent, INFINITE);
         ResetEvent(tEvent);
@@ -127,6 +167,33 @@ void AudioRecorder::SetAudioCallback(function<void(shared_ptr<vector<BYTE>> data
     OnAudioReady = callback;
 }
 
+void AudioRecorder::SetPacketDuration(int32_t duration)
+{
+    if (duration != 20 && duration != 40 && duration != 60)
+    {
+        fprintf(stderr, "unsupported packet duration %d\n", duration);
+        return;
+    }
+    packetDuration = duration;
+}
+
+void AudioRecorder::SetMusicMode(bool enable)
+{
+    bool restart = false;
+    {
+        unique_lock<mutex> lck(startedMutex);
+        if (musicMode == enable)
+            return;
+        musicMode = enable;
+        restart = started;
+    }
+    if (restart)
+    {
+        Stop();
+        Start();
+    }
+}
+
 void AudioRecorder::Start()
 {
     unique_lock<mutex> lck(startedMutex);
@@ -136,28 +203,44 @@ void AudioRecorder::Start()
         if (capture) {
 
             sampleRate = capture->SamplesPerSecond();
+            channels = musicMode ? min<int32_t>(capture->ChannelCount(), 2) : 1;
             if (sampleRate == 44100)
             {
                 sampleRate = 48000;
                 needResample = true;
-                int err = 0;
-                resampler = src_new(SRC_SINC_FASTEST, capture->ChannelCount(), &err);
             }
             else if (sampleRate != 48000 && sampleRate != 8000 && sampleRate != 16000 && sampleRate != 32000)
             {
                 fprintf(stderr, "unsupported sample rate %d\n", sampleRate);
                 return;
             }
+            if (channels != (int32_t)capture->ChannelCount())
+                needResample = true;
+            if (needResample)
+                resampler = new Resampler(capture->SamplesPerSecond(), sampleRate, capture->ChannelCount(), channels);
 
             int err = OPUS_OK;
-            encoder = opus_encoder_create(sampleRate, capture->ChannelCount(), OPUS_APPLICATION_VOIP, &err);
+            encoder = opus_encoder_create(sampleRate, channels, musicMode ? OPUS_APPLICATION_AUDIO : OPUS_APPLICATION_VOIP, &err);
             if (err != OPUS_OK)
             {
                 fprintf(stderr, "create encoder failed.");
                 encoder = nullptr;
                 started = false;
+                if (needResample)
+                {
+                    delete resampler;
+                    resampler = nullptr;
+                    needResample = false;
+                }
                 return;
             }
+            if (musicMode)
+            {
+                opus_encoder_ctl(encoder, OPUS_SET_SIGNAL(OPUS_SIGNAL_MUSIC));
+                opus_encoder_ctl(encoder, OPUS_SET_BITRATE(kMusicBitrate * channels));
+            }
+
+            repacketizer = opus_repacketizer_create();
 
             if (!hTimer)
             {
@@ -186,6 +269,7 @@ void AudioRecorder::Stop()
         }
         if (capture)
             capture->Stop();
+        meter.Reset();
 
         if (encoder)
         {
@@ -193,9 +277,15 @@ void AudioRecorder::Stop()
             encoder = nullptr;
         }
 
+        if (repacketizer)
+        {
+            opus_repacketizer_destroy(repacketizer);
+            repacketizer = nullptr;
+        }
+
         if (needResample)
         {
-            src_delete(resampler);
+            delete resampler;
             resampler = nullptr;
             needResample = false;
         }
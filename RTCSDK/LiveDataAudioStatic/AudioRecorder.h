@@ -1,11 +1,15 @@
 #pragma once
 #include "WASAPICapture.h"
+#include "LevelMeter.h"
+#include "PacketPool.h"
 
 #include <vector>
 #include <functional>
+#include <atomic>
 
 struct OpusEncoder;
-typedef struct SRC_STATE_tag SRC_STATE;
+struct OpusRepacketizer;
+class Resampler;
 
 class AudioRecorder
 {
@@ -14,14 +18,20 @@ class AudioRecorder
 	std::thread* hTimer;
 	bool running = false;
 	OpusEncoder* encoder;
+	OpusRepacketizer* repacketizer;
+	atomic<int32_t> packetDuration = 20;
 
 	bool started = false;
 	mutex startedMutex;
 
 	int32_t sampleRate;
+	int32_t channels;
 	bool needResample = false;
+	bool musicMode = false;
 
-	SRC_STATE* resampler;
+	Resampler* resampler;
+	LevelMeter meter;
+	shared_ptr<BufferPool> bufferPool = make_shared<BufferPool>();
 
 	static void WINAPI TimerProc(PVOID lpParameter, BOOLEAN TimerOrWaitFired);
 public:
@@ -30,6 +40,14 @@ public:
 	virtual ~AudioRecorder();
 	static AudioRecorder* GetInstance();
 	void SetAudioCallback(function<void(shared_ptr<vector<BYTE>> data)> callback);
+	// 20, 40 or 60 ms of audio per packet
+	void SetPacketDuration(int32_t duration);
+	int32_t GetPacketDuration() { return packetDuration; }
+	// stereo, OPUS_APPLICATION_AUDIO and a higher bitrate instead of mono voice;
+	// restarts the encoder if recording
+	void SetMusicMode(bool enable);
+	// level of the captured signal, also while muted
+	AudioLevel GetLevel() { return meter.GetLevel(); }
 	void Start();
 	void Stop();
 };
@@ -0,0 +1,38 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <mutex>
+
+using namespace std;
+
+// Levels of one stream in dBFS, kSilence when nothing is playing.
+struct AudioLevel
+{
+	static constexpr float kSilence = -100.0f;
+
+	float peak = kSilence;		// loudest sample of the last 20 ms block
+	float rms = kSilence;		// RMS of the last 20 ms block
+	float vu = kSilence;		// RMS smoothed with VU ballistics
+};
+
+// Measures peak and RMS of each 20 ms block in one SSE pass over the samples
+// the caller is already working on, and keeps a smoothed VU reading. Process
+// runs on the audio thread; GetLevel may be called from any thread.
+class LevelMeter
+{
+	float peak = 0.0f;
+	float rms = 0.0f;
+	float vu = 0.0f;
+	mutex levelMutex;
+
+public:
+	// interleaved samples, all channels are metered together
+	void Process(const float* pcm, size_t samples);
+	// a block in which the stream played nothing
+	void ProcessSilence();
+	void Reset();
+	AudioLevel GetLevel();
+
+	// clamps to [-1, 1] and rounds, eight samples per step
+	static void FloatToInt16(const float* input, int16_t* output, size_t count);
+};
@@ -0,0 +1,228 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+using namespace std;
+
+// One received audio packet. A packet carries at most three 20 ms Opus
+// frames of at most 1275 bytes each, so a fixed-size slot always fits.
+struct AudioPacket
+{
+    static const size_t kCapacity = 4000;
+
+    long long timestamp;
+    int32_t duration;   // ms, a packet may carry several Opus frames
+    size_t length;
+    AudioPacket* next;
+    unsigned char data[kCapacity];
+};
+
+// Slab allocator for AudioPacket. Slots are handed out from a free list and
+// new slabs are only allocated while the pool grows to the peak number of
+// packets in flight, so steady-state receive does no heap allocation.
+class PacketPool
+{
+    static const size_t kSlabPackets = 64;
+
+    mutex poolMutex;
+    AudioPacket* freeList;
+    vector<AudioPacket*> slabs;
+    size_t inUse;
+
+    void Grow()
+    {
+        AudioPacket* slab = new AudioPacket[kSlabPackets];
+        slabs.push_back(slab);
+        for (size_t i = 0; i < kSlabPackets; i++)
+        {
+            slab[i].next = freeList;
+            freeList = &slab[i];
+        }
+    }
+
+public:
+    PacketPool() : freeList(nullptr), inUse(0) {}
+
+    ~PacketPool()
+    {
+        for (auto slab : slabs)
+            delete[] slab;
+    }
+
+    PacketPool(const PacketPool&) = delete;
+    PacketPool& operator=(const PacketPool&) = delete;
+
+    AudioPacket* Acquire(long long timestamp, const char* data, size_t length)
+    {
+        if (length > AudioPacket::kCapacity)
+            return nullptr;
+
+        AudioPacket* packet;
+        {
+            unique_lock<mutex> lck(poolMutex);
+            if (freeList == nullptr)
+                Grow();
+            packet = freeList;
+            freeList = packet->next;
+            inUse++;
+        }
+        packet->timestamp = timestamp;
+        packet->duration = 0;
+        packet->length = length;
+        packet->next = nullptr;
+        memcpy(packet->data, data, length);
+        return packet;
+    }
+
+    void Release(AudioPacket* packet)
+    {
+        unique_lock<mutex> lck(poolMutex);
+        packet->next = freeList;
+        freeList = packet;
+        inUse--;
+    }
+
+    size_t SlabCount()
+    {
+        unique_lock<mutex> lck(poolMutex);
+        return slabs.size();
+    }
+
+    size_t InUse()
+    {
+        unique_lock<mutex> lck(poolMutex);
+        return inUse;
+    }
+};
+
+// Per-stream jitter queue: a fixed ring of packet pointers kept sorted by
+// timestamp. Packets almost always arrive in order, so Insert walks back from
+// the tail and usually shifts nothing. When the ring is full the oldest packet
+// is pushed out and returned to the caller.
+class PacketRing
+{
+    static const size_t kCapacity = 64;
+
+    AudioPacket* packets[kCapacity];
+    size_t head;
+    size_t count;
+
+    AudioPacket*& At(size_t index)
+    {
+        return packets[(head + index) % kCapacity];
+    }
+
+public:
+    PacketRing() : head(0), count(0) {}
+
+    PacketRing(const PacketRing&) = delete;
+    PacketRing& operator=(const PacketRing&) = delete;
+
+    AudioPacket* Insert(AudioPacket* packet)
+    {
+        AudioPacket* evicted = nullptr;
+        if (count == kCapacity)
+            evicted = PopFront();
+
+        size_t index = count;
+        while (index > 0 && At(index - 1)->timestamp > packet->timestamp)
+        {
+            At(index) = At(index - 1);
+            index--;
+        }
+        At(index) = packet;
+        count++;
+        return evicted;
+    }
+
+    AudioPacket* Front()
+    {
+        return count > 0 ? packets[head] : nullptr;
+    }
+
+    AudioPacket* PopFront()
+    {
+        if (count == 0)
+            return nullptr;
+        AudioPacket* packet = packets[head];
+        head = (head + 1) % kCapacity;
+        count--;
+        return packet;
+    }
+
+    void Clear(PacketPool& pool)
+    {
+        while (count > 0)
+            pool.Release(PopFront());
+        head = 0;
+    }
+
+    size_t Size() const { return count; }
+};
+
+// Recycles the byte buffers handed to the send path. A buffer returns to the
+// pool when its last reference drops, which is once the quest carrying it has
+// been serialized, so steady-state capture keeps reusing the same allocations.
+class BufferPool : public enable_shared_from_this<BufferPool>
+{
+    static const size_t kMaxSpare = 16;
+
+    mutex poolMutex;
+    vector<vector<unsigned char>*> spare;
+
+    void Release(vector<unsigned char>* buffer)
+    {
+        {
+            unique_lock<mutex> lck(poolMutex);
+            if (spare.size() < kMaxSpare)
+            {
+                spare.push_back(buffer);
+                return;
+            }
+        }
+        delete buffer;
+    }
+
+public:
+    BufferPool() {}
+
+    ~BufferPool()
+    {
+        for (auto buffer : spare)
+            delete buffer;
+    }
+
+    BufferPool(const BufferPool&) = delete;
+    BufferPool& operator=(const BufferPool&) = delete;
+
+    // must be owned by a shared_ptr; buffers outliving the pool are simply freed
+    shared_ptr<vector<unsigned char>> Acquire(size_t size)
+    {
+        vector<unsigned char>* buffer = nullptr;
+        {
+            unique_lock<mutex> lck(poolMutex);
+            if (spare.size() > 0)
+            {
+                buffer = spare.back();
+                spare.pop_back();
+            }
+        }
+        if (buffer == nullptr)
+            buffer = new vector<unsigned char>();
+        buffer->resize(size);
+
+        weak_ptr<BufferPool> pool = shared_from_this();
+        return shared_ptr<vector<unsigned char>>(buffer, [pool](vector<unsigned char>* released) {
+            shared_ptr<BufferPool> owner = pool.lock();
+            if (owner)
+                owner->Release(released);
+            else
+                delete released;
+        });
+    }
+};
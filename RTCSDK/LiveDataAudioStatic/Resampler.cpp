@@ -0,0 +1,363 @@
+#include "Resampler.h"
+
+#include <intrin.h>
+#include <immintrin.h>
+#include <math.h>
+#include <string.h>
+
+namespace
+{
+    const int32_t kBaseTaps = 48;
+    const double kBandwidth = 0.9;
+    const double kKaiserBeta = 7.0;
+    const double kPi = 3.14159265358979323846;
+    const float kSurroundGain = 0.7071f;   // -3 dB for centre and surround channels folded into a side
+
+    int32_t Gcd(int32_t a, int32_t b)
+    {
+        while (b != 0)
+        {
+            int32_t t = a % b;
+            a = b;
+            b = t;
+        }
+        return a;
+    }
+
+    double BesselI0(double x)
+    {
+        double sum = 1.0;
+        double term = 1.0;
+        double half = x / 2.0;
+        for (int k = 1; k < 64; k++)
+        {
+            term *= (half / k) * (half / k);
+            sum += term;
+            if (term < sum * 1e-12)
+                break;
+        }
+        return sum;
+    }
+
+    bool CpuSupportsAVX()
+    {
+        int info[4] = { 0 };
+        __cpuid(info, 1);
+        bool osxsave = (info[2] & (1 << 27)) != 0;
+        bool avx = (info[2] & (1 << 28)) != 0;
+        if (!osxsave || !avx)
+            return false;
+        return (_xgetbv(0) & 0x6) == 0x6;
+    }
+
+    // Share of input channel in that goes to stereo side out (0 left, 1 right).
+    // 5.1 and 7.1 follow the WAVEFORMATEXTENSIBLE order (FL FR FC LFE BL BR
+    // SL SR): centre to both sides, LFE dropped. Other counts, such as mic
+    // arrays, alternate between the sides.
+    float StereoWeight(int32_t inChannels, int32_t in, int32_t out)
+    {
+        if (inChannels == 6 || inChannels == 8)
+        {
+            if (in == 2)
+                return kSurroundGain;
+            if (in == 3)
+                return 0.0f;
+            if (in < 2)
+                return in == out ? 1.0f : 0.0f;
+            return (in % 2) == out ? kSurroundGain : 0.0f;
+        }
+        return (in % 2) == out ? 1.0f : 0.0f;
+    }
+
+    inline float DotSSE(const float* coeff, const float* data, int32_t taps)
+    {
+        __m128 acc0 = _mm_setzero_ps();
+        __m128 acc1 = _mm_setzero_ps();
+        for (int32_t i = 0; i < taps; i += 8)
+        {
+            acc0 = _mm_add_ps(acc0, _mm_mul_ps(_mm_load_ps(coeff + i), _mm_loadu_ps(data + i)));
+            acc1 = _mm_add_ps(acc1, _mm_mul_ps(_mm_load_ps(coeff + i + 4), _mm_loadu_ps(data + i + 4)));
+        }
+        acc0 = _mm_add_ps(acc0, acc1);
+        acc0 = _mm_add_ps(acc0, _mm_movehl_ps(acc0, acc0));
+        acc0 = _mm_add_ss(acc0, _mm_shuffle_ps(acc0, acc0, 1));
+        return _mm_cvtss_f32(acc0);
+    }
+
+    inline float DotAVX(const float* coeff, const float* data, int32_t taps)
+    {
+        __m256 acc = _mm256_setzero_ps();
+        for (int32_t i = 0; i < taps; i += 8)
+        {
+            acc = _mm256_add_ps(acc, _mm256_mul_ps(_mm256_load_ps(coeff + i), _mm256_loadu_ps(data + i)));
+        }
+        __m128 sum = _mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+        sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+        sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+        return _mm_cvtss_f32(sum);
+    }
+}
+
+Resampler::Resampler(int32_t inRate, int32_t outRate, int32_t inChannels, int32_t outChannels) :
+    inRate(inRate),
+    outRate(outRate),
+    inChannels(inChannels),
+    outChannels(outChannels),
+    coeffs(nullptr),
+    downmix(nullptr),
+    history(nullptr),
+    historyLength(0),
+    historyCapacity(0),
+    position(0),
+    phase(0)
+{
+    channels = inChannels < outChannels ? inChannels : outChannels;
+    if (inChannels > channels && channels > 1)
+    {
+        // each output side is normalized so a full-scale input can't clip
+        downmix = new float[channels * inChannels];
+        for (int32_t c = 0; c < channels; c++)
+        {
+            float sum = 0.0f;
+            for (int32_t i = 0; i < inChannels; i++)
+            {
+                downmix[c * inChannels + i] = channels == 2 ? StereoWeight(inChannels, i, c) : (i % channels == c ? 1.0f : 0.0f);
+                sum += downmix[c * inChannels + i];
+            }
+            for (int32_t i = 0; i < inChannels; i++)
+                downmix[c * inChannels + i] /= sum;
+        }
+    }
+
+    int32_t g = Gcd(inRate, outRate);
+    upFactor = outRate / g;
+    downFactor = inRate / g;
+
+    if (IsPassthrough())
+    {
+        taps = 1;
+    }
+    else
+    {
+        double scale = upFactor < downFactor ? double(upFactor) / downFactor : 1.0;
+        taps = int32_t(ceil(kBaseTaps / scale));
+        taps = (taps + 7) & ~7;
+    }
+
+    useAVX = CpuSupportsAVX();
+
+    history = new float* [channels];
+    for (int32_t c = 0; c < channels; c++)
+        history[c] = nullptr;
+
+    if (!IsPassthrough())
+        BuildFilter();
+    EnsureCapacity(size_t(inRate) * 20 / 1000);
+    Reset();
+}
+
+Resampler::~Resampler()
+{
+    if (coeffs)
+        _mm_free(coeffs);
+    delete[] downmix;
+    for (int32_t c = 0; c < channels; c++)
+    {
+        if (history[c])
+            _mm_free(history[c]);
+    }
+    delete[] history;
+}
+
+void Resampler::BuildFilter()
+{
+    int32_t length = upFactor * taps;
+    double cutoff = 0.5 * kBandwidth * (upFactor < downFactor ? double(upFactor) / downFactor : 1.0) / upFactor;
+    double center = (length - 1) / 2.0;
+    double norm = BesselI0(kKaiserBeta);
+
+    coeffs = (float*)_mm_malloc(sizeof(float) * length, 32);
+    for (int32_t p = 0; p < upFactor; p++)
+    {
+        for (int32_t j = 0; j < taps; j++)
+        {
+            int32_t n = p + j * upFactor;
+            double t = n - center;
+            double sinc = t == 0.0 ? 2.0 * cutoff : sin(2.0 * kPi * cutoff * t) / (kPi * t);
+            double r = 2.0 * n / (length - 1) - 1.0;
+            double window = BesselI0(kKaiserBeta * sqrt(1.0 - r * r)) / norm;
+            // taps are stored reversed so the dot product walks the history forward
+            coeffs[p * taps + (taps - 1 - j)] = float(sinc * window * upFactor);
+        }
+    }
+}
+
+void Resampler::EnsureCapacity(size_t inputFrames)
+{
+    size_t needed = (historyLength > size_t(taps) ? historyLength : taps) + inputFrames + 8;
+    if (needed <= historyCapacity)
+        return;
+
+    for (int32_t c = 0; c < channels; c++)
+    {
+        float* buffer = (float*)_mm_malloc(sizeof(float) * needed, 32);
+        memset(buffer, 0, sizeof(float) * needed);
+        if (history[c])
+        {
+            memcpy(buffer, history[c], sizeof(float) * historyLength);
+            _mm_free(history[c]);
+        }
+        history[c] = buffer;
+    }
+    historyCapacity = needed;
+}
+
+void Resampler::Reset()
+{
+    for (int32_t c = 0; c < channels; c++)
+        memset(history[c], 0, sizeof(float) * historyCapacity);
+    historyLength = IsPassthrough() ? 0 : taps - 1;
+    position = 0;
+    phase = 0;
+}
+
+size_t Resampler::MaxOutputFrames(size_t inputFrames) const
+{
+    return (inputFrames * upFactor + downFactor - 1) / downFactor + 1;
+}
+
+void Resampler::FoldInput(const float* input, size_t inputFrames)
+{
+    if (channels == inChannels)
+    {
+        if (channels == 1)
+        {
+            memcpy(history[0] + historyLength, input, sizeof(float) * inputFrames);
+        }
+        else
+        {
+            for (size_t i = 0; i < inputFrames; i++)
+            {
+                for (int32_t c = 0; c < channels; c++)
+                    history[c][historyLength + i] = input[i * inChannels + c];
+            }
+        }
+    }
+    else if (channels > 1)
+    {
+        for (size_t i = 0; i < inputFrames; i++)
+        {
+            const float* frame = input + i * inChannels;
+            for (int32_t c = 0; c < channels; c++)
+            {
+                const float* weights = downmix + c * inChannels;
+                float sum = 0.0f;
+                for (int32_t j = 0; j < inChannels; j++)
+                    sum += frame[j] * weights[j];
+                history[c][historyLength + i] = sum;
+            }
+        }
+    }
+    else
+    {
+        float gain = 1.0f / inChannels;
+        float* dst = history[0] + historyLength;
+        if (inChannels == 2)
+        {
+            for (size_t i = 0; i < inputFrames; i++)
+                dst[i] = (input[i * 2] + input[i * 2 + 1]) * 0.5f;
+        }
+        else
+        {
+            for (size_t i = 0; i < inputFrames; i++)
+            {
+                float sum = 0.0f;
+                for (int32_t c = 0; c < inChannels; c++)
+                    sum += input[i * inChannels + c];
+                dst[i] = sum * gain;
+            }
+        }
+    }
+    historyLength += inputFrames;
+}
+
+void Resampler::UnfoldOutput(float* output, size_t frames)
+{
+    if (channels == outChannels)
+    {
+        if (channels == 1)
+        {
+            memcpy(output, history[0], sizeof(float) * frames);
+        }
+        else
+        {
+            for (size_t i = 0; i < frames; i++)
+            {
+                for (int32_t c = 0; c < channels; c++)
+                    output[i * outChannels + c] = history[c][i];
+            }
+        }
+    }
+    else
+    {
+        for (size_t i = 0; i < frames; i++)
+        {
+            for (int32_t c = 0; c < outChannels; c++)
+                output[i * outChannels + c] = history[c % channels][i];
+        }
+    }
+}
+
+size_t Resampler::Process(const float* input, size_t inputFrames, float* output, size_t outputFrames)
+{
+    EnsureCapacity(inputFrames);
+    FoldInput(input, inputFrames);
+
+    if (IsPassthrough())
+    {
+        size_t frames = inputFrames < outputFrames ? inputFrames : outputFrames;
+        UnfoldOutput(output, frames);
+        historyLength = 0;
+        return frames;
+    }
+
+    size_t generated = 0;
+    if (channels == outChannels && channels == 1)
+    {
+        const float* src = history[0];
+        while (generated < outputFrames && position + taps <= historyLength)
+        {
+            const float* coeff = coeffs + phase * taps;
+            output[generated++] = useAVX ? DotAVX(coeff, src + position, taps) : DotSSE(coeff, src + position, taps);
+            phase += downFactor;
+            position += phase / upFactor;
+            phase %= upFactor;
+        }
+    }
+    else
+    {
+        while (generated < outputFrames && position + taps <= historyLength)
+        {
+            const float* coeff = coeffs + phase * taps;
+            float* dst = output + generated * outChannels;
+            for (int32_t c = 0; c < channels; c++)
+            {
+                dst[c] = useAVX ? DotAVX(coeff, history[c] + position, taps) : DotSSE(coeff, history[c] + position, taps);
+            }
+            for (int32_t o = channels; o < outChannels; o++)
+                dst[o] = dst[o % channels];
+            generated++;
+            phase += downFactor;
+            position += phase / upFactor;
+            phase %= upFactor;
+        }
+    }
+
+    size_t remain = historyLength - position;
+    for (int32_t c = 0; c < channels; c++)
+        memmove(history[c], history[c] + position, sizeof(float) * remain);
+    historyLength = remain;
+    position = 0;
+
+    return generated;
+}
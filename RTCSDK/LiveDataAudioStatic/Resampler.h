@@ -0,0 +1,55 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+
+// Fixed-ratio polyphase resampler for interleaved float PCM.
+// The ratio is reduced to L/M once and the per-phase filter taps are built
+// in the constructor, so Process() only does dot products (AVX/SSE).
+// Channel folding is done on the way in/out so callers don't need their own
+// loops: extra input channels are downmixed to the output count (to mono by
+// averaging, to stereo by side), missing output channels are copies.
+class Resampler
+{
+	int32_t inRate;
+	int32_t outRate;
+	int32_t inChannels;
+	int32_t outChannels;
+	int32_t channels;	// channels actually filtered, the smaller of the two
+	float* downmix;		// channels * inChannels weights, only when inChannels > channels
+
+	int32_t upFactor;	// L
+	int32_t downFactor;	// M
+	int32_t taps;		// taps per phase, multiple of 8
+	float* coeffs;		// upFactor * taps, 32-byte aligned
+
+	float** history;	// per channel, taps - 1 + maxInputFrames
+	size_t historyLength;
+	size_t historyCapacity;
+	size_t position;
+	int32_t phase;
+
+	bool useAVX;
+
+	void BuildFilter();
+	void EnsureCapacity(size_t inputFrames);
+	void FoldInput(const float* input, size_t inputFrames);
+	void UnfoldOutput(float* output, size_t frames);
+
+public:
+	Resampler(int32_t inRate, int32_t outRate, int32_t inChannels, int32_t outChannels);
+	~Resampler();
+
+	Resampler(const Resampler&) = delete;
+	Resampler& operator=(const Resampler&) = delete;
+
+	// Returns generated output frames (never more than outputFrames).
+	size_t Process(const float* input, size_t inputFrames, float* output, size_t outputFrames);
+	void Reset();
+
+	size_t MaxOutputFrames(size_t inputFrames) const;
+	int32_t InputRate() const { return inRate; }
+	int32_t OutputRate() const { return outRate; }
+	int32_t InputChannels() const { return inChannels; }
+	int32_t OutputChannels() const { return outChannels; }
+	bool IsPassthrough() const { return upFactor == 1 && downFactor == 1; }
+};
@@ -10,7 +10,6 @@
 #include <memory.h>
 #include <tchar.h>
 
-#include <samplerate.h>
 #include <opus.h>
 
 
@@ -0,0 +1,204 @@
+// MediaSocketBench.cpp : loopback send rate of MediaSocket (Registered I/O) against the UDPClient quest path.
+// Both send the voice packet RTCClient::SendAudioData builds, a media header and a 160 byte payload,
+// to a plain socket on 127.0.0.1 that only counts what arrives. The sender runs flat out for a few
+// seconds; the report is packets a second and packets per CPU second of the sending side, which is
+// the process's CPU time minus the sink thread's.
+
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <stdio.h>
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+#include <UDPClient.h>
+#include "MediaHeader.h"
+#include "MediaSocket.h"
+
+using namespace std;
+using namespace fpnn;
+
+namespace
+{
+    const int32_t kSeconds = 5;
+    const size_t kPayload = 160;            // a 20 ms Opus frame at voice bitrates
+    const int32_t kBurst = 64;              // packets between clock checks
+    const int kReceiveBuffer = 4 << 20;
+
+    struct Sink
+    {
+        SOCKET socket = INVALID_SOCKET;
+        unsigned short port = 0;
+        atomic<bool> running = true;
+        atomic<int64_t> datagrams = 0;
+        atomic<int64_t> bytes = 0;
+        thread worker;
+
+        bool Start()
+        {
+            socket = ::socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+            sockaddr_in address = {};
+            address.sin_family = AF_INET;
+            address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            int length = sizeof(address);
+            if (socket == INVALID_SOCKET
+                || setsockopt(socket, SOL_SOCKET, SO_RCVBUF, (const char*)&kReceiveBuffer, sizeof(kReceiveBuffer)) != 0
+                || bind(socket, (sockaddr*)&address, sizeof(address)) != 0
+                || getsockname(socket, (sockaddr*)&address, &length) != 0)
+            {
+                fprintf(stderr, "sink socket failed (%d)\n", WSAGetLastError());
+                return false;
+            }
+            port = ntohs(address.sin_port);
+            DWORD timeout = 100;
+            setsockopt(socket, SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeout, sizeof(timeout));
+            worker = thread([this]() {
+                char buffer[2048];
+                while (running)
+                {
+                    int received = recv(socket, buffer, sizeof(buffer), 0);
+                    if (received > 0)
+                    {
+                        datagrams++;
+                        bytes += received;
+                    }
+                }
+                });
+            return true;
+        }
+
+        void Stop()
+        {
+            running = false;
+            if (worker.joinable())
+                worker.join();
+            if (socket != INVALID_SOCKET)
+                closesocket(socket);
+        }
+
+        int64_t CpuTime()
+        {
+            FILETIME created, exited, kernel, user;
+            GetThreadTimes(worker.native_handle(), &created, &exited, &kernel, &user);
+            return ToMicroseconds(kernel) + ToMicroseconds(user);
+        }
+
+        static int64_t ToMicroseconds(const FILETIME& time)
+        {
+            return (((int64_t)time.dwHighDateTime << 32) | time.dwLowDateTime) / 10;
+        }
+    };
+
+    int64_t ProcessCpuTime()
+    {
+        FILETIME created, exited, kernel, user;
+        GetProcessTimes(GetCurrentProcess(), &created, &exited, &kernel, &user);
+        return Sink::ToMicroseconds(kernel) + Sink::ToMicroseconds(user);
+    }
+
+    struct Result
+    {
+        int64_t accepted = 0;       // taken by the sender
+        int64_t refused = 0;        // MediaSocket ring full, retried after a yield
+        int64_t datagrams = 0;      // seen by the sink
+        int64_t bytes = 0;
+        double seconds = 0;
+        double cpuSeconds = 0;      // sending side
+    };
+
+    // send returns false when the packet wasn't taken
+    template <typename SendFunction>
+    Result Run(Sink& sink, SendFunction send)
+    {
+        Result result;
+        int64_t datagrams = sink.datagrams;
+        int64_t bytes = sink.bytes;
+        int64_t cpu = ProcessCpuTime() - sink.CpuTime();
+        auto start = chrono::steady_clock::now();
+        auto end = start + chrono::seconds(kSeconds);
+        while (chrono::steady_clock::now() < end)
+        {
+            for (int32_t i = 0; i < kBurst; i++)
+            {
+                if (send(result.accepted))
+                    result.accepted++;
+                else
+                {
+                    result.refused++;
+                    this_thread::yield();
+                }
+            }
+        }
+        // whatever is still queued gets its chance to arrive
+        this_thread::sleep_for(chrono::milliseconds(500));
+        result.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        result.cpuSeconds = (ProcessCpuTime() - sink.CpuTime() - cpu) / 1000000.0;
+        result.datagrams = sink.datagrams - datagrams;
+        result.bytes = sink.bytes - bytes;
+        return result;
+    }
+
+    void Print(const char* name, const Result& result)
+    {
+        printf("%-12s %10.0f packets/s sent  %10.0f datagrams/s arrived  %8.1f MB/s  %10.0f packets per CPU second",
+            name, result.accepted / result.seconds, result.datagrams / result.seconds,
+            result.bytes / result.seconds / 1000000, result.cpuSeconds > 0 ? result.accepted / result.cpuSeconds : 0);
+        if (result.refused > 0)
+            printf("  (%lld refused)", (long long)result.refused);
+        printf("\n");
+    }
+}
+
+int main()
+{
+    WSADATA data;
+    if (WSAStartup(MAKEWORD(2, 2), &data) != 0)
+        return 1;
+
+    Sink sink;
+    if (!sink.Start())
+        return 1;
+    printf("loopback sink on 127.0.0.1:%d, %d s per path, %zu byte payloads\n", sink.port, kSeconds, kPayload);
+
+    unsigned char payload[kPayload] = { 0 };
+
+    {
+        MediaSocket socket([](vector<MediaSocket::Datagram>& burst) {});
+        if (socket.Open("127.0.0.1", sink.port, 1))
+        {
+            Result result = Run(sink, [&](int64_t seq) {
+                MediaHeader header;
+                PackVoiceHeader(header, 1, seq, seq * 20);
+                return socket.Send(&header, sizeof(header), payload, sizeof(payload));
+                });
+            Print("MediaSocket", result);
+            MediaSocket::Stats stats = socket.GetStats();
+            printf("             %lld sent in %lld batches, %lld dropped\n",
+                (long long)stats.sent, (long long)stats.sendBatches, (long long)stats.dropped);
+            socket.Close();
+        }
+        else
+            printf("MediaSocket  not available\n");
+    }
+
+    {
+        // the same quest the pacer hands to sendQuest when the media socket is off
+        ClientPtr client = UDPClient::createClient("127.0.0.1", sink.port);
+        client->connect();
+        Result result = Run(sink, [&](int64_t seq) {
+            MediaHeader header;
+            PackVoiceHeader(header, 1, seq, seq * 20);
+            FPQWriter qw(2, "voice", true);
+            qw.paramBinary("m", &header, sizeof(header));
+            qw.paramBinary("data", payload, sizeof(payload));
+            client->sendQuest(qw.take());
+            return true;
+            });
+        Print("UDPClient", result);
+        client->close();
+    }
+
+    sink.Stop();
+    WSACleanup();
+    return 0;
+}
@@ -51,6 +51,26 @@ namespace RTCCLISDK
 		implement->OnRoomEvent(rid, (int32_t)roomEvent, eventData);
 	}
 
+	void BridgeRTCEventHandler::OnNetworkQuality(NetworkQuality uplink, NetworkQuality downlink)
+	{
+		implement->OnNetworkQuality((int32_t)uplink, (int32_t)downlink);
+	}
+
+	void BridgeRTCEventHandler::OnKeyFrameRequest(int64_t rid, int64_t fromUid)
+	{
+		implement->OnKeyFrameRequest(rid, fromUid);
+	}
+
+	void BridgeRTCEventHandler::OnVideoTileChanged(int32_t tile, int64_t uid)
+	{
+		implement->OnVideoTileChanged(tile, uid);
+	}
+
+	void BridgeRTCEventHandler::OnRosterChanged(int64_t rid, int64_t uid, RosterChange change, int64_t version)
+	{
+		implement->OnRosterChanged(rid, uid, (int32_t)change, version);
+	}
+
 	CLIRTCEventHandler::CLIRTCEventHandler()
 	{
 		throw gcnew System::NotImplementedException();
@@ -100,4 +120,24 @@ namespace RTCCLISDK
 	{
 		throw gcnew System::NotImplementedException();
 	}
+
+	void CLIRTCEventHandler::OnNetworkQuality(int32_t uplink, int32_t downlink)
+	{
+		throw gcnew System::NotImplementedException();
+	}
+
+	void CLIRTCEventHandler::OnKeyFrameRequest(int64_t rid, int64_t fromUid)
+	{
+		throw gcnew System::NotImplementedException();
+	}
+
+	void CLIRTCEventHandler::OnVideoTileChanged(int32_t tile, int64_t uid)
+	{
+		throw gcnew System::NotImplementedException();
+	}
+
+	void CLIRTCEventHandler::OnRosterChanged(int64_t rid, int64_t uid, int32_t change, int64_t version)
+	{
+		throw gcnew System::NotImplementedException();
+	}
 }
\ No newline at end of file
@@ -18,6 +18,10 @@ namespace RTCCLISDK
 		virtual void OnPullIntoRTCRoom(int64_t rid, string token);
 		virtual void OnAdminCommand(int32_t command, vector<int64_t> uids);
 		virtual void OnRoomEvent(int64_t rid, int32_t roomEvent, vector<unsigned char>eventData);
+		virtual void OnNetworkQuality(int32_t uplink, int32_t downlink);
+		virtual void OnKeyFrameRequest(int64_t rid, int64_t fromUid);
+		virtual void OnVideoTileChanged(int32_t tile, int64_t uid);
+		virtual void OnRosterChanged(int64_t rid, int64_t uid, int32_t change, int64_t version);
 	};
 
 
@@ -36,5 +40,9 @@ namespace RTCCLISDK
 		virtual void OnPullIntoRTCRoom(int64_t rid, string token) override;
 		virtual void OnAdminCommand(AdminCommand command, vector<int64_t> uids) override;
 		virtual void OnRoomEvent(int64_t rid, RoomEvent roomEvent, vector<unsigned char>eventData) override;
+		virtual void OnNetworkQuality(NetworkQuality uplink, NetworkQuality downlink) override;
+		virtual void OnKeyFrameRequest(int64_t rid, int64_t fromUid) override;
+		virtual void OnVideoTileChanged(int32_t tile, int64_t uid) override;
+		virtual void OnRosterChanged(int64_t rid, int64_t uid, RosterChange change, int64_t version) override;
 	};
 }
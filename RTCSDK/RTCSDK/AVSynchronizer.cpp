@@ -0,0 +1,100 @@
+#include "AVSynchronizer.h"
+
+#include <stdlib.h>
+
+namespace
+{
+    const int64_t kAudioOutputLatency = 30;   // WASAPI engine latency used by AudioPlayer
+    const int64_t kAudioClockTimeout = 500;   // speaker went quiet, free-run video
+    const int64_t kUnrelatedSkew = 2000;      // clocks too far apart to be the same sender clock
+    const int64_t kNudgeInterval = 1000;
+    const int32_t kFrameDuration = 20;
+    const int32_t kMaxAudioDelay = 200;
+}
+
+AVSynchronizer::AVSynchronizer(int32_t maxLead, int32_t maxLag) :
+    maxLead(maxLead),
+    maxLag(maxLag)
+{
+}
+
+void AVSynchronizer::UpdateAudioClock(int64_t timestamp, int64_t playTime)
+{
+    unique_lock<mutex> lck(statsMutex);
+    audioTimestamp = timestamp;
+    audioPlayTime = playTime;
+}
+
+AVSynchronizer::Action AVSynchronizer::Check(int64_t videoTimestamp, int64_t now)
+{
+    unique_lock<mutex> lck(statsMutex);
+    if (audioPlayTime == 0 || now - audioPlayTime > kAudioClockTimeout)
+    {
+        stats.synced = false;
+        return Action::Present;
+    }
+
+    int64_t audioNow = audioTimestamp + (now - audioPlayTime) - kAudioOutputLatency;
+    int64_t skew = videoTimestamp - audioNow;
+    if (llabs(skew) > kUnrelatedSkew)
+    {
+        stats.synced = false;
+        return Action::Present;
+    }
+
+    stats.synced = true;
+    stats.skew = skew;
+    stats.averageSkew += (skew - stats.averageSkew) / 8;
+    if (llabs(skew) > stats.maxSkew)
+        stats.maxSkew = llabs(skew);
+
+    if (now - lastNudgeTime > kNudgeInterval)
+    {
+        // dropping can only catch video up to what has arrived; if it still
+        // trails, the audio has to wait for it
+        if (stats.averageSkew < -maxLag && stats.audioDelay < kMaxAudioDelay)
+        {
+            stats.audioDelay += kFrameDuration;
+            pendingNudge++;
+            lastNudgeTime = now;
+        }
+        else if (stats.averageSkew > maxLead && stats.audioDelay > 0)
+        {
+            stats.audioDelay -= kFrameDuration;
+            pendingNudge--;
+            lastNudgeTime = now;
+        }
+    }
+
+    if (skew > maxLead)
+    {
+        stats.held++;
+        return Action::Hold;
+    }
+    if (skew < -maxLag)
+        return Action::Drop;
+    return Action::Present;
+}
+
+void AVSynchronizer::OnPresented(bool dropped)
+{
+    unique_lock<mutex> lck(statsMutex);
+    if (dropped)
+        stats.dropped++;
+    else
+        stats.presented++;
+}
+
+int32_t AVSynchronizer::TakeAudioNudge()
+{
+    unique_lock<mutex> lck(statsMutex);
+    int32_t nudge = pendingNudge;
+    pendingNudge = 0;
+    return nudge;
+}
+
+AVSynchronizer::Stats AVSynchronizer::GetStats()
+{
+    unique_lock<mutex> lck(statsMutex);
+    return stats;
+}
@@ -0,0 +1,48 @@
+#pragma once
+#include <stdint.h>
+#include <mutex>
+
+using namespace std;
+
+class AVSynchronizer
+{
+public:
+	enum class Action
+	{
+		Present,
+		Hold,
+		Drop
+	};
+
+	struct Stats
+	{
+		int64_t skew = 0;			// video - audio in ms, last frame
+		int64_t averageSkew = 0;
+		int64_t maxSkew = 0;
+		int64_t presented = 0;
+		int64_t held = 0;
+		int64_t dropped = 0;
+		int32_t audioDelay = 0;		// extra audio delay requested, ms
+		bool synced = false;		// false while there is no audio clock to follow
+	};
+
+	AVSynchronizer(int32_t maxLead = 40, int32_t maxLag = 80);
+
+	void UpdateAudioClock(int64_t timestamp, int64_t playTime);
+	Action Check(int64_t videoTimestamp, int64_t now);
+	void OnPresented(bool dropped);
+	int32_t TakeAudioNudge();
+	Stats GetStats();
+
+private:
+	int32_t maxLead;
+	int32_t maxLag;
+
+	int64_t audioTimestamp = 0;
+	int64_t audioPlayTime = 0;
+	int64_t lastNudgeTime = 0;
+	int32_t pendingNudge = 0;
+
+	Stats stats;
+	mutex statsMutex;
+};
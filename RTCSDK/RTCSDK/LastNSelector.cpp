@@ -0,0 +1,186 @@
+#include "LastNSelector.h"
+#include <algorithm>
+
+namespace
+{
+    const float kSpeechLevel = -50.0f;          // dBFS vu, louder counts as talking
+    const int64_t kSpeechGap = 600;             // ms of quiet that still belongs to the same utterance
+    const int64_t kPromoteDelay = 1000;         // ms a speaker has to talk before taking a tile
+    const int64_t kMinHold = 4000;              // ms a user stays on screen at least
+    const int64_t kForget = 5000;               // ms neither a member nor heard before a user is dropped
+    const int64_t kBlockTime = 10000;           // ms before a user whose subscribe failed is tried again
+}
+
+void LastNSelector::SetVisible(size_t count)
+{
+    unique_lock<mutex> lck(selectorMutex);
+    visible = count;
+}
+
+void LastNSelector::Pin(int64_t uid, bool pin)
+{
+    unique_lock<mutex> lck(selectorMutex);
+    if (pin)
+        pinned.insert(uid);
+    else
+        pinned.erase(uid);
+}
+
+void LastNSelector::Remove(int64_t uid)
+{
+    unique_lock<mutex> lck(selectorMutex);
+    speakers.erase(uid);
+    pinned.erase(uid);
+    blocked.erase(uid);
+    selection.erase(remove(selection.begin(), selection.end(), uid), selection.end());
+}
+
+void LastNSelector::Block(int64_t uid, int64_t now)
+{
+    unique_lock<mutex> lck(selectorMutex);
+    blocked[uid] = now;
+    auto iter = find(selection.begin(), selection.end(), uid);
+    if (iter == selection.end())
+        return;
+    selection.erase(iter);
+    speakers[uid].selectedSince = 0;
+}
+
+int32_t LastNSelector::FindVictim(bool hold, int64_t now)
+{
+    int32_t victim = -1;
+    for (size_t i = 0; i < selection.size(); i++)
+    {
+        if (pinned.count(selection[i]) > 0)
+            continue;
+        Speaker& speaker = speakers[selection[i]];
+        if (hold && now - speaker.selectedSince < kMinHold)
+            continue;
+        if (victim < 0 || speaker.lastSpoke < speakers[selection[victim]].lastSpoke)
+            victim = (int32_t)i;
+    }
+    return victim;
+}
+
+void LastNSelector::Select(int64_t uid, int64_t now)
+{
+    selection.push_back(uid);
+    speakers[uid].selectedSince = now;
+}
+
+vector<int64_t> LastNSelector::Update(const vector<int64_t>& members, const vector<pair<int64_t, float>>& levels, int64_t now)
+{
+    unique_lock<mutex> lck(selectorMutex);
+    for (int64_t uid : members)
+        speakers[uid].heard = now;
+    for (auto& level : levels)
+    {
+        Speaker& speaker = speakers[level.first];
+        speaker.heard = now;
+        if (level.second >= kSpeechLevel)
+        {
+            if (speaker.speechStart == 0)
+                speaker.speechStart = now;
+            speaker.lastSpoke = now;
+        }
+        else if (now - speaker.lastSpoke > kSpeechGap)
+            speaker.speechStart = 0;
+    }
+    for (auto iter = speakers.begin(); iter != speakers.end();)
+    {
+        if (now - iter->second.heard > kForget && pinned.count(iter->first) == 0)
+        {
+            selection.erase(remove(selection.begin(), selection.end(), iter->first), selection.end());
+            iter = speakers.erase(iter);
+        }
+        else
+            ++iter;
+    }
+    for (auto iter = blocked.begin(); iter != blocked.end();)
+    {
+        if (now - iter->second >= kBlockTime)
+            iter = blocked.erase(iter);
+        else
+            ++iter;
+    }
+
+    // pins are explicit, they go on screen right away
+    for (int64_t uid : pinned)
+    {
+        if (blocked.count(uid) > 0 || find(selection.begin(), selection.end(), uid) != selection.end())
+            continue;
+        if (selection.size() < visible)
+        {
+            Select(uid, now);
+            continue;
+        }
+        int32_t victim = FindVictim(false, now);
+        if (victim < 0)
+            continue;
+        speakers[selection[victim]].selectedSince = 0;
+        selection[victim] = uid;
+        speakers[uid].selectedSince = now;
+    }
+    while (selection.size() > visible)
+    {
+        int32_t victim = FindVictim(false, now);
+        if (victim < 0)
+            victim = (int32_t)selection.size() - 1;
+        speakers[selection[victim]].selectedSince = 0;
+        selection.erase(selection.begin() + victim);
+    }
+
+    vector<pair<int64_t, Speaker*>> waiting;
+    for (auto& item : speakers)
+    {
+        if (item.second.selectedSince == 0 && pinned.count(item.first) == 0 && blocked.count(item.first) == 0)
+            waiting.emplace_back(item.first, &item.second);
+    }
+    sort(waiting.begin(), waiting.end(), [](const pair<int64_t, Speaker*>& a, const pair<int64_t, Speaker*>& b) {
+        return a.second->lastSpoke > b.second->lastSpoke;
+        });
+
+    // free tiles are filled at once, silent users too
+    size_t next = 0;
+    for (; next < waiting.size() && selection.size() < visible; next++)
+        Select(waiting[next].first, now);
+
+    // the rest only take a tile from someone quieter once they have talked long enough
+    for (; next < waiting.size(); next++)
+    {
+        Speaker& speaker = *waiting[next].second;
+        if (speaker.speechStart == 0 || now - speaker.speechStart < kPromoteDelay)
+            continue;
+        int32_t victim = FindVictim(true, now);
+        if (victim < 0 || speakers[selection[victim]].lastSpoke >= speaker.speechStart)
+        {
+            stats.held++;
+            continue;
+        }
+        speakers[selection[victim]].selectedSince = 0;
+        selection[victim] = waiting[next].first;
+        speaker.selectedSince = now;
+        stats.switches++;
+    }
+
+    stats.visible = (int32_t)visible;
+    stats.selected = (int32_t)selection.size();
+    stats.candidates = (int32_t)speakers.size();
+    stats.blocked = (int32_t)blocked.size();
+    return selection;
+}
+
+LastNSelector::Stats LastNSelector::GetStats()
+{
+    unique_lock<mutex> lck(selectorMutex);
+    return stats;
+}
+
+void LastNSelector::Reset()
+{
+    unique_lock<mutex> lck(selectorMutex);
+    speakers.clear();
+    selection.clear();
+    blocked.clear();
+    stats = Stats();
+}
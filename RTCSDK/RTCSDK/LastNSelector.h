@@ -0,0 +1,66 @@
+#pragma once
+#include <stdint.h>
+#include <mutex>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+using namespace std;
+
+// Picks whose video a large room shows: pinned users first, then the most
+// recent speakers, at most as many as there are visible tiles. Free tiles go
+// to members who haven't spoken as well, so a quiet room still shows video;
+// audio levels only decide the order. A speaker only
+// displaces someone on screen after talking for a while, and nobody leaves
+// the screen again before a minimum hold, so crosstalk does not make tiles
+// flap.
+class LastNSelector
+{
+public:
+	struct Stats
+	{
+		int32_t visible = 0;
+		int32_t selected = 0;
+		int32_t candidates = 0;		// members and users heard recently
+		int64_t switches = 0;		// speakers that took someone's tile
+		int64_t held = 0;			// times a speaker waited because of the hysteresis
+		int32_t blocked = 0;		// users whose video couldn't be subscribed lately
+	};
+
+	void SetVisible(size_t count);
+	void Pin(int64_t uid, bool pin);
+	// the user left the room
+	void Remove(int64_t uid);
+	// the user's video couldn't be subscribed; off screen and not picked again
+	// for a while, pinned or not
+	void Block(int64_t uid, int64_t now);
+	// the members whose video may be shown and the vu levels (dBFS) of the
+	// remote users heard, every tick; the selection in a stable order, users
+	// already on screen keep their place
+	vector<int64_t> Update(const vector<int64_t>& members, const vector<pair<int64_t, float>>& levels, int64_t now);
+	Stats GetStats();
+	void Reset();
+
+private:
+	struct Speaker
+	{
+		int64_t heard = 0;			// last tick the user was a member or had an audio stream
+		int64_t speechStart = 0;	// 0 while quiet
+		int64_t lastSpoke = 0;
+		int64_t selectedSince = 0;	// 0 when not on screen
+	};
+
+	unordered_map<int64_t, Speaker> speakers;
+	unordered_set<int64_t> pinned;
+	unordered_map<int64_t, int64_t> blocked;	// uid -> when
+	vector<int64_t> selection;
+	size_t visible = 0;
+	Stats stats;
+	mutex selectorMutex;
+
+	// unpinned user on screen that spoke longest ago, -1 when there is none;
+	// with hold set only users past the minimum hold qualify
+	int32_t FindVictim(bool hold, int64_t now);
+	void Select(int64_t uid, int64_t now);
+};
@@ -0,0 +1,73 @@
+#pragma once
+#include <stddef.h>
+#include <memory>
+#include <vector>
+
+using namespace std;
+
+// Read-only view of a received payload that keeps whatever owns the bytes
+// alive (the FPNN reader whose msgpack zone holds them, or a vector). Passing
+// one around only bumps a reference count; slicing shares the same owner.
+class MediaBuffer
+{
+	shared_ptr<const void> owner;
+	const unsigned char* ptr;
+	size_t length;
+
+public:
+	MediaBuffer() : ptr(nullptr), length(0) {}
+
+	MediaBuffer(shared_ptr<const void> owner, const unsigned char* data, size_t length) :
+		owner(move(owner)),
+		ptr(data),
+		length(length)
+	{
+	}
+
+	explicit MediaBuffer(vector<unsigned char>&& data)
+	{
+		auto holder = make_shared<vector<unsigned char>>(move(data));
+		ptr = holder->data();
+		length = holder->size();
+		owner = move(holder);
+	}
+
+	MediaBuffer(const MediaBuffer&) = default;
+	MediaBuffer& operator=(const MediaBuffer&) = default;
+
+	// a moved-from buffer is empty rather than pointing at bytes it no longer owns
+	MediaBuffer(MediaBuffer&& other) noexcept :
+		owner(move(other.owner)),
+		ptr(other.ptr),
+		length(other.length)
+	{
+		other.ptr = nullptr;
+		other.length = 0;
+	}
+
+	MediaBuffer& operator=(MediaBuffer&& other) noexcept
+	{
+		if (this != &other)
+		{
+			owner = move(other.owner);
+			ptr = other.ptr;
+			length = other.length;
+			other.ptr = nullptr;
+			other.length = 0;
+		}
+		return *this;
+	}
+
+	const unsigned char* data() const { return ptr; }
+	size_t size() const { return length; }
+	bool empty() const { return length == 0; }
+
+	MediaBuffer Slice(size_t offset, size_t count) const
+	{
+		if (offset > length)
+			offset = length;
+		if (count > length - offset)
+			count = length - offset;
+		return MediaBuffer(owner, ptr + offset, count);
+	}
+};
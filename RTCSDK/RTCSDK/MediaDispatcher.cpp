@@ -0,0 +1,135 @@
+#include "MediaDispatcher.h"
+#include <algorithm>
+
+namespace
+{
+    const size_t kMaxWorkers = 4;
+    const size_t kMaxDepth = 512;               // about 10 s of voice for one stream
+
+    // spreads uids that differ only in the low bits
+    uint64_t Mix(uint64_t key)
+    {
+        key ^= key >> 33;
+        key *= 0xff51afd7ed558ccdULL;
+        key ^= key >> 33;
+        return key;
+    }
+}
+
+MediaDispatcher::MediaDispatcher(size_t workerCount) :
+    receivePackets(0),
+    receiveTime(0)
+{
+    if (workerCount == 0)
+        workerCount = min(max<size_t>(thread::hardware_concurrency() / 2, 1), kMaxWorkers);
+    for (size_t i = 0; i < workerCount; i++)
+        workers.push_back(make_unique<Worker>());
+    for (auto& worker : workers)
+    {
+        Worker* target = worker.get();
+        worker->runner = thread([this, target]() {Run(*target); });
+    }
+}
+
+MediaDispatcher::~MediaDispatcher()
+{
+    Stop();
+}
+
+void MediaDispatcher::Stop()
+{
+    for (auto& worker : workers)
+    {
+        {
+            unique_lock<mutex> lck(worker->taskMutex);
+            worker->running = false;
+            worker->tasks.clear();
+        }
+        worker->taskCondition.notify_one();
+    }
+    for (auto& worker : workers)
+    {
+        if (worker->runner.joinable())
+            worker->runner.join();
+    }
+}
+
+bool MediaDispatcher::Post(int64_t uid, bool video, function<void()> task)
+{
+    Worker& worker = *workers[Mix(((uint64_t)uid << 1) | (video ? 1 : 0)) % workers.size()];
+    {
+        unique_lock<mutex> lck(worker.taskMutex);
+        if (!worker.running)
+            return false;
+        if (worker.tasks.size() >= kMaxDepth)
+        {
+            worker.stats.dropped++;
+            return false;
+        }
+        worker.tasks.push_back({ move(task), chrono::steady_clock::now() });
+        worker.stats.posted++;
+        worker.stats.maxDepth = max(worker.stats.maxDepth, worker.tasks.size());
+    }
+    worker.taskCondition.notify_one();
+    return true;
+}
+
+void MediaDispatcher::RecordReceive(int64_t packets, int64_t ns)
+{
+    receivePackets += packets;
+    receiveTime += ns;
+}
+
+MediaDispatcher::Stats MediaDispatcher::GetStats()
+{
+    Stats total;
+    total.workers = (int32_t)workers.size();
+    for (auto& worker : workers)
+    {
+        unique_lock<mutex> lck(worker->taskMutex);
+        total.posted += worker->stats.posted;
+        total.executed += worker->stats.executed;
+        total.dropped += worker->stats.dropped;
+        total.maxDepth = max(total.maxDepth, worker->stats.maxDepth);
+        total.maxQueueDelay = max(total.maxQueueDelay, worker->stats.maxQueueDelay);
+        total.busyTime += worker->stats.busyTime;
+    }
+    total.receivePackets = receivePackets;
+    total.receiveTime = receiveTime;
+    return total;
+}
+
+void MediaDispatcher::ResetStats()
+{
+    for (auto& worker : workers)
+    {
+        unique_lock<mutex> lck(worker->taskMutex);
+        worker->stats = Stats();
+    }
+    receivePackets = 0;
+    receiveTime = 0;
+}
+
+void MediaDispatcher::Run(Worker& worker)
+{
+    unique_lock<mutex> lck(worker.taskMutex);
+    while (true)
+    {
+        worker.taskCondition.wait(lck, [&worker]() {return !worker.running || worker.tasks.size() > 0; });
+        if (!worker.running)
+            break;
+
+        Task task = move(worker.tasks.front());
+        worker.tasks.pop_front();
+        lck.unlock();
+        TimePoint start = chrono::steady_clock::now();
+        task.work();
+        TimePoint end = chrono::steady_clock::now();
+        // drop the captured buffers before taking the lock again
+        task.work = nullptr;
+        lck.lock();
+        worker.stats.executed++;
+        worker.stats.maxQueueDelay = max<int64_t>(worker.stats.maxQueueDelay, chrono::duration_cast<chrono::microseconds>(start - task.posted).count());
+        worker.stats.busyTime += chrono::duration_cast<chrono::nanoseconds>(end - start).count();
+    }
+}
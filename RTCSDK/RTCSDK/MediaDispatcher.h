@@ -0,0 +1,73 @@
+#pragma once
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+// Runs incoming media callbacks off the network threads. Every stream (a
+// sender's voice or video) hashes to one worker of a small fixed pool, so a
+// stream's packets are handled one at a time and in arrival order while
+// different streams run in parallel. Each worker has its own queue and lock;
+// posting never waits for a callback to finish.
+class MediaDispatcher
+{
+public:
+	struct Stats
+	{
+		int32_t workers = 0;
+		int64_t posted = 0;
+		int64_t executed = 0;
+		int64_t dropped = 0;			// the worker's queue was full
+		size_t maxDepth = 0;			// deepest any worker queue got
+		int64_t maxQueueDelay = 0;		// us from Post to the callback starting
+		int64_t busyTime = 0;			// ns the workers spent in callbacks
+		int64_t receivePackets = 0;		// handled on the network threads
+		int64_t receiveTime = 0;		// ns the network threads spent on them, parsing and posting
+	};
+
+	// 0 picks a size from the core count
+	MediaDispatcher(size_t workerCount = 0);
+	~MediaDispatcher();
+
+	// false when the stream's worker is too far behind, or stopped, and the task was dropped
+	bool Post(int64_t uid, bool video, function<void()> task);
+	// returns once no task runs any more; queued ones are dropped, later ones refused
+	void Stop();
+	// time a network thread spent on incoming packets, for the occupancy figures
+	void RecordReceive(int64_t packets, int64_t ns);
+	Stats GetStats();
+	void ResetStats();
+
+private:
+	typedef chrono::steady_clock::time_point TimePoint;
+
+	struct Task
+	{
+		function<void()> work;
+		TimePoint posted;
+	};
+
+	struct Worker
+	{
+		deque<Task> tasks;
+		bool running = true;
+		mutex taskMutex;
+		condition_variable taskCondition;
+		thread runner;
+		Stats stats;
+	};
+
+	vector<unique_ptr<Worker>> workers;
+	atomic<int64_t> receivePackets;
+	atomic<int64_t> receiveTime;
+
+	void Run(Worker& worker);
+};
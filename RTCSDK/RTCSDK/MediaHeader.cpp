@@ -0,0 +1,85 @@
+#include "MediaHeader.h"
+
+#include <string.h>
+
+namespace
+{
+    void FillHeader(MediaHeader& header, MediaType type, uint16_t headerLength, int64_t rid, int64_t seq, int64_t flags, int64_t timestamp)
+    {
+        header.version = kMediaHeaderVersion;
+        header.type = (uint8_t)type;
+        header.headerLength = headerLength;
+        header.flags = (uint16_t)flags;
+        header.seq = (uint32_t)seq;
+        header.timestamp = timestamp;
+        header.rid = rid;
+    }
+}
+
+void PackVoiceHeader(MediaHeader& header, int64_t rid, int64_t seq, int64_t timestamp)
+{
+    FillHeader(header, MediaType::Voice, sizeof(MediaHeader), rid, seq, 0, timestamp);
+}
+
+vector<unsigned char> PackVideoHeader(int64_t rid, int64_t seq, int64_t flags, int64_t timestamp, int64_t rotation,
+    int64_t version, int32_t facing, int32_t captureLevel,
+    const unsigned char* sps, size_t spsLength, const unsigned char* pps, size_t ppsLength)
+{
+    const size_t headerLength = sizeof(MediaHeader) + sizeof(VideoHeader);
+    vector<unsigned char> buffer(headerLength + spsLength + ppsLength);
+    MediaHeader header;
+    FillHeader(header, MediaType::Video, headerLength, rid, seq, flags, timestamp);
+    VideoHeader video;
+    video.rotation = (int16_t)rotation;
+    video.facing = (uint8_t)facing;
+    video.captureLevel = (uint8_t)captureLevel;
+    video.version = (uint16_t)version;
+    video.spsLength = (uint16_t)spsLength;
+    video.ppsLength = (uint16_t)ppsLength;
+
+    unsigned char* p = buffer.data();
+    memcpy(p, &header, sizeof(header));
+    memcpy(p + sizeof(header), &video, sizeof(video));
+    p += headerLength;
+    if (spsLength > 0)
+        memcpy(p, sps, spsLength);
+    p += spsLength;
+    if (ppsLength > 0)
+        memcpy(p, pps, ppsLength);
+    return buffer;
+}
+
+bool ParseMedia(const unsigned char* buffer, size_t length, MediaType type, MediaPacket& packet)
+{
+    if (length < sizeof(MediaHeader))
+        return false;
+    memcpy(&packet.header, buffer, sizeof(MediaHeader));
+    if (packet.header.version < kMediaHeaderVersion || packet.header.type != (uint8_t)type)
+        return false;
+
+    size_t minimum = sizeof(MediaHeader) + (type == MediaType::Video ? sizeof(VideoHeader) : 0);
+    size_t headerLength = packet.header.headerLength;
+    if (headerLength < minimum || headerLength > length)
+        return false;
+
+    const unsigned char* payload = buffer + headerLength;
+    size_t payloadLength = length - headerLength;
+    packet.sps = nullptr;
+    packet.pps = nullptr;
+    memset(&packet.video, 0, sizeof(VideoHeader));
+    if (type == MediaType::Video)
+    {
+        // common fields a newer sender adds sit in between, the extension ends the header
+        memcpy(&packet.video, payload - sizeof(VideoHeader), sizeof(VideoHeader));
+        size_t parameterLength = size_t(packet.video.spsLength) + packet.video.ppsLength;
+        if (parameterLength > payloadLength)
+            return false;
+        packet.sps = payload;
+        packet.pps = payload + packet.video.spsLength;
+        payload += parameterLength;
+        payloadLength -= parameterLength;
+    }
+    packet.data = payload;
+    packet.dataLength = payloadLength;
+    return true;
+}
@@ -0,0 +1,65 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+using namespace std;
+
+// Fixed-layout header for media quests. When the gate answers enterRTCRoom
+// with "mediaHeader" >= kMediaHeaderVersion, voice/video quests carry the
+// header (and sps/pps) as one binary field "m" and the payload as "data",
+// instead of a msgpack key per field. A payload may also trail the header
+// inside "m". Fields are little-endian; headerLength lets later versions
+// append fields. Fields added to MediaHeader go right after it and before
+// the video extension, which always ends the header, so a parser finds the
+// extension from headerLength whatever the version. Fields for the video
+// extension itself need a new version.
+const uint8_t kMediaHeaderVersion = 1;
+
+enum class MediaType : uint8_t
+{
+	Voice = 0,
+	Video = 1
+};
+
+#pragma pack(push, 1)
+struct MediaHeader
+{
+	uint8_t version;
+	uint8_t type;
+	uint16_t headerLength;	// bytes before the payload, video extension included
+	uint16_t flags;
+	uint32_t seq;
+	int64_t timestamp;
+	int64_t rid;			// 0 on p2p calls
+};
+
+// the last sizeof(VideoHeader) bytes of a video header
+struct VideoHeader
+{
+	int16_t rotation;
+	uint8_t facing;
+	uint8_t captureLevel;
+	uint16_t version;
+	uint16_t spsLength;		// sps and pps precede the frame data
+	uint16_t ppsLength;
+};
+#pragma pack(pop)
+
+// Points into the buffer passed to ParseMedia.
+struct MediaPacket
+{
+	MediaHeader header;
+	VideoHeader video;
+	const unsigned char* sps;
+	const unsigned char* pps;
+	const unsigned char* data;
+	size_t dataLength;
+};
+
+void PackVoiceHeader(MediaHeader& header, int64_t rid, int64_t seq, int64_t timestamp);
+// header, video extension, sps and pps; the frame data goes out separately
+vector<unsigned char> PackVideoHeader(int64_t rid, int64_t seq, int64_t flags, int64_t timestamp, int64_t rotation,
+	int64_t version, int32_t facing, int32_t captureLevel,
+	const unsigned char* sps, size_t spsLength, const unsigned char* pps, size_t ppsLength);
+bool ParseMedia(const unsigned char* buffer, size_t length, MediaType type, MediaPacket& packet);
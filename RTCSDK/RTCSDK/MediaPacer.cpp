@@ -0,0 +1,212 @@
+#include "MediaPacer.h"
+
+namespace
+{
+    const int64_t kBurstMs = 20;                // budget that may build up while idle
+    const int64_t kMinBurstBytes = 4000;
+    const int64_t kCongestedDelay = 150;        // ms, start dropping non-reference frames
+    const int64_t kMaxVideoDelay = 1000;        // ms, give up on the queue until the next keyframe
+    const int32_t kMinBitrate = 64;
+
+    int64_t ElapsedMs(chrono::steady_clock::time_point from, chrono::steady_clock::time_point to)
+    {
+        return chrono::duration_cast<chrono::milliseconds>(to - from).count();
+    }
+}
+
+MediaPacer::MediaPacer(ClientPtr client, int32_t bitrate) :
+    client(client),
+    bitrate(max(bitrate, kMinBitrate)),
+    budget(0),
+    lastRefill(chrono::steady_clock::now())
+{
+    stats.bitrate = this->bitrate;
+    sender = thread([this]() {Run(); });
+}
+
+MediaPacer::~MediaPacer()
+{
+    {
+        unique_lock<mutex> lck(queueMutex);
+        running = false;
+    }
+    queueCondition.notify_one();
+    sender.join();
+}
+
+bool MediaPacer::IsReferenceFrame(const unsigned char* data, size_t length)
+{
+    bool found = false;
+    for (size_t i = 0; i + 3 < length; i++)
+    {
+        if (data[i] != 0 || data[i + 1] != 0 || data[i + 2] != 1)
+            continue;
+        found = true;
+        if ((data[i + 3] & 0x60) != 0)
+            return true;
+        i += 3;
+    }
+    // not Annex-B, can't tell
+    return !found;
+}
+
+void MediaPacer::SendAudio(FPQuestPtr quest, size_t bytes)
+{
+    {
+        unique_lock<mutex> lck(queueMutex);
+        audio.push_back({ quest, bytes, true, chrono::steady_clock::now() });
+    }
+    queueCondition.notify_one();
+}
+
+void MediaPacer::SendVideo(FPQuestPtr quest, size_t bytes, bool reference, bool keyframe)
+{
+    {
+        unique_lock<mutex> lck(queueMutex);
+        TimePoint now = chrono::steady_clock::now();
+        Refill(now);
+        stats.videoFrames++;
+        int64_t queueDelay = video.size() > 0 ? ElapsedMs(video.front().enqueued, now) : 0;
+
+        if (keyframe)
+        {
+            // everything still queued is superseded once it can't keep up
+            if (waitKeyframe || queueDelay > kCongestedDelay)
+            {
+                stats.videoDropped += video.size();
+                video.clear();
+            }
+            waitKeyframe = false;
+        }
+        else if (waitKeyframe)
+        {
+            stats.videoDropped++;
+            return;
+        }
+        else if (queueDelay > kMaxVideoDelay)
+        {
+            stats.videoDropped += video.size() + 1;
+            video.clear();
+            waitKeyframe = true;
+            return;
+        }
+        else if (queueDelay > kCongestedDelay)
+        {
+            DropNonReference();
+            if (!reference)
+            {
+                stats.videoDropped++;
+                return;
+            }
+        }
+
+        if (video.size() > 0 || budget <= 0)
+            stats.videoDeferred++;
+        video.push_back({ quest, bytes, reference, now });
+    }
+    queueCondition.notify_one();
+}
+
+void MediaPacer::SetBitrate(int32_t kbps)
+{
+    unique_lock<mutex> lck(queueMutex);
+    bitrate = max(kbps, kMinBitrate);
+    stats.bitrate = bitrate;
+}
+
+void MediaPacer::SetClient(ClientPtr client)
+{
+    unique_lock<mutex> lck(queueMutex);
+    this->client = client;
+}
+
+MediaPacer::Stats MediaPacer::GetStats()
+{
+    unique_lock<mutex> lck(queueMutex);
+    stats.videoQueueDelay = video.size() > 0 ? ElapsedMs(video.front().enqueued, chrono::steady_clock::now()) : 0;
+    return stats;
+}
+
+void MediaPacer::ResetStats()
+{
+    unique_lock<mutex> lck(queueMutex);
+    stats = Stats();
+    stats.bitrate = bitrate;
+}
+
+void MediaPacer::Refill(TimePoint now)
+{
+    int64_t elapsed = chrono::duration_cast<chrono::microseconds>(now - lastRefill).count();
+    lastRefill = now;
+    int64_t burst = max(int64_t(bitrate) * kBurstMs / 8, kMinBurstBytes);
+    budget = min(budget + int64_t(bitrate) * elapsed / 8000, burst);
+}
+
+void MediaPacer::DropNonReference()
+{
+    size_t kept = 0;
+    for (size_t i = 0; i < video.size(); i++)
+    {
+        if (video[i].reference)
+            video[kept++] = move(video[i]);
+    }
+    stats.videoDropped += video.size() - kept;
+    video.resize(kept);
+}
+
+void MediaPacer::RecordAudioDelay(int64_t delay)
+{
+    int64_t variation = delay > stats.audioDelay ? delay - stats.audioDelay : stats.audioDelay - delay;
+    if (stats.audioPackets > 0)
+        stats.audioJitter += (variation - stats.audioJitter) / 16;
+    stats.audioPackets++;
+    stats.audioDelay = delay;
+    stats.averageAudioDelay += (delay - stats.averageAudioDelay) / 8;
+    if (delay > stats.maxAudioDelay)
+        stats.maxAudioDelay = delay;
+}
+
+void MediaPacer::Run()
+{
+    unique_lock<mutex> lck(queueMutex);
+    while (running)
+    {
+        Refill(chrono::steady_clock::now());
+
+        if (audio.size() > 0)
+        {
+            Item item = move(audio.front());
+            audio.pop_front();
+            budget -= item.bytes;
+            ClientPtr target = client;
+            lck.unlock();
+            target->sendQuest(item.quest);
+            int64_t delay = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - item.enqueued).count();
+            lck.lock();
+            RecordAudioDelay(delay);
+            continue;
+        }
+
+        if (video.size() > 0 && budget > 0)
+        {
+            Item item = move(video.front());
+            video.pop_front();
+            budget -= item.bytes;
+            ClientPtr target = client;
+            lck.unlock();
+            target->sendQuest(item.quest);
+            lck.lock();
+            continue;
+        }
+
+        if (video.size() == 0)
+        {
+            queueCondition.wait(lck, [this]() {return !running || audio.size() > 0 || video.size() > 0; });
+            continue;
+        }
+
+        // sleep until the budget is back above zero, audio wakes us early
+        int64_t wait = (1 - budget) * 8000 / bitrate + 1;
+        queueCondition.wait_for(lck, chrono::microseconds(wait), [this]() {return !running || audio.size() > 0; });
+    }
+}
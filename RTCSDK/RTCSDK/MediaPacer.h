@@ -0,0 +1,79 @@
+#pragma once
+#include <UDPClient.h>
+#include <stdint.h>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+using namespace fpnn;
+using namespace std;
+
+// Sends media quests from one thread. Audio always goes out first and is
+// never held back; video frames are spread at the target bitrate with a
+// small burst allowance, so a keyframe no longer lands on the socket in one
+// piece right in front of the next voice packet. When video falls behind,
+// queued non-reference frames are dropped and reference frames wait.
+class MediaPacer
+{
+public:
+	struct Stats
+	{
+		int64_t audioPackets = 0;
+		int64_t audioDelay = 0;			// us from SendAudio to the socket, last packet
+		int64_t averageAudioDelay = 0;
+		int64_t maxAudioDelay = 0;
+		int64_t audioJitter = 0;		// us, smoothed variation of audioDelay
+		int64_t videoFrames = 0;
+		int64_t videoDeferred = 0;		// frames that had to wait for budget
+		int64_t videoDropped = 0;
+		int64_t videoQueueDelay = 0;	// ms the oldest queued frame has waited
+		int32_t bitrate = 0;			// kbps
+	};
+
+	MediaPacer(ClientPtr client, int32_t bitrate = 2000);
+	~MediaPacer();
+
+	void SendAudio(FPQuestPtr quest, size_t bytes);
+	// reference: other frames predict from this one; keyframe: decodable on its own
+	void SendVideo(FPQuestPtr quest, size_t bytes, bool reference, bool keyframe);
+	void SetBitrate(int32_t kbps);
+	// the gate client is replaced on reconnect; queued quests go to the new one
+	void SetClient(ClientPtr client);
+	Stats GetStats();
+	void ResetStats();
+
+	// false only when every NAL unit in the Annex-B frame has nal_ref_idc 0
+	static bool IsReferenceFrame(const unsigned char* data, size_t length);
+
+private:
+	typedef chrono::steady_clock::time_point TimePoint;
+
+	struct Item
+	{
+		FPQuestPtr quest;
+		size_t bytes;
+		bool reference;
+		TimePoint enqueued;
+	};
+
+	ClientPtr client;
+	deque<Item> audio;
+	deque<Item> video;
+	int32_t bitrate;
+	int64_t budget;			// bytes, negative while paying off a large frame
+	TimePoint lastRefill;
+	bool waitKeyframe = false;
+
+	Stats stats;
+	bool running = true;
+	mutex queueMutex;
+	condition_variable queueCondition;
+	thread sender;
+
+	void Run();
+	void Refill(TimePoint now);
+	void DropNonReference();
+	void RecordAudioDelay(int64_t delay);
+};
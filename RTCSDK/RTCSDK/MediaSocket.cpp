@@ -0,0 +1,413 @@
+#include "MediaSocket.h"
+#include <PacketPool.h>
+
+#include <string.h>
+
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <mswsock.h>
+
+namespace
+{
+    const int32_t kWaitMs = 100;       // threads recheck running at least this often
+    const int kReceiveBuffer = 1 << 20;    // room for bursts from many senders
+    const int64_t kKeepaliveInterval = 15000;   // ms, well inside the 30 s many NATs keep an idle UDP binding
+    const int64_t kCompletionTimeout = 1000;    // ms a batch of sends gets to complete
+}
+
+struct MediaSocket::Backend
+{
+    SOCKET socket = INVALID_SOCKET;
+    RIO_EXTENSION_FUNCTION_TABLE rio;
+    RIO_CQ sendQueue = RIO_INVALID_CQ;
+    RIO_CQ receiveQueue = RIO_INVALID_CQ;
+    RIO_RQ requests = RIO_INVALID_RQ;
+    RIO_BUFFERID sendBuffer = RIO_INVALID_BUFFERID;
+    RIO_BUFFERID receiveBuffer = RIO_INVALID_BUFFERID;
+    HANDLE sendEvent = NULL;
+    HANDLE receiveEvent = NULL;
+    mutex requestMutex;        // a request queue is not thread safe
+
+    RIO_CQ CreateQueue(HANDLE event)
+    {
+        RIO_NOTIFICATION_COMPLETION completion;
+        memset(&completion, 0, sizeof(completion));
+        completion.Type = RIO_EVENT_COMPLETION;
+        completion.Event.EventHandle = event;
+        completion.Event.NotifyReset = TRUE;
+        return rio.RIOCreateCompletionQueue(kSlots, &completion);
+    }
+
+    bool PostReceive(size_t slot)
+    {
+        RIO_BUF buffer;
+        buffer.BufferId = receiveBuffer;
+        buffer.Offset = ULONG(slot * kSlotSize);
+        buffer.Length = ULONG(kSlotSize);
+        return rio.RIOReceive(requests, &buffer, 1, 0, (PVOID)slot) == TRUE;
+    }
+
+    // false when the queue can no longer signal its event
+    bool Notify(RIO_CQ queue)
+    {
+        INT result = rio.RIONotify(queue);
+        return result == ERROR_SUCCESS || result == WSAEALREADY;
+    }
+
+    ~Backend()
+    {
+        if (socket != INVALID_SOCKET)
+            closesocket(socket);
+        if (sendBuffer != RIO_INVALID_BUFFERID)
+            rio.RIODeregisterBuffer(sendBuffer);
+        if (receiveBuffer != RIO_INVALID_BUFFERID)
+            rio.RIODeregisterBuffer(receiveBuffer);
+        if (sendQueue != RIO_INVALID_CQ)
+            rio.RIOCloseCompletionQueue(sendQueue);
+        if (receiveQueue != RIO_INVALID_CQ)
+            rio.RIOCloseCompletionQueue(receiveQueue);
+        if (sendEvent)
+            CloseHandle(sendEvent);
+        if (receiveEvent)
+            CloseHandle(receiveEvent);
+    }
+};
+
+MediaSocket::MediaSocket(function<void(vector<Datagram>& burst)> receiver) :
+    receiver(receiver),
+    bufferPool(make_shared<BufferPool>()),
+    opened(false),
+    running(false),
+    sendRing(kSlots * kSlotSize),
+    receiveRing(kSlots * kSlotSize)
+{
+    received.reserve(kBatch);
+    burst.reserve(kBatch);
+}
+
+MediaSocket::~MediaSocket()
+{
+    Close();
+}
+
+bool MediaSocket::Open(const string& host, unsigned short port, int64_t token)
+{
+    unique_lock<mutex> stateLck(stateMutex);
+    Shutdown();
+
+    addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    addrinfo* address = nullptr;
+    if (getaddrinfo(host.c_str(), to_string(port).c_str(), &hints, &address) != 0 || address == nullptr)
+    {
+        fprintf(stderr, "media socket resolve %s failed\n", host.c_str());
+        return false;
+    }
+
+    unique_ptr<Backend> created(new Backend());
+    created->socket = WSASocket(address->ai_family, SOCK_DGRAM, IPPROTO_UDP, nullptr, 0, WSA_FLAG_REGISTERED_IO);
+    GUID functions = WSAID_MULTIPLE_RIO;
+    DWORD bytes = 0;
+    bool ok = created->socket != INVALID_SOCKET
+        && WSAIoctl(created->socket, SIO_GET_MULTIPLE_EXTENSION_FUNCTION_POINTER, &functions, sizeof(functions),
+            &created->rio, sizeof(created->rio), &bytes, nullptr, nullptr) == 0
+        && setsockopt(created->socket, SOL_SOCKET, SO_RCVBUF, (const char*)&kReceiveBuffer, sizeof(kReceiveBuffer)) == 0
+        && connect(created->socket, address->ai_addr, int(address->ai_addrlen)) == 0;
+    if (ok)
+    {
+        created->sendEvent = CreateEvent(nullptr, TRUE, FALSE, nullptr);
+        created->receiveEvent = CreateEvent(nullptr, TRUE, FALSE, nullptr);
+        created->sendQueue = created->CreateQueue(created->sendEvent);
+        created->receiveQueue = created->CreateQueue(created->receiveEvent);
+        ok = created->sendQueue != RIO_INVALID_CQ && created->receiveQueue != RIO_INVALID_CQ;
+    }
+    if (ok)
+    {
+        created->requests = created->rio.RIOCreateRequestQueue(created->socket, kSlots, 1, kSlots, 1,
+            created->receiveQueue, created->sendQueue, nullptr);
+        created->sendBuffer = created->rio.RIORegisterBuffer((PCHAR)sendRing.data(), DWORD(sendRing.size()));
+        created->receiveBuffer = created->rio.RIORegisterBuffer((PCHAR)receiveRing.data(), DWORD(receiveRing.size()));
+        ok = created->requests != RIO_INVALID_RQ && created->sendBuffer != RIO_INVALID_BUFFERID && created->receiveBuffer != RIO_INVALID_BUFFERID;
+    }
+    for (size_t slot = 0; slot < kSlots && ok; slot++)
+        ok = created->PostReceive(slot);
+    freeaddrinfo(address);
+    if (!ok)
+    {
+        fprintf(stderr, "media socket open %s:%d failed (%d)\n", host.c_str(), port, WSAGetLastError());
+        return false;
+    }
+
+    backend = move(created);
+    {
+        unique_lock<mutex> lck(sendMutex);
+        this->token = token;
+        sendHead = 0;
+        sendCount = 0;
+        running = true;
+        // registers our address with the gate before any media needs it
+        QueueKeepalive();
+    }
+    // before the threads, a failure in them must stick
+    opened = true;
+    sendThread = thread([this]() {SendLoop(); });
+    receiveThread = thread([this]() {ReceiveLoop(); });
+    return true;
+}
+
+void MediaSocket::Close()
+{
+    unique_lock<mutex> stateLck(stateMutex);
+    Shutdown();
+}
+
+void MediaSocket::Shutdown()
+{
+    if (!running)
+        return;
+    opened = false;
+    {
+        unique_lock<mutex> lck(sendMutex);
+        running = false;
+    }
+    sendCondition.notify_one();
+    sendThread.join();
+    receiveThread.join();
+    backend.reset();
+}
+
+bool MediaSocket::Send(const void* header, size_t headerLength, const void* payload, size_t payloadLength)
+{
+    if (!opened || headerLength + payloadLength > kMaxDatagram)
+        return false;
+
+    {
+        unique_lock<mutex> lck(sendMutex);
+        if (sendCount == kSlots)
+        {
+            lck.unlock();
+            unique_lock<mutex> statsLck(statsMutex);
+            stats.dropped++;
+            return false;
+        }
+        // slots past sendHead + sendCount are not touched by the send thread
+        size_t slot = (sendHead + sendCount) % kSlots;
+        unsigned char* p = sendRing.data() + slot * kSlotSize;
+        memcpy(p, &token, sizeof(token));
+        memcpy(p + sizeof(token), header, headerLength);
+        if (payloadLength > 0)
+            memcpy(p + sizeof(token) + headerLength, payload, payloadLength);
+        sendLengths[slot] = sizeof(token) + headerLength + payloadLength;
+        sendCount++;
+    }
+    sendCondition.notify_one();
+    return true;
+}
+
+MediaSocket::Stats MediaSocket::GetStats()
+{
+    unique_lock<mutex> lck(statsMutex);
+    return stats;
+}
+
+void MediaSocket::SendLoop()
+{
+    unique_lock<mutex> lck(sendMutex);
+    while (running)
+    {
+        // a client that only listens still has to keep its NAT binding open
+        if (!sendCondition.wait_for(lck, chrono::milliseconds(kKeepaliveInterval), [this]() {return !running || sendCount > 0; }))
+            QueueKeepalive();
+        if (sendCount == 0)
+            continue;
+
+        // everything queued so far goes out together
+        size_t first = sendHead;
+        size_t count = sendCount;
+        lck.unlock();
+        size_t sent = SendBatch(first, count);
+        {
+            unique_lock<mutex> statsLck(statsMutex);
+            stats.sent += sent;
+            stats.dropped += count - sent;
+            stats.sendBatches++;
+        }
+        lck.lock();
+        sendHead = (sendHead + count) % kSlots;
+        sendCount -= count;
+    }
+}
+
+void MediaSocket::QueueKeepalive()
+{
+    if (sendCount == kSlots)
+        return;
+    // the token alone, no media packet
+    size_t slot = (sendHead + sendCount) % kSlots;
+    memcpy(sendRing.data() + slot * kSlotSize, &token, sizeof(token));
+    sendLengths[slot] = sizeof(token);
+    sendCount++;
+    unique_lock<mutex> statsLck(statsMutex);
+    stats.keepalives++;
+}
+
+void MediaSocket::Fail(const char* call)
+{
+    if (opened.exchange(false))
+        fprintf(stderr, "media socket %s failed (%d), media goes back to the quest path\n", call, WSAGetLastError());
+}
+
+size_t MediaSocket::SendBatch(size_t first, size_t count)
+{
+    // queued before the socket failed, nothing more goes through it
+    if (!opened)
+        return 0;
+
+    size_t posted = 0;
+    {
+        unique_lock<mutex> lck(backend->requestMutex);
+        for (; posted < count; posted++)
+        {
+            size_t slot = (first + posted) % kSlots;
+            RIO_BUF buffer;
+            buffer.BufferId = backend->sendBuffer;
+            buffer.Offset = ULONG(slot * kSlotSize);
+            buffer.Length = ULONG(sendLengths[slot]);
+            if (!backend->rio.RIOSend(backend->requests, &buffer, 1, RIO_MSG_DEFER, nullptr))
+            {
+                Fail("RIOSend");
+                break;
+            }
+        }
+        if (posted > 0 && !backend->rio.RIOSend(backend->requests, nullptr, 0, RIO_MSG_COMMIT_ONLY, nullptr))
+        {
+            // the deferred sends may never go out; the ring is left alone until the next Open
+            Fail("RIOSend commit");
+            return 0;
+        }
+    }
+
+    // the slots can only be reused once their sends have completed
+    RIORESULT results[kBatch];
+    size_t completed = 0;
+    size_t sent = 0;
+    chrono::steady_clock::time_point deadline = chrono::steady_clock::now() + chrono::milliseconds(kCompletionTimeout);
+    while (completed < posted && running)
+    {
+        ULONG dequeued = backend->rio.RIODequeueCompletion(backend->sendQueue, results, kBatch);
+        if (dequeued == RIO_CORRUPT_CQ)
+        {
+            Fail("RIODequeueCompletion");
+            break;
+        }
+        if (dequeued == 0)
+        {
+            if (chrono::steady_clock::now() > deadline)
+            {
+                Fail("send completion");
+                break;
+            }
+            if (!backend->Notify(backend->sendQueue))
+            {
+                Fail("RIONotify");
+                break;
+            }
+            WaitForSingleObject(backend->sendEvent, kWaitMs);
+            continue;
+        }
+        for (ULONG i = 0; i < dequeued; i++)
+        {
+            if (results[i].Status == 0)
+                sent++;
+        }
+        completed += dequeued;
+    }
+    return sent;
+}
+
+void MediaSocket::ReceiveLoop()
+{
+    RIORESULT results[kBatch];
+    while (running)
+    {
+        ULONG dequeued = backend->rio.RIODequeueCompletion(backend->receiveQueue, results, kBatch);
+        if (dequeued == RIO_CORRUPT_CQ)
+        {
+            Fail("RIODequeueCompletion");
+            break;
+        }
+        if (dequeued == 0)
+        {
+            if (!backend->Notify(backend->receiveQueue))
+            {
+                Fail("RIONotify");
+                break;
+            }
+            WaitForSingleObject(backend->receiveEvent, kWaitMs);
+            continue;
+        }
+
+        for (ULONG i = 0; i < dequeued; i++)
+        {
+            size_t slot = (size_t)results[i].RequestContext;
+            if (results[i].Status == 0)
+                AddReceived(receiveRing.data() + slot * kSlotSize, results[i].BytesTransferred);
+        }
+        CopyBurst();
+        {
+            unique_lock<mutex> lck(backend->requestMutex);
+            for (ULONG i = 0; i < dequeued; i++)
+            {
+                if (!backend->PostReceive((size_t)results[i].RequestContext))
+                    Fail("RIOReceive");
+            }
+        }
+        DeliverBurst();
+    }
+}
+
+void MediaSocket::AddReceived(const unsigned char* data, size_t length)
+{
+    if (length > sizeof(int64_t))
+        received.push_back(make_pair(data, length));
+}
+
+void MediaSocket::CopyBurst()
+{
+    if (received.size() == 0)
+        return;
+
+    // one copy out of the ring into a single pooled buffer per burst, so
+    // handlers may keep their views while the slots are reused
+    size_t total = 0;
+    for (auto& datagram : received)
+        total += datagram.second - sizeof(int64_t);
+    shared_ptr<vector<unsigned char>> buffer = bufferPool->Acquire(total);
+    unsigned char* p = buffer->data();
+    for (auto& datagram : received)
+    {
+        int64_t uid;
+        memcpy(&uid, datagram.first, sizeof(uid));
+        size_t length = datagram.second - sizeof(uid);
+        memcpy(p, datagram.first + sizeof(uid), length);
+        burst.push_back({ uid, MediaBuffer(buffer, p, length) });
+        p += length;
+    }
+    received.clear();
+}
+
+void MediaSocket::DeliverBurst()
+{
+    if (burst.size() == 0)
+        return;
+    {
+        unique_lock<mutex> lck(statsMutex);
+        stats.received += burst.size();
+        stats.receiveBatches++;
+    }
+    if (receiver)
+        receiver(burst);
+    burst.clear();
+}
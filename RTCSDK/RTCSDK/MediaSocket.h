@@ -0,0 +1,102 @@
+#pragma once
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "MediaBuffer.h"
+
+using namespace std;
+
+class BufferPool;
+
+// Optional UDP socket for small media packets, next to the FPNN client.
+// Datagrams are queued in fixed buffer rings and handed to the kernel in
+// batches through Registered I/O; received ones reach the handler a burst at
+// a time. Outgoing datagrams start with the session token the gate handed
+// out, incoming ones with the sender's uid; the rest is a binary media packet
+// with the payload trailing the header. A datagram with the token alone
+// registers our address: one goes out on Open and another whenever nothing
+// was sent for a while, so a muted client still gets media through its NAT.
+// Once a Registered I/O call fails the socket closes itself to senders and
+// Send returns false, which puts media back on the quest path.
+class MediaSocket
+{
+public:
+	struct Datagram
+	{
+		int64_t uid;
+		MediaBuffer data;
+	};
+
+	struct Stats
+	{
+		int64_t sent = 0;
+		int64_t sendBatches = 0;
+		int64_t received = 0;
+		int64_t receiveBatches = 0;
+		int64_t dropped = 0;		// ring full, or refused or never completed by the socket
+		int64_t keepalives = 0;
+	};
+
+	static const size_t kMaxDatagram = 1200;
+
+	MediaSocket(function<void(vector<Datagram>& burst)> receiver);
+	~MediaSocket();
+
+	bool Open(const string& host, unsigned short port, int64_t token);
+	void Close();
+	// false again once a Registered I/O call has failed
+	bool IsOpen() { return opened; }
+	// false when the packet doesn't fit one datagram or the ring is full
+	bool Send(const void* header, size_t headerLength, const void* payload, size_t payloadLength);
+	Stats GetStats();
+
+private:
+	struct Backend;
+
+	static const size_t kSlots = 256;
+	static const size_t kSlotSize = sizeof(int64_t) + kMaxDatagram;
+	static const size_t kBatch = 64;
+
+	function<void(vector<Datagram>& burst)> receiver;
+	unique_ptr<Backend> backend;
+	shared_ptr<BufferPool> bufferPool;
+	atomic<bool> opened;
+	atomic<bool> running;
+	int64_t token = 0;
+
+	vector<unsigned char> sendRing;
+	vector<unsigned char> receiveRing;
+	size_t sendLengths[kSlots];
+	size_t sendHead = 0;
+	size_t sendCount = 0;		// queued plus in flight
+	mutex sendMutex;
+	condition_variable sendCondition;
+	thread sendThread;
+	thread receiveThread;
+	vector<pair<const unsigned char*, size_t>> received;
+	vector<Datagram> burst;
+
+	Stats stats;
+	mutex statsMutex;
+	mutex stateMutex;		// Open and Close
+
+	void Shutdown();
+	void SendLoop();
+	void ReceiveLoop();
+	// sendMutex held
+	void QueueKeepalive();
+	// stops new sends through the socket, the owner falls back to quests
+	void Fail(const char* call);
+	// sends slots [first, first + count) of the ring, wrapping; returns how many went out
+	size_t SendBatch(size_t first, size_t count);
+	void AddReceived(const unsigned char* data, size_t length);
+	void CopyBurst();
+	void DeliverBurst();
+};
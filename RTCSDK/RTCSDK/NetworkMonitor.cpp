@@ -0,0 +1,164 @@
+#include "NetworkMonitor.h"
+#include <algorithm>
+
+namespace
+{
+    const int32_t kProbeWindow = 8;             // pings the probe loss is taken over
+    const int64_t kMaxSeqJump = 3000;           // further than this the sender restarted its numbering
+    const int64_t kStreamTimeout = 10000;       // ms, forget streams that went quiet
+
+    struct Threshold
+    {
+        int32_t loss;       // percent
+        int64_t jitter;     // ms
+        int64_t rtt;        // ms
+    };
+
+    // the best grade whose limits all hold wins, VeryBad otherwise
+    const Threshold kThresholds[] = {
+        { 1, 20, 100 },     // Excellent
+        { 3, 40, 200 },     // Good
+        { 8, 80, 400 },     // Poor
+        { 15, 150, 800 },   // Bad
+    };
+}
+
+NetworkMonitor::Quality NetworkMonitor::Grade(int32_t loss, int64_t jitter, int64_t rtt)
+{
+    for (size_t i = 0; i < sizeof(kThresholds) / sizeof(kThresholds[0]); i++)
+    {
+        if (loss <= kThresholds[i].loss && jitter <= kThresholds[i].jitter && rtt <= kThresholds[i].rtt)
+            return (Quality)((int32_t)Quality::Excellent + i);
+    }
+    return Quality::VeryBad;
+}
+
+void NetworkMonitor::OnProbeAnswered(int64_t rtt)
+{
+    unique_lock<mutex> lck(monitorMutex);
+    stats.rtt = answered ? stats.rtt + (rtt - stats.rtt) / 8 : rtt;
+    answered = true;
+    RecordProbe(false);
+}
+
+void NetworkMonitor::OnProbeLost()
+{
+    unique_lock<mutex> lck(monitorMutex);
+    RecordProbe(true);
+}
+
+void NetworkMonitor::RecordProbe(bool lost)
+{
+    probeHistory = (probeHistory << 1) | (lost ? 1 : 0);
+    probeCount = min(probeCount + 1, kProbeWindow);
+    int32_t lostCount = 0;
+    for (int32_t i = 0; i < probeCount; i++)
+        lostCount += (probeHistory >> i) & 1;
+    stats.probeLoss = lostCount * 100 / probeCount;
+}
+
+void NetworkMonitor::OnMedia(int64_t uid, bool video, int64_t seq, int64_t timestamp, int64_t arrival)
+{
+    int64_t key = (uid << 1) | (video ? 1 : 0);
+    Shard& shard = shards[ShardOf(key)];
+    unique_lock<mutex> lck(shard.shardMutex);
+    Stream& stream = shard.streams[key];
+    int64_t transit = arrival - timestamp;
+    if (stream.lastArrival == 0 || seq > stream.maxSeq + kMaxSeqJump || seq < stream.maxSeq - kMaxSeqJump)
+    {
+        stream = Stream();
+        stream.video = video;
+        stream.maxSeq = seq;
+        stream.intervalSeq = seq - 1;
+        stream.received = 1;
+        stream.transit = transit;
+        stream.lastArrival = arrival;
+        return;
+    }
+
+    stream.received++;
+    if (seq > stream.maxSeq)
+        stream.maxSeq = seq;
+    int64_t variation = transit > stream.transit ? transit - stream.transit : stream.transit - transit;
+    stream.transit = transit;
+    stream.jitter += variation - ((stream.jitter + 8) >> 4);
+    stream.lastArrival = arrival;
+}
+
+NetworkMonitor::Stats NetworkMonitor::Evaluate(bool connected, int64_t framesSent, int64_t framesDropped, int64_t queueDelay, int64_t now)
+{
+    int64_t expected = 0;
+    int64_t received = 0;
+    int64_t voiceJitter = -1;
+    int64_t videoJitter = 0;
+    for (Shard& shard : shards)
+    {
+        unique_lock<mutex> shardLck(shard.shardMutex);
+        for (auto iter = shard.streams.begin(); iter != shard.streams.end();)
+        {
+            Stream& stream = iter->second;
+            if (now - stream.lastArrival > kStreamTimeout)
+            {
+                iter = shard.streams.erase(iter);
+                continue;
+            }
+            int64_t streamExpected = stream.maxSeq - stream.intervalSeq;
+            expected += streamExpected;
+            received += min(stream.received, streamExpected);
+            stream.intervalSeq = stream.maxSeq;
+            stream.received = 0;
+            if (stream.video)
+                videoJitter = max(videoJitter, stream.jitter >> 4);
+            else
+                voiceJitter = max(voiceJitter, stream.jitter >> 4);
+            ++iter;
+        }
+    }
+
+    unique_lock<mutex> lck(monitorMutex);
+    stats.expected = expected;
+    stats.received = received;
+    stats.downlinkLoss = expected > 0 ? (int32_t)((expected - received) * 100 / expected) : 0;
+    stats.downlinkJitter = voiceJitter >= 0 ? voiceJitter : videoJitter;
+    int32_t dropRate = framesSent > 0 ? (int32_t)(min(framesDropped, framesSent) * 100 / framesSent) : 0;
+    stats.uplinkLoss = max(stats.probeLoss, dropRate);
+    stats.uplinkDelay = queueDelay;
+
+    if (!connected)
+    {
+        stats.uplink = Quality::Down;
+        stats.downlink = Quality::Down;
+    }
+    else if (!answered && expected == 0)
+    {
+        stats.uplink = Quality::Unknown;
+        stats.downlink = Quality::Unknown;
+    }
+    else
+    {
+        // a lost ping may have been lost either way, so it counts against both
+        stats.uplink = Grade(stats.uplinkLoss, stats.uplinkDelay, stats.rtt);
+        stats.downlink = Grade(max(stats.downlinkLoss, stats.probeLoss), stats.downlinkJitter, stats.rtt);
+    }
+    return stats;
+}
+
+NetworkMonitor::Stats NetworkMonitor::GetStats()
+{
+    unique_lock<mutex> lck(monitorMutex);
+    return stats;
+}
+
+void NetworkMonitor::Reset()
+{
+    for (Shard& shard : shards)
+    {
+        unique_lock<mutex> shardLck(shard.shardMutex);
+        shard.streams.clear();
+    }
+    unique_lock<mutex> lck(monitorMutex);
+    probeHistory = 0;
+    probeCount = 0;
+    answered = false;
+    stats = Stats();
+}
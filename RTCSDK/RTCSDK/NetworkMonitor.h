@@ -0,0 +1,82 @@
+#pragma once
+#include <stdint.h>
+#include <mutex>
+#include <unordered_map>
+#include "RTCEventHandler.h"
+
+using namespace std;
+
+// Collects what the network quality event is graded from: round trips and
+// losses of the gate ping, and per stream loss and jitter of incoming media
+// worked out from sequence numbers and sender timestamps (RFC 3550 style).
+// Evaluate closes an interval and grades each direction on its own.
+class NetworkMonitor
+{
+public:
+	typedef RTCEventHandler::NetworkQuality Quality;
+
+	struct Stats
+	{
+		int64_t rtt = 0;				// ms, smoothed round trip of the gate ping
+		int32_t probeLoss = 0;			// percent of the recent pings that got no answer
+		int64_t expected = 0;			// media packets sent to us in the last interval
+		int64_t received = 0;
+		int32_t downlinkLoss = 0;		// percent
+		int64_t downlinkJitter = 0;		// ms, worst voice stream, video when nobody talks
+		int32_t uplinkLoss = 0;			// percent, pings lost or frames the pacer dropped
+		int64_t uplinkDelay = 0;		// ms the oldest video frame waited in the pacer
+		Quality uplink = Quality::Unknown;
+		Quality downlink = Quality::Unknown;
+	};
+
+	void OnProbeAnswered(int64_t rtt);
+	void OnProbeLost();
+	// called for every incoming media packet, arrival in ms; a stream's packets
+	// one at a time, different streams in parallel
+	void OnMedia(int64_t uid, bool video, int64_t seq, int64_t timestamp, int64_t arrival);
+	// connected is false while the gate session is being resumed
+	Stats Evaluate(bool connected, int64_t framesSent, int64_t framesDropped, int64_t queueDelay, int64_t now);
+	Stats GetStats();
+	void Reset();
+
+	static Quality Grade(int32_t loss, int64_t jitter, int64_t rtt);
+
+private:
+	struct Stream
+	{
+		int64_t maxSeq = 0;
+		int64_t intervalSeq = 0;	// maxSeq when the interval started
+		int64_t received = 0;		// this interval
+		int64_t transit = 0;		// arrival - timestamp of the last packet
+		int64_t jitter = 0;			// ms << 4
+		int64_t lastArrival = 0;
+		bool video = false;
+	};
+
+	static const size_t kShards = 16;
+
+	// streams spread over shards, so workers handling different streams rarely share a lock
+	struct alignas(64) Shard
+	{
+		unordered_map<int64_t, Stream> streams;
+		mutex shardMutex;
+	};
+
+	static size_t ShardOf(int64_t streamKey)
+	{
+		uint64_t key = (uint64_t)streamKey;
+		key ^= key >> 33;
+		key *= 0xff51afd7ed558ccdULL;
+		key ^= key >> 33;
+		return key % kShards;
+	}
+
+	Shard shards[kShards];
+	uint32_t probeHistory = 0;		// one bit per ping, newest lowest, set when lost
+	int32_t probeCount = 0;
+	bool answered = false;
+	Stats stats;
+	mutex monitorMutex;		// everything but the shards
+
+	void RecordProbe(bool lost);
+};
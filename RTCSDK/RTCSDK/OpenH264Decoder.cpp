@@ -26,7 +26,7 @@ OpenH264Decoder::~OpenH264Decoder()
 	decoder = nullptr;
 }
 
-vector<unsigned char> OpenH264Decoder::Decode(unsigned char* srcData, int srcLen)
+vector<unsigned char> OpenH264Decoder::Decode(const unsigned char* srcData, int srcLen)
 {
 	static unsigned char* dstData[3] = { {} };
 	SBufferInfo dstBufferInfo = {};
@@ -14,7 +14,7 @@ class OpenH264Decoder
 public:
 	OpenH264Decoder(int w,int h);
 	~OpenH264Decoder();
-	vector<unsigned char> Decode(unsigned char* srcData, int srcLen);
+	vector<unsigned char> Decode(const unsigned char* srcData, int srcLen);
 
 	bool IsInited();
 	void SetInited(bool t);
@@ -1,19 +1,98 @@
 //#include "Objbase.h"
 #include "RTCClient.h"
 #include "RTCGateQuestProcessor.h"
+#include "MediaHeader.h"
+#include <chrono>
 using namespace std;
 
+namespace
+{
+    const int64_t kWatchdogInterval = 500;     // ms
+    const int64_t kProbeInterval = 2000;       // ping the gate this often, for round trips and liveness
+    const int64_t kQualityInterval = 2000;
+    const int32_t kProbeTimeout = 2;           // s
+    const int64_t kGateTimeout = 5000;         // nothing at all from the gate, reconnect
+    const int32_t kResumeTimeout = 3;          // s
+    const int64_t kRetryInterval = 1000;
+    const int64_t kMaxRetryInterval = 8000;
+    const int64_t kConnectTimeout = 3000;      // a handshake still unfinished after this is started over
+
+    int64_t NowMs()
+    {
+        return chrono::steady_clock::now().time_since_epoch().count() / 1000000;
+    }
+
+    bool IsNetworkError(int errorCode)
+    {
+        return errorCode == fpnn::FPNN_EC_CORE_TIMEOUT
+            || errorCode == fpnn::FPNN_EC_CORE_CONNECTION_CLOSED
+            || errorCode == fpnn::FPNN_EC_CORE_INVALID_CONNECTION;
+    }
+}
+
 RTCClient::RTCClient(string host, unsigned short port) :
-	client(UDPClient::createClient(host, port))
+	client(UDPClient::createClient(host, port)),
+	mediaHeaderVersion(0),
+	host(host),
+	port(port),
+	mediaSocketEnabled(false),
+	connectStart(NowMs()),
+	probing(false),
+	sessionRenewed(false),
+	refreshing(false)
 {
 	processor = make_shared<RTCGateQuestProcessor>();
+	gateProcessor = dynamic_cast<RTCGateQuestProcessor*>(processor.get());
+	monitor = make_shared<NetworkMonitor>();
+	gateProcessor->SetNetworkMonitor(monitor);
 	client->setQuestProcessor(processor);
+	pacer = make_unique<MediaPacer>(client);
+	mediaSocket = make_unique<MediaSocket>([this](vector<MediaSocket::Datagram>& burst) {
+		gateProcessor->OnMediaBurst(burst);
+		});
 
-    client->connect();
+    // the handshake overlaps the owner's RTM login instead of blocking construction
+    client->asyncConnect();
+	watchdog = thread([this]() {Watchdog(); });
 }
 
 RTCClient::~RTCClient()
 {
+	Shutdown();
+}
+
+void RTCClient::Shutdown()
+{
+	{
+		unique_lock<mutex> lck(watchdogMutex);
+		if (!running)
+			return;
+		running = false;
+	}
+	watchdogCondition.notify_one();
+	watchdog.join();
+	resumeCallback = nullptr;
+	qualityCallback = nullptr;
+
+	GetClient()->close();
+	mediaSocket->Close();
+	gateProcessor->Shutdown();
+}
+
+ClientPtr RTCClient::GetClient()
+{
+	unique_lock<mutex> lck(clientMutex);
+	return client;
+}
+
+void RTCClient::UpdateMediaTransport(FPAReader& ar)
+{
+    mediaHeaderVersion = (uint8_t)ar.getInt("mediaHeader", 0);
+    int32_t mediaPort = (int32_t)ar.getInt("mediaPort", 0);
+    if (mediaSocketEnabled && mediaHeaderVersion >= kMediaHeaderVersion && mediaPort > 0)
+        mediaSocket->Open(host, (unsigned short)mediaPort, ar.getInt("mediaToken", 0));
+    else
+        mediaSocket->Close();
 }
 
 bool RTCClient::EnterRTCRoom(int64_t pid, int64_t rid, int64_t uid, string token)
@@ -23,7 +102,7 @@ bool RTCClient::EnterRTCRoom(int64_t pid, int64_t rid, int64_t uid, string token
 	qw.param("rid", rid);
 	qw.param("uid", uid);
 	qw.param("token", token);
-    FPAnswerPtr answer4 = client->sendQuest(qw.take());
+    FPAnswerPtr answer4 = GetClient()->sendQuest(qw.take());
     if (answer4->status() != 0)
     {
         return false;
@@ -32,6 +111,8 @@ bool RTCClient::EnterRTCRoom(int64_t pid, int64_t rid, int64_t uid, string token
     {
         FPAReader ar4(answer4);
         ar4.getBool("microphone", false);
+        UpdateMediaTransport(ar4);
+        RememberSession(Session::Room, pid, rid, uid, token, 0, 0, 0);
         return true;
     }
 
@@ -44,7 +125,7 @@ void RTCClient::EnterRTCRoom(int64_t pid, int64_t rid, int64_t uid, string token
     qw.param("rid", rid);
     qw.param("uid", uid);
     qw.param("token", token);
-    client->sendQuest(qw.take(), [callback](FPAnswerPtr answer, int errorCode) {
+    GetClient()->sendQuest(qw.take(), [this, pid, rid, uid, token, callback](FPAnswerPtr answer, int errorCode) {
         if (errorCode != fpnn::FPNN_EC_OK)
         {
             FPAReader ar(answer);
@@ -53,54 +134,82 @@ void RTCClient::EnterRTCRoom(int64_t pid, int64_t rid, int64_t uid, string token
         }
         else
         {
+            FPAReader ar(answer);
+            UpdateMediaTransport(ar);
+            RememberSession(Session::Room, pid, rid, uid, token, 0, 0, 0);
             callback(errorCode, false);
         }
         });
 }
 
-void RTCClient::SetVideoCallback(function<void(int64_t rid, int64_t uid, int64_t seq, int64_t flags, int64_t timestamp, int64_t rotation, int64_t version, int32_t facing, int32_t captureLevel, vector<unsigned char>data, vector<unsigned char>sps, vector<unsigned char>pps)> callback)
+void RTCClient::SetVideoCallback(function<void(int64_t rid, int64_t uid, int64_t seq, int64_t flags, int64_t timestamp, int64_t rotation, int64_t version, int32_t facing, int32_t captureLevel, MediaBuffer data, MediaBuffer sps, MediaBuffer pps)> callback)
 {
     dynamic_cast<RTCGateQuestProcessor*>(processor.get())->SetVideoCallback(callback);
 }
 
-void RTCClient::SetAudioCallback(function<void(int64_t uid, int64_t rid, int64_t seq, int64_t timestamp, vector<unsigned char>data)> callback)
+void RTCClient::SetAudioCallback(function<void(int64_t uid, int64_t rid, int64_t seq, int64_t timestamp, MediaBuffer data)> callback)
 {
     dynamic_cast<RTCGateQuestProcessor*>(processor.get())->SetVoiceCallback(callback);
 }
 
-void RTCClient::SendAudioData(int64_t rid, int64_t seq, int64_t timestamp, vector<unsigned char> data)
+void RTCClient::SendAudioData(int64_t rid, int64_t seq, int64_t timestamp, const MediaBuffer& data)
 {
+    // the writer serializes straight from the caller's buffer, the only copy on the way out
+    if (mediaHeaderVersion >= kMediaHeaderVersion)
+    {
+        MediaHeader header;
+        PackVoiceHeader(header, rid, seq, timestamp);
+        if (mediaSocket->Send(&header, sizeof(header), data.data(), data.size()))
+            return;
+        FPQWriter qw(2, "voice", true);
+        qw.paramBinary("m", &header, sizeof(header));
+        qw.paramBinary("data", data.data(), data.size());
+        pacer->SendAudio(qw.take(), data.size());
+        return;
+    }
     FPQWriter qw(4, "voice", true);
     qw.param("timestamp", timestamp);
-    qw.param("data", data);
+    qw.paramBinary("data", data.data(), data.size());
     qw.param("seq", seq);
     qw.param("rid", rid);
-    client->sendQuest(qw.take());
+    pacer->SendAudio(qw.take(), data.size());
 }
 
-void RTCClient::SendVideoData(int64_t rid, int64_t seq, int64_t flags, int64_t timestamp, int64_t rotation, int64_t version, int32_t facing, int32_t captureLevel, vector<unsigned char> data, vector<unsigned char> sps, vector<unsigned char> pps)
+void RTCClient::SendVideoData(int64_t rid, int64_t seq, int64_t flags, int64_t timestamp, int64_t rotation, int64_t version, int32_t facing, int32_t captureLevel, const MediaBuffer& data, const MediaBuffer& sps, const MediaBuffer& pps)
 {
+    bool keyframe = sps.size() > 0;
+    bool reference = keyframe || MediaPacer::IsReferenceFrame(data.data(), data.size());
+    size_t bytes = data.size() + sps.size() + pps.size();
+    if (mediaHeaderVersion >= kMediaHeaderVersion)
+    {
+        vector<unsigned char> header = PackVideoHeader(rid, seq, flags, timestamp, rotation, version, facing, captureLevel, sps.data(), sps.size(), pps.data(), pps.size());
+        FPQWriter qw(2, "video", true);
+        qw.paramBinary("m", header.data(), header.size());
+        qw.paramBinary("data", data.data(), data.size());
+        pacer->SendVideo(qw.take(), bytes, reference, keyframe);
+        return;
+    }
     FPQWriter qw(11, "video", true);
     qw.param("timestamp", timestamp);
     qw.param("seq", seq);
-    qw.param("data", data);
+    qw.paramBinary("data", data.data(), data.size());
     qw.param("rid", rid);
     qw.param("flags", flags);
-    qw.param("sps", sps);
-    qw.param("pps", pps);
+    qw.paramBinary("sps", sps.data(), sps.size());
+    qw.paramBinary("pps", pps.data(), pps.size());
     qw.param("facing", facing);
     qw.param("version", version);
-    qw.param("captureLevel", version);
-    qw.param("rotation", version);
-    client->sendQuest(qw.take());
+    qw.param("captureLevel", captureLevel);
+    qw.param("rotation", rotation);
+    pacer->SendVideo(qw.take(), bytes, reference, keyframe);
 }
 
-void RTCClient::SetP2PVideoCallback(function<void(int64_t uid, int64_t seq, int64_t flags, int64_t timestamp, int64_t rotation, int64_t version, int32_t facing, int32_t captureLevel, vector<unsigned char>data, vector<unsigned char>sps, vector<unsigned char>pps)> callback)
+void RTCClient::SetP2PVideoCallback(function<void(int64_t uid, int64_t seq, int64_t flags, int64_t timestamp, int64_t rotation, int64_t version, int32_t facing, int32_t captureLevel, MediaBuffer data, MediaBuffer sps, MediaBuffer pps)> callback)
 {
     dynamic_cast<RTCGateQuestProcessor*>(processor.get())->SetP2PVideoCallback(callback);
 }
 
-void RTCClient::SetP2PAudioCallback(function<void(int64_t uid, int64_t seq, int64_t timestamp, vector<unsigned char>data)> callback)
+void RTCClient::SetP2PAudioCallback(function<void(int64_t uid, int64_t seq, int64_t timestamp, MediaBuffer data)> callback)
 {
     dynamic_cast<RTCGateQuestProcessor*>(processor.get())->SetP2PVoiceCallback(callback);
 }
@@ -113,7 +222,7 @@ void RTCClient::SetP2PRequest(int64_t pid, int64_t uid, int32_t type, int64_t pe
     qw.param("type", type);
     qw.param("peerUid", peerUid);
     qw.param("callid", callid);
-    client->sendQuest(qw.take(), [callback](FPAnswerPtr answer, int errorCode) {
+    GetClient()->sendQuest(qw.take(), [this, pid, uid, type, peerUid, callid, callback](FPAnswerPtr answer, int errorCode) {
         if (errorCode != fpnn::FPNN_EC_OK)
         {
             // error log
@@ -121,32 +230,380 @@ void RTCClient::SetP2PRequest(int64_t pid, int64_t uid, int32_t type, int64_t pe
         }
         else
         {
+            FPAReader ar(answer);
+            UpdateMediaTransport(ar);
+            RememberSession(Session::P2P, pid, 0, uid, "", type, peerUid, callid);
             callback(errorCode);
         }
         });
 }
 
-void RTCClient::SendP2PAudioData(int64_t seq, int64_t timestamp, vector<unsigned char> data)
+void RTCClient::SendP2PAudioData(int64_t seq, int64_t timestamp, const MediaBuffer& data)
 {
+	if (mediaHeaderVersion >= kMediaHeaderVersion)
+	{
+		MediaHeader header;
+		PackVoiceHeader(header, 0, seq, timestamp);
+		if (mediaSocket->Send(&header, sizeof(header), data.data(), data.size()))
+			return;
+		FPQWriter qw(2, "voiceP2P", true);
+		qw.paramBinary("m", &header, sizeof(header));
+		qw.paramBinary("data", data.data(), data.size());
+		pacer->SendAudio(qw.take(), data.size());
+		return;
+	}
 	FPQWriter qw(3, "voiceP2P", true);
 	qw.param("timestamp", timestamp);
-	qw.param("data", data);
+	qw.paramBinary("data", data.data(), data.size());
 	qw.param("seq", seq);
-	client->sendQuest(qw.take());
+	pacer->SendAudio(qw.take(), data.size());
 }
 
-void RTCClient::SendP2PVideoData(int64_t seq, int64_t flags, int64_t timestamp, int64_t rotation, int64_t version, int32_t facing, int32_t captureLevel, vector<unsigned char> data, vector<unsigned char> sps, vector<unsigned char> pps)
+void RTCClient::SendP2PVideoData(int64_t seq, int64_t flags, int64_t timestamp, int64_t rotation, int64_t version, int32_t facing, int32_t captureLevel, const MediaBuffer& data, const MediaBuffer& sps, const MediaBuffer& pps)
 {
+	bool keyframe = sps.size() > 0;
+	bool reference = keyframe || MediaPacer::IsReferenceFrame(data.data(), data.size());
+	size_t bytes = data.size() + sps.size() + pps.size();
+	if (mediaHeaderVersion >= kMediaHeaderVersion)
+	{
+		vector<unsigned char> header = PackVideoHeader(0, seq, flags, timestamp, rotation, version, facing, captureLevel, sps.data(), sps.size(), pps.data(), pps.size());
+		FPQWriter qw(2, "VideoP2P", true);
+		qw.paramBinary("m", header.data(), header.size());
+		qw.paramBinary("data", data.data(), data.size());
+		pacer->SendVideo(qw.take(), bytes, reference, keyframe);
+		return;
+	}
 	FPQWriter qw(10, "VideoP2P", true);
 	qw.param("timestamp", timestamp);
 	qw.param("seq", seq);
-	qw.param("data", data);
+	qw.paramBinary("data", data.data(), data.size());
 	qw.param("flags", flags);
-	qw.param("sps", sps);
-	qw.param("pps", pps);
+	qw.paramBinary("sps", sps.data(), sps.size());
+	qw.paramBinary("pps", pps.data(), pps.size());
 	qw.param("facing", facing);
 	qw.param("version", version);
-	qw.param("captureLevel", version);
-	qw.param("rotation", version);
-	client->sendQuest(qw.take());
+	qw.param("captureLevel", captureLevel);
+	qw.param("rotation", rotation);
+	pacer->SendVideo(qw.take(), bytes, reference, keyframe);
+}
+
+void RTCClient::RequestKeyFrame(int64_t rid, int64_t uid)
+{
+	FPQWriter qw(2, "requestKeyFrame", true);
+	qw.param("rid", rid);
+	qw.param("uid", uid);
+	GetClient()->sendQuest(qw.take());
+}
+
+void RTCClient::SetKeyFrameRequestCallback(function<void(int64_t rid, int64_t uid)> callback)
+{
+	gateProcessor->SetKeyFrameCallback(callback);
+}
+
+void RTCClient::SetVideoLossCallback(function<void(int64_t rid, int64_t uid)> callback)
+{
+	gateProcessor->SetVideoLossCallback(callback);
+}
+
+void RTCClient::SetSendBitrate(int32_t kbps)
+{
+	pacer->SetBitrate(kbps);
+}
+
+MediaPacer::Stats RTCClient::GetPacerStats()
+{
+	return pacer->GetStats();
+}
+
+void RTCClient::EnableMediaSocket(bool enable)
+{
+	mediaSocketEnabled = enable;
+	if (!enable)
+		mediaSocket->Close();
+}
+
+MediaSocket::Stats RTCClient::GetMediaSocketStats()
+{
+	return mediaSocket->GetStats();
+}
+
+MediaDispatcher::Stats RTCClient::GetDispatchStats()
+{
+	return gateProcessor->GetDispatchStats();
+}
+
+void RTCClient::SetResumeCallback(function<void(int errorCode)> callback)
+{
+	resumeCallback = callback;
+}
+
+void RTCClient::RememberSession(Session kind, int64_t pid, int64_t rid, int64_t uid, const string& token, int32_t type, int64_t peerUid, int64_t callId)
+{
+	{
+		unique_lock<mutex> lck(sessionMutex);
+		session = kind;
+		sessionPid = pid;
+		sessionRid = rid;
+		sessionUid = uid;
+		sessionToken = token;
+		p2pType = type;
+		p2pPeerUid = peerUid;
+		p2pCallId = callId;
+	}
+	gateProcessor->OnActivity(false);
+	refreshing = false;
+	sessionRenewed = true;
+}
+
+void RTCClient::CancelRefresh()
+{
+	refreshing = false;
+}
+
+void RTCClient::ClearSession()
+{
+	{
+		unique_lock<mutex> lck(sessionMutex);
+		session = Session::None;
+	}
+	refreshing = false;
+	monitor->Reset();
+}
+
+void RTCClient::ClearP2PSession(int64_t callId)
+{
+	{
+		unique_lock<mutex> lck(sessionMutex);
+		if (session != Session::P2P || (callId != 0 && callId != p2pCallId))
+			return;
+		session = Session::None;
+	}
+	refreshing = false;
+	monitor->Reset();
+}
+
+RTCClient::SessionStats RTCClient::GetSessionStats()
+{
+	unique_lock<mutex> lck(statsMutex);
+	SessionStats stats = sessionStats;
+	stats.lastMediaGap = gateProcessor->GetLastMediaGap();
+	return stats;
+}
+
+void RTCClient::Watchdog()
+{
+	unique_lock<mutex> lck(watchdogMutex);
+	while (running)
+	{
+		watchdogCondition.wait_for(lck, chrono::milliseconds(kWatchdogInterval));
+		if (!running)
+			break;
+		lck.unlock();
+		CheckGate();
+		lck.lock();
+	}
+}
+
+void RTCClient::CheckGate()
+{
+	{
+		unique_lock<mutex> lck(sessionMutex);
+		if (session == Session::None)
+		{
+			resuming = false;
+			return;
+		}
+	}
+
+	int64_t now = NowMs();
+	ReportQuality(now);
+	bool renewed = sessionRenewed.exchange(false);
+	if (resuming && renewed)
+	{
+		// the owner entered again with a fresh token
+		FinishResume();
+		return;
+	}
+	if (resuming)
+	{
+		if (now >= nextAttempt && !refreshing)
+			Resume(now);
+		return;
+	}
+
+	int64_t idle = now - gateProcessor->GetLastActivity();
+	if (idle > kGateTimeout)
+	{
+		fprintf(stderr, "rtc gate silent for %lld ms, reconnecting\n", (long long)idle);
+		resuming = true;
+		lossTime = now;
+		retryInterval = kRetryInterval;
+		gateProcessor->StartMediaGap();
+		Resume(now);
+	}
+	else if (now - lastProbe >= kProbeInterval && !probing)
+	{
+		Probe(now);
+	}
+}
+
+void RTCClient::Probe(int64_t now)
+{
+	probing = true;
+	lastProbe = now;
+	GetClient()->sendQuest(FPQWriter::emptyQuest("ping"), [this, now](FPAnswerPtr answer, int errorCode) {
+		// any answer, even an error, shows the gate is still there
+		if (!IsNetworkError(errorCode))
+		{
+			gateProcessor->OnActivity(false);
+			monitor->OnProbeAnswered(NowMs() - now);
+		}
+		else
+			monitor->OnProbeLost();
+		probing = false;
+		}, kProbeTimeout);
+}
+
+void RTCClient::ReportQuality(int64_t now)
+{
+	if (now - lastReport < kQualityInterval)
+		return;
+	lastReport = now;
+
+	MediaPacer::Stats pacerStats = pacer->GetStats();
+	int64_t framesSent = pacerStats.videoFrames - lastFramesSent;
+	int64_t framesDropped = pacerStats.videoDropped - lastFramesDropped;
+	lastFramesSent = pacerStats.videoFrames;
+	lastFramesDropped = pacerStats.videoDropped;
+	// ResetStats started the counters over
+	if (framesSent < 0 || framesDropped < 0)
+	{
+		framesSent = 0;
+		framesDropped = 0;
+	}
+
+	NetworkMonitor::Stats stats = monitor->Evaluate(!resuming, framesSent, framesDropped, pacerStats.videoQueueDelay, now);
+	if (qualityCallback)
+		qualityCallback(stats);
+}
+
+void RTCClient::SetNetworkQualityCallback(function<void(const NetworkMonitor::Stats& stats)> callback)
+{
+	qualityCallback = callback;
+}
+
+NetworkMonitor::Stats RTCClient::GetNetworkStats()
+{
+	return monitor->GetStats();
+}
+
+ClientPtr RTCClient::Reconnect(bool wait)
+{
+	// a fresh client gets a fresh socket, which follows a changed local address
+	ClientPtr fresh = UDPClient::createClient(host, port);
+	fresh->setQuestProcessor(processor);
+	connectStart = NowMs();
+	if (wait)
+		fresh->connect();
+	else
+		fresh->asyncConnect();
+	ClientPtr stale;
+	{
+		unique_lock<mutex> lck(clientMutex);
+		stale = client;
+		client = fresh;
+	}
+	pacer->SetClient(fresh);
+	stale->close();
+	mediaSocket->Close();
+	return fresh;
+}
+
+void RTCClient::Prepare()
+{
+	{
+		unique_lock<mutex> lck(sessionMutex);
+		// in a room or call the watchdog looks after the connection
+		if (session != Session::None)
+			return;
+	}
+	ClientPtr current = GetClient();
+	// a connection still being set up is left to finish
+	if (!current->connected() && NowMs() - connectStart > kConnectTimeout)
+		current = Reconnect(false);
+	// finishes the handshake and refreshes the NAT binding before enterRTCRoom needs them
+	current->sendQuest(FPQWriter::emptyQuest("ping"), [this](FPAnswerPtr answer, int errorCode) {
+		if (!IsNetworkError(errorCode))
+			gateProcessor->OnActivity(false);
+		}, kProbeTimeout);
+}
+
+void RTCClient::Resume(int64_t now)
+{
+	ClientPtr fresh = Reconnect(true);
+
+	FPQuestPtr quest;
+	Session kind;
+	{
+		unique_lock<mutex> lck(sessionMutex);
+		kind = session;
+		if (kind == Session::Room)
+		{
+			FPQWriter qw(4, "enterRTCRoom");
+			qw.param("pid", sessionPid);
+			qw.param("rid", sessionRid);
+			qw.param("uid", sessionUid);
+			qw.param("token", sessionToken);
+			quest = qw.take();
+		}
+		else if (kind == Session::P2P)
+		{
+			FPQWriter qw(5, "enterRTCRoom");
+			qw.param("pid", sessionPid);
+			qw.param("uid", sessionUid);
+			qw.param("type", p2pType);
+			qw.param("peerUid", p2pPeerUid);
+			qw.param("callid", p2pCallId);
+			quest = qw.take();
+		}
+	}
+	if (quest == nullptr)
+	{
+		resuming = false;
+		return;
+	}
+
+	FPAnswerPtr answer = fresh->sendQuest(quest, kResumeTimeout);
+	FPAReader ar(answer);
+	if (answer->status() == 0)
+	{
+		UpdateMediaTransport(ar);
+		gateProcessor->OnActivity(false);
+		FinishResume();
+		if (resumeCallback)
+			resumeCallback(0);
+		return;
+	}
+
+	int errorCode = (int)ar.getInt("code", fpnn::FPNN_EC_CORE_TIMEOUT);
+	nextAttempt = now + retryInterval;
+	retryInterval = min(retryInterval * 2, kMaxRetryInterval);
+	if (!IsNetworkError(errorCode))
+	{
+		// the token is no longer accepted; the owner enters again with a fresh one,
+		// the stale one is only tried again if that fails. A call has no token to renew.
+		nextAttempt = now + kMaxRetryInterval;
+		if (kind == Session::Room && resumeCallback)
+			refreshing = true;
+		if (resumeCallback)
+			resumeCallback(errorCode);
+	}
+}
+
+void RTCClient::FinishResume()
+{
+	resuming = false;
+	unique_lock<mutex> lck(statsMutex);
+	sessionStats.resumes++;
+	sessionStats.lastOutage = NowMs() - lossTime;
 }
@@ -3,43 +3,163 @@
 #include <TCPClient.h>
 #include <UDPClient.h>
 #include <IQuestProcessor.h>
+#include <atomic>
+#include <condition_variable>
+#include <thread>
+#include "MediaBuffer.h"
+#include "MediaDispatcher.h"
+#include "MediaPacer.h"
+#include "MediaSocket.h"
+#include "NetworkMonitor.h"
 
 using namespace fpnn;
 using namespace std;
 
+class RTCGateQuestProcessor;
+
 class RTCClient
 {
-	ClientPtr client;
+public:
+	struct SessionStats
+	{
+		int32_t resumes = 0;
+		int64_t lastOutage = 0;		// ms from detecting the gate loss to being back in the room
+		int64_t lastMediaGap = 0;	// ms between the last media packet before the loss and the first after
+	};
+
+private:
+	enum class Session
+	{
+		None,
+		Room,
+		P2P
+	};
+
+	ClientPtr client;				// replaced on reconnect, read through GetClient
+	mutex clientMutex;
 	IQuestProcessorPtr processor;
+	RTCGateQuestProcessor* gateProcessor;
+	atomic<uint8_t> mediaHeaderVersion;	// 0 until the gate advertises binary media headers
+	unique_ptr<MediaPacer> pacer;
+	string host;
+	unsigned short port;
+	atomic<bool> mediaSocketEnabled;
+	atomic<int64_t> connectStart;	// ms, when the current client began connecting
+	unique_ptr<MediaSocket> mediaSocket;
+
+	// what to replay after a reconnect
+	Session session = Session::None;
+	int64_t sessionPid = 0;
+	int64_t sessionRid = 0;
+	int64_t sessionUid = 0;
+	string sessionToken;
+	int32_t p2pType = 0;
+	int64_t p2pPeerUid = 0;
+	int64_t p2pCallId = 0;
+	mutex sessionMutex;
+
+	atomic<bool> probing;
+	int64_t lastProbe = 0;			// watchdog thread only
+	shared_ptr<NetworkMonitor> monitor;
+	function<void(const NetworkMonitor::Stats& stats)> qualityCallback;
+	int64_t lastReport = 0;
+	int64_t lastFramesSent = 0;
+	int64_t lastFramesDropped = 0;
+	atomic<bool> sessionRenewed;	// set by every successful enter
+	bool resuming = false;			// watchdog thread only
+	int64_t lossTime = 0;
+	int64_t nextAttempt = 0;
+	int64_t retryInterval = 0;
+	atomic<bool> refreshing;		// the owner is getting a fresh token, no retries meanwhile
+	function<void(int errorCode)> resumeCallback;
+	SessionStats sessionStats;
+	mutex statsMutex;
+
+	bool running = true;
+	mutex watchdogMutex;
+	condition_variable watchdogCondition;
+	thread watchdog;
+
+	ClientPtr GetClient();
+	void UpdateMediaTransport(FPAReader& ar);
+	void RememberSession(Session kind, int64_t pid, int64_t rid, int64_t uid, const string& token, int32_t type, int64_t peerUid, int64_t callId);
+	void Watchdog();
+	void CheckGate();
+	void Probe(int64_t now);
+	void ReportQuality(int64_t now);
+	ClientPtr Reconnect(bool wait);
+	void Resume(int64_t now);
+	void FinishResume();
 public:
     RTCClient(string host, unsigned short port);
 	virtual ~RTCClient();
 
+	// stops the watchdog, the connections and the media workers; no callback
+	// runs once it returns, so the owner can take down what they use
+	void Shutdown();
+
 	bool EnterRTCRoom(int64_t pid, int64_t rid, int64_t uid, string token);
 	void EnterRTCRoom(int64_t pid, int64_t rid, int64_t uid, string token, function<void(int errorCode, bool microphone)> callback);
+	// call when an enter is coming (the token is on its way from RTM); returns at once
+	// and leaves a live gate connection behind. Does nothing in a room or a call
+	// set up through SetP2PRequest.
+	void Prepare();
 	void SetVideoCallback(function<
 		void(int64_t rid, int64_t uid, int64_t seq,
 			int64_t flags, int64_t timestamp, int64_t rotation,
 			int64_t version, int32_t facing, int32_t captureLevel,
-			vector<unsigned char> data, vector<unsigned char> sps, vector<unsigned char> pps)> callback);
-	void SetAudioCallback(function<void(int64_t uid, int64_t rid, int64_t seq, int64_t timestamp, vector<unsigned char> data)> callback);
-    void SendAudioData(int64_t rid, int64_t seq, int64_t timestamp, vector<unsigned char> data);
+			MediaBuffer data, MediaBuffer sps, MediaBuffer pps)> callback);
+	void SetAudioCallback(function<void(int64_t uid, int64_t rid, int64_t seq, int64_t timestamp, MediaBuffer data)> callback);
+    void SendAudioData(int64_t rid, int64_t seq, int64_t timestamp, const MediaBuffer& data);
 	void SendVideoData(int64_t rid, int64_t seq, int64_t flags, int64_t timestamp, int64_t rotation,
 		int64_t version, int32_t facing, int32_t captureLevel, 
-		vector<unsigned char> data, vector<unsigned char> sps, vector<unsigned char> pps);
+		const MediaBuffer& data, const MediaBuffer& sps, const MediaBuffer& pps);
 
 	void SetP2PVideoCallback(function<
 		void(int64_t uid, int64_t seq,
 			int64_t flags, int64_t timestamp, int64_t rotation,
 			int64_t version, int32_t facing, int32_t captureLevel,
-			vector<unsigned char> data, vector<unsigned char> sps, vector<unsigned char> pps)> callback);
-	void SetP2PAudioCallback(function<void(int64_t uid, int64_t seq, int64_t timestamp, vector<unsigned char> data)> callback);
+			MediaBuffer data, MediaBuffer sps, MediaBuffer pps)> callback);
+	void SetP2PAudioCallback(function<void(int64_t uid, int64_t seq, int64_t timestamp, MediaBuffer data)> callback);
 
 	void SetP2PRequest(int64_t pid, int64_t uid, int32_t type, int64_t peerUid, int64_t callid, function<void(int errorCode)> callback);
-	void SendP2PAudioData(int64_t seq, int64_t timestamp, vector<unsigned char> data);
+	void SendP2PAudioData(int64_t seq, int64_t timestamp, const MediaBuffer& data);
 	void SendP2PVideoData(int64_t seq, int64_t flags, int64_t timestamp, int64_t rotation,
 		int64_t version, int32_t facing, int32_t captureLevel,
-		vector<unsigned char> data, vector<unsigned char> sps, vector<unsigned char> pps);
+		const MediaBuffer& data, const MediaBuffer& sps, const MediaBuffer& pps);
+
+	// asks the gate to have uid send a keyframe; rid 0 for the p2p peer
+	void RequestKeyFrame(int64_t rid, int64_t uid);
+	void SetKeyFrameRequestCallback(function<void(int64_t rid, int64_t uid)> callback);
+	// incoming video of uid was dropped before decoding, on the receiving thread; rid 0 for the p2p peer
+	void SetVideoLossCallback(function<void(int64_t rid, int64_t uid)> callback);
+
+	// target rate video is paced to, kbps
+	void SetSendBitrate(int32_t kbps);
+	MediaPacer::Stats GetPacerStats();
+	// voice over a batched UDP socket when the gate offers one, takes effect on the next enter
+	void EnableMediaSocket(bool enable);
+	MediaSocket::Stats GetMediaSocketStats();
+	// incoming media runs on per stream workers; how busy they and the network threads are
+	MediaDispatcher::Stats GetDispatchStats();
+
+	// Once in a room or call, a quiet gate is probed with ping; when it stays
+	// silent the client reconnects and re-enters with the cached token. The
+	// callback gets 0 after a resume, or the gate's error when the token was
+	// turned down and the owner has to enter again with a fresh one; the
+	// watchdog waits for that enter, or for CancelRefresh when it failed.
+	void SetResumeCallback(function<void(int errorCode)> callback);
+	void CancelRefresh();
+	void ClearSession();
+	// a call set up through SetP2PRequest has ended; callId 0 for whichever call is remembered
+	void ClearP2PSession(int64_t callId);
+	SessionStats GetSessionStats();
 
+	// The gate is pinged every 2 seconds for round trips; loss and jitter of
+	// incoming media come from sequence numbers. Both directions are graded
+	// and reported every 2 seconds while in a room or a call set up through
+	// SetP2PRequest.
+	void SetNetworkQualityCallback(function<void(const NetworkMonitor::Stats& stats)> callback);
+	NetworkMonitor::Stats GetNetworkStats();
 };
 
@@ -20,6 +20,23 @@ public:
 		CloseUserCamera
 	};
 	enum class RoomEvent : int32_t {};
+	enum class NetworkQuality : int32_t
+	{
+		Unknown,
+		Excellent,
+		Good,
+		Poor,
+		Bad,
+		VeryBad,
+		Down
+	};
+	enum class RosterChange : int32_t
+	{
+		Entered,
+		Exited,
+		RoleChanged,
+		Resynced			// the whole member list was fetched again
+	};
 	virtual void OnUserEnterRTCRoom(int64_t uid, int64_t rid, int64_t mtime) {}
 	virtual void OnUserExitRTCRoom(int64_t uid, int64_t rid, int64_t mtime) {}
 	virtual void OnRTCRoomClosed(int64_t rid) {}
@@ -31,4 +48,13 @@ public:
 
 	virtual void OnPushP2PRTCRequest(int64_t callId, int64_t peerUid, int32_t type) {}
 	virtual void OnPushP2PRTCEvent(int64_t callId, int64_t peerUid, int32_t type, int32_t p2pEvent) {}
+
+	// every 2 seconds while in a room or call
+	virtual void OnNetworkQuality(NetworkQuality uplink, NetworkQuality downlink) {}
+	// someone just subscribed to our video; the encoder should send a keyframe now. rid is 0 on p2p calls
+	virtual void OnKeyFrameRequest(int64_t rid, int64_t fromUid) {}
+	// large room mode moved uid onto the tile, 0 when the tile is empty now
+	virtual void OnVideoTileChanged(int32_t tile, int64_t uid) {}
+	// the local member list of the current room changed; uid is 0 for Resynced
+	virtual void OnRosterChanged(int64_t rid, int64_t uid, RosterChange change, int64_t version) {}
 };
\ No newline at end of file
@@ -1,22 +1,86 @@
 #include "RTCGateQuestProcessor.h"
+#include "MediaHeader.h"
+#include <chrono>
 
 using namespace std;
 
+namespace
+{
+    // The payload already sits in the reader's msgpack zone; hand out a view
+    // that keeps the reader alive instead of copying it into a vector.
+    MediaBuffer BorrowBinary(const FPReaderPtr& args, const char* key)
+    {
+        msgpack::object obj = args->getObject(key);
+        if (obj.type == msgpack::type::BIN)
+            return MediaBuffer(args, (const unsigned char*)obj.via.bin.ptr, obj.via.bin.size);
+        if (obj.type == msgpack::type::STR)
+            return MediaBuffer(args, (const unsigned char*)obj.via.str.ptr, obj.via.str.size);
+        return MediaBuffer();
+    }
+
+    // payload trailing the header inside "m", or sent next to it as "data"
+    MediaBuffer MediaPayload(const FPReaderPtr& args, const MediaBuffer& media, const MediaPacket& packet)
+    {
+        if (packet.dataLength > 0)
+            return media.Slice(packet.data - media.data(), packet.dataLength);
+        return BorrowBinary(args, "data");
+    }
+
+    // charges the time a network thread spends on incoming packets to the dispatcher
+    class ReceiveTimer
+    {
+        MediaDispatcher& dispatcher;
+        int64_t packets;
+        chrono::steady_clock::time_point start;
+    public:
+        ReceiveTimer(MediaDispatcher& dispatcher, int64_t packets = 1) :
+            dispatcher(dispatcher), packets(packets), start(chrono::steady_clock::now()) {}
+        ~ReceiveTimer()
+        {
+            dispatcher.RecordReceive(packets, chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count());
+        }
+    };
+}
+
 RTCGateQuestProcessor::RTCGateQuestProcessor():
     videoCallback(nullptr),
-    voiceCallback(nullptr)
+    voiceCallback(nullptr),
+    stopped(false),
+    lastActivity(0),
+    lastMedia(0),
+    gapStart(0),
+    lastGap(0),
+    dispatcher(make_unique<MediaDispatcher>())
 {
     registerMethod("pushVoice", &RTCGateQuestProcessor::voice);
     registerMethod("pushVideo", &RTCGateQuestProcessor::video);
     registerMethod("ping", &RTCGateQuestProcessor::ping);
+    registerMethod("pushKeyFrameRequest", &RTCGateQuestProcessor::keyFrameRequest);
 
     registerMethod("pushP2PVoice", &RTCGateQuestProcessor::p2pVoice);
     registerMethod("pushP2PVideo", &RTCGateQuestProcessor::p2pVideo);
 }
 RTCGateQuestProcessor::~RTCGateQuestProcessor() {}
 
+void RTCGateQuestProcessor::Shutdown()
+{
+    stopped = true;
+    dispatcher->Stop();
+}
+
 FPAnswerPtr RTCGateQuestProcessor::video(const FPReaderPtr args, const FPQuestPtr quest, const ConnectionInfo& ci)
 {
+    ReceiveTimer timer(*dispatcher);
+    OnActivity(true);
+    MediaBuffer media = BorrowBinary(args, "m");
+    if (media.size() > 0)
+    {
+        MediaPacket packet;
+        if (ParseMedia(media.data(), media.size(), MediaType::Video, packet))
+            DispatchMedia(args->wantInt("uid"), packet, media, MediaPayload(args, media, packet), false);
+        return nullptr;
+    }
+
     int64_t timestamp = args->wantInt("timestamp");
     int64_t uid = args->wantInt("uid");
     int64_t rid = args->wantInt("rid"); 
@@ -26,50 +90,188 @@ FPAnswerPtr RTCGateQuestProcessor::video(const FPReaderPtr args, const FPQuestPt
     int64_t version = args->wantInt("version"); 
     int32_t facing = args->wantInt("facing");  
     int32_t captureLevel = args->wantInt("captureLevel");
-    vector<unsigned char> data = args->want("data", vector<unsigned char>()); 
-    vector<unsigned char> sps = args->want("sps", vector<unsigned char>()); 
-    vector<unsigned char> pps = args->want("pps", vector<unsigned char>());
+    MediaBuffer data = BorrowBinary(args, "data");
+    MediaBuffer sps = BorrowBinary(args, "sps");
+    MediaBuffer pps = BorrowBinary(args, "pps");
+    int64_t arrival = lastMedia;
 
     if (videoCallback)
-        videoCallback(rid, uid, seq, flags, timestamp, rotation, version, facing, captureLevel, data, sps, pps);
+        PostVideo(rid, uid, [=]() {
+            TrackMedia(uid, true, seq, timestamp, arrival);
+            videoCallback(rid, uid, seq, flags, timestamp, rotation, version, facing, captureLevel, data, sps, pps);
+            });
 
     return nullptr;
 }
 
 FPAnswerPtr RTCGateQuestProcessor::voice(const FPReaderPtr args, const FPQuestPtr quest, const ConnectionInfo& ci)
 {
+    ReceiveTimer timer(*dispatcher);
+    OnActivity(true);
+    MediaBuffer media = BorrowBinary(args, "m");
+    if (media.size() > 0)
+    {
+        MediaPacket packet;
+        if (ParseMedia(media.data(), media.size(), MediaType::Voice, packet))
+            DispatchMedia(args->wantInt("uid"), packet, media, MediaPayload(args, media, packet), false);
+        return nullptr;
+    }
+
     int64_t timestamp = args->wantInt("timestamp");
     int64_t uid = args->wantInt("uid");
     int64_t rid = args->wantInt("rid");
     int64_t seq = args->wantInt("seq");
-    vector<unsigned char> data = args->want("data", vector<unsigned char>());
+    MediaBuffer data = BorrowBinary(args, "data");
+    int64_t arrival = lastMedia;
 
     if (voiceCallback)
-        voiceCallback(uid, rid, seq, timestamp, data);
+        dispatcher->Post(uid, false, [=]() {
+            TrackMedia(uid, false, seq, timestamp, arrival);
+            voiceCallback(uid, rid, seq, timestamp, data);
+            });
 
     return nullptr;
 }
 
+void RTCGateQuestProcessor::TrackMedia(int64_t uid, bool video, int64_t seq, int64_t timestamp, int64_t arrival)
+{
+    if (monitor)
+        monitor->OnMedia(uid, video, seq, timestamp, arrival);
+}
+
+void RTCGateQuestProcessor::PostVideo(int64_t rid, int64_t uid, function<void()> task)
+{
+    if (!dispatcher->Post(uid, true, move(task)) && videoLossCallback && !stopped)
+        videoLossCallback(rid, uid);
+}
+
+void RTCGateQuestProcessor::DispatchMedia(int64_t uid, const MediaPacket& packet, const MediaBuffer& media, MediaBuffer payload, bool p2p)
+{
+    bool video = packet.header.type == (uint8_t)MediaType::Video;
+    int64_t arrival = lastMedia;
+    // packet points into media, which the copy keeps alive
+    function<void()> task = [this, uid, video, packet, media, payload, p2p, arrival]() {
+        TrackMedia(uid, video, packet.header.seq, packet.header.timestamp, arrival);
+        DeliverMedia(uid, packet, media, payload, p2p);
+    };
+    if (video)
+        PostVideo(p2p ? 0 : packet.header.rid, uid, move(task));
+    else
+        dispatcher->Post(uid, false, move(task));
+}
+
+void RTCGateQuestProcessor::DeliverMedia(int64_t uid, const MediaPacket& packet, const MediaBuffer& media, const MediaBuffer& payload, bool p2p)
+{
+    if (packet.header.type == (uint8_t)MediaType::Voice)
+    {
+        if (p2p && p2pVoiceCallback)
+            p2pVoiceCallback(uid, packet.header.seq, packet.header.timestamp, payload);
+        else if (!p2p && voiceCallback)
+            voiceCallback(uid, packet.header.rid, packet.header.seq, packet.header.timestamp, payload);
+        return;
+    }
+
+    MediaBuffer sps = media.Slice(packet.sps - media.data(), packet.video.spsLength);
+    MediaBuffer pps = media.Slice(packet.pps - media.data(), packet.video.ppsLength);
+    if (p2p && p2pVideoCallback)
+        p2pVideoCallback(uid, packet.header.seq, packet.header.flags, packet.header.timestamp,
+            packet.video.rotation, packet.video.version, packet.video.facing, packet.video.captureLevel,
+            payload, move(sps), move(pps));
+    else if (!p2p && videoCallback)
+        videoCallback(packet.header.rid, uid, packet.header.seq, packet.header.flags, packet.header.timestamp,
+            packet.video.rotation, packet.video.version, packet.video.facing, packet.video.captureLevel,
+            payload, move(sps), move(pps));
+}
+
+void RTCGateQuestProcessor::OnMediaBurst(vector<MediaSocket::Datagram>& burst)
+{
+    ReceiveTimer timer(*dispatcher, burst.size());
+    OnActivity(true);
+    // the payload always trails the header here; p2p packets carry rid 0
+    for (auto& datagram : burst)
+    {
+        const MediaBuffer& media = datagram.data;
+        if (media.size() < 2 || media.data()[1] > (uint8_t)MediaType::Video)
+            continue;
+        MediaPacket packet;
+        if (!ParseMedia(media.data(), media.size(), (MediaType)media.data()[1], packet))
+            continue;
+        DispatchMedia(datagram.uid, packet, media, media.Slice(packet.data - media.data(), packet.dataLength), packet.header.rid == 0);
+    }
+}
+
+void RTCGateQuestProcessor::OnActivity(bool media)
+{
+    int64_t now = chrono::steady_clock::now().time_since_epoch().count() / 1000000;
+    lastActivity = now;
+    if (!media)
+        return;
+    lastMedia = now;
+    if (gapStart != 0)
+    {
+        int64_t start = gapStart.exchange(0);
+        if (start != 0)
+            lastGap = now - start;
+    }
+}
+
 FPAnswerPtr RTCGateQuestProcessor::ping(const FPReaderPtr args, const FPQuestPtr quest, const ConnectionInfo& ci)
 {
+    OnActivity(false);
     return FPAWriter::emptyAnswer(quest);
 }
 
+FPAnswerPtr RTCGateQuestProcessor::keyFrameRequest(const FPReaderPtr args, const FPQuestPtr quest, const ConnectionInfo& ci)
+{
+    OnActivity(false);
+    int64_t rid = args->getInt("rid");
+    int64_t uid = args->wantInt("uid");
+    if (keyFrameCallback)
+        keyFrameCallback(rid, uid);
+    return nullptr;
+}
+
 FPAnswerPtr RTCGateQuestProcessor::p2pVoice(const FPReaderPtr args, const FPQuestPtr quest, const ConnectionInfo& ci)
 {
+    ReceiveTimer timer(*dispatcher);
+    OnActivity(true);
+    MediaBuffer media = BorrowBinary(args, "m");
+    if (media.size() > 0)
+    {
+        MediaPacket packet;
+        if (ParseMedia(media.data(), media.size(), MediaType::Voice, packet))
+            DispatchMedia(args->wantInt("uid"), packet, media, MediaPayload(args, media, packet), true);
+        return nullptr;
+    }
+
     int64_t timestamp = args->wantInt("timestamp");
     int64_t uid = args->wantInt("uid");
     int64_t seq = args->wantInt("seq");
-    vector<unsigned char> data = args->want("data", vector<unsigned char>());
+    MediaBuffer data = BorrowBinary(args, "data");
+    int64_t arrival = lastMedia;
 
     if (p2pVoiceCallback)
-        p2pVoiceCallback(uid, seq, timestamp, data);
+        dispatcher->Post(uid, false, [=]() {
+            TrackMedia(uid, false, seq, timestamp, arrival);
+            p2pVoiceCallback(uid, seq, timestamp, data);
+            });
 
     return nullptr;
 }
 
 FPAnswerPtr RTCGateQuestProcessor::p2pVideo(const FPReaderPtr args, const FPQuestPtr quest, const ConnectionInfo& ci)
 {
+    ReceiveTimer timer(*dispatcher);
+    OnActivity(true);
+    MediaBuffer media = BorrowBinary(args, "m");
+    if (media.size() > 0)
+    {
+        MediaPacket packet;
+        if (ParseMedia(media.data(), media.size(), MediaType::Video, packet))
+            DispatchMedia(args->wantInt("uid"), packet, media, MediaPayload(args, media, packet), true);
+        return nullptr;
+    }
+
     int64_t timestamp = args->wantInt("timestamp");
     int64_t uid = args->wantInt("uid");
     int64_t seq = args->wantInt("seq");
@@ -78,12 +280,16 @@ FPAnswerPtr RTCGateQuestProcessor::p2pVideo(const FPReaderPtr args, const FPQues
     int64_t version = args->wantInt("version");
     int32_t facing = args->wantInt("facing");
     int32_t captureLevel = args->wantInt("captureLevel");
-    vector<unsigned char> data = args->want("data", vector<unsigned char>());
-    vector<unsigned char> sps = args->want("sps", vector<unsigned char>());
-    vector<unsigned char> pps = args->want("pps", vector<unsigned char>());
+    MediaBuffer data = BorrowBinary(args, "data");
+    MediaBuffer sps = BorrowBinary(args, "sps");
+    MediaBuffer pps = BorrowBinary(args, "pps");
+    int64_t arrival = lastMedia;
 
     if (p2pVideoCallback)
-        p2pVideoCallback(uid, seq, flags, timestamp, rotation, version, facing, captureLevel, data, sps, pps);
+        PostVideo(0, uid, [=]() {
+            TrackMedia(uid, true, seq, timestamp, arrival);
+            p2pVideoCallback(uid, seq, flags, timestamp, rotation, version, facing, captureLevel, data, sps, pps);
+            });
 
     return nullptr;
 }
@@ -107,3 +313,18 @@ void RTCGateQuestProcessor::SetP2PVoiceCallback(P2PVoiceCallback callback)
 {
     p2pVoiceCallback = callback;
 }
+
+void RTCGateQuestProcessor::SetNetworkMonitor(shared_ptr<NetworkMonitor> networkMonitor)
+{
+    monitor = networkMonitor;
+}
+
+void RTCGateQuestProcessor::SetKeyFrameCallback(KeyFrameCallback callback)
+{
+    keyFrameCallback = callback;
+}
+
+void RTCGateQuestProcessor::SetVideoLossCallback(VideoLossCallback callback)
+{
+    videoLossCallback = callback;
+}
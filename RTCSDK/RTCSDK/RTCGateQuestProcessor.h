@@ -1,10 +1,17 @@
 #pragma once
 #include <IQuestProcessor.h>
 #include <functional>
+#include <atomic>
+#include "MediaBuffer.h"
+#include "MediaDispatcher.h"
+#include "MediaSocket.h"
+#include "NetworkMonitor.h"
 
 using namespace fpnn;
 using namespace std;
 
+struct MediaPacket;
+
 class RTCGateQuestProcessor : public IQuestProcessor
 {
     QuestProcessorClassPrivateFields(RTCGateQuestProcessor)
@@ -12,17 +19,40 @@ class RTCGateQuestProcessor : public IQuestProcessor
     typedef function<void(int64_t rid, int64_t uid, int64_t seq,
         int64_t flags, int64_t timestamp, int64_t rotation,
         int64_t version, int32_t facing, int32_t captureLevel,
-        vector<unsigned char> data, vector<unsigned char> sps, vector<unsigned char> pps)> VideoCallback;
+        MediaBuffer data, MediaBuffer sps, MediaBuffer pps)> VideoCallback;
     VideoCallback videoCallback;
     typedef function<void(int64_t uid, int64_t seq,
         int64_t flags, int64_t timestamp, int64_t rotation,
         int64_t version, int32_t facing, int32_t captureLevel,
-        vector<unsigned char> data, vector<unsigned char> sps, vector<unsigned char> pps)> P2PVideoCallback;
+        MediaBuffer data, MediaBuffer sps, MediaBuffer pps)> P2PVideoCallback;
     P2PVideoCallback p2pVideoCallback;
-    typedef function<void(int64_t uid, int64_t rid, int64_t seq, int64_t timestamp, vector<unsigned char> data)> VoiceCallback;
+    typedef function<void(int64_t uid, int64_t rid, int64_t seq, int64_t timestamp, MediaBuffer data)> VoiceCallback;
     VoiceCallback voiceCallback;
-    typedef function<void(int64_t uid, int64_t seq, int64_t timestamp, vector<unsigned char> data)> P2PVoiceCallback;
+    typedef function<void(int64_t uid, int64_t seq, int64_t timestamp, MediaBuffer data)> P2PVoiceCallback;
     P2PVoiceCallback p2pVoiceCallback;
+    // a subscriber of ours asks for a keyframe; rid 0 on p2p calls
+    typedef function<void(int64_t rid, int64_t uid)> KeyFrameCallback;
+    KeyFrameCallback keyFrameCallback;
+    // a video packet of uid was dropped undecoded; rid 0 on p2p calls
+    typedef function<void(int64_t rid, int64_t uid)> VideoLossCallback;
+    VideoLossCallback videoLossCallback;
+
+    atomic<bool> stopped;
+    atomic<int64_t> lastActivity;   // ms, anything from the gate
+    atomic<int64_t> lastMedia;
+    atomic<int64_t> gapStart;       // last media before a gate loss, 0 when not measuring
+    atomic<int64_t> lastGap;
+    shared_ptr<NetworkMonitor> monitor;
+    // the callbacks run here, never on the FPNN or MediaSocket threads
+    unique_ptr<MediaDispatcher> dispatcher;
+
+    // on the stream's worker, which keeps the network threads to parsing and posting;
+    // arrival was taken when the packet came in
+    void TrackMedia(int64_t uid, bool video, int64_t seq, int64_t timestamp, int64_t arrival);
+    // reports the packet when the worker drops it, the frames after it can't decode
+    void PostVideo(int64_t rid, int64_t uid, function<void()> task);
+    void DispatchMedia(int64_t uid, const MediaPacket& packet, const MediaBuffer& media, MediaBuffer payload, bool p2p);
+    void DeliverMedia(int64_t uid, const MediaPacket& packet, const MediaBuffer& media, const MediaBuffer& payload, bool p2p);
 public:
     RTCGateQuestProcessor();
     ~RTCGateQuestProcessor();
@@ -30,6 +60,7 @@ public:
     FPAnswerPtr voice(const FPReaderPtr args, const FPQuestPtr quest, const ConnectionInfo& ci);
     FPAnswerPtr video(const FPReaderPtr args, const FPQuestPtr quest, const ConnectionInfo& ci);
     FPAnswerPtr ping(const FPReaderPtr args, const FPQuestPtr quest, const ConnectionInfo& ci);
+    FPAnswerPtr keyFrameRequest(const FPReaderPtr args, const FPQuestPtr quest, const ConnectionInfo& ci);
 
     FPAnswerPtr p2pVoice(const FPReaderPtr args, const FPQuestPtr quest, const ConnectionInfo& ci);
     FPAnswerPtr p2pVideo(const FPReaderPtr args, const FPQuestPtr quest, const ConnectionInfo& ci);
@@ -39,6 +70,21 @@ public:
 
     void SetP2PVideoCallback(P2PVideoCallback callback);
     void SetP2PVoiceCallback(P2PVoiceCallback callback);
+    void SetKeyFrameCallback(KeyFrameCallback callback);
+    void SetVideoLossCallback(VideoLossCallback callback);
+    void SetNetworkMonitor(shared_ptr<NetworkMonitor> networkMonitor);
+    MediaDispatcher::Stats GetDispatchStats() { return dispatcher->GetStats(); }
+    // returns once no media callback runs any more, none is called afterwards
+    void Shutdown();
+
+    // packets that came over the MediaSocket instead of as quests
+    void OnMediaBurst(vector<MediaSocket::Datagram>& burst);
+
+    void OnActivity(bool media);
+    int64_t GetLastActivity() { return lastActivity; }
+    // the gap closes with the next media packet
+    void StartMediaGap() { gapStart = lastMedia.load(); }
+    int64_t GetLastMediaGap() { return lastGap; }
 
     QuestProcessorClassBasicPublicFuncs
 };
\ No newline at end of file
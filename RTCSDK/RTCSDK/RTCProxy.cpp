@@ -6,173 +6,173 @@
 #include <AudioRecorder.h>
 #include <D3D12Renderer.h>
 
+#include <algorithm>
+#include <chrono>
+
 #include "OpenH264Decoder.h"
 
+namespace
+{
+	const DWORD kLastNInterval = 500;		// ms between tile updates in large room mode
+	const int64_t kRosterCheckInterval = 30000;	// ms, member count compared with the server's at most this often
+	const DWORD kRosterRetryInterval = 2000;	// ms between fetches of a member list that failed to come
+	const int64_t kThumbnailInterval = 1000;	// ms between thumbnail frames at most
+	const size_t kMaxQueuedFrames = 60;		// 2 s at 30 fps, longer than the synchronizer ever holds a frame
+
+	thread_local bool inLastNProc = false;	// the app may call SetVideoTiles from OnVideoTileChanged
+}
+
 RTCProxy::RTCProxy(string rtmhost, unsigned short rtmport, int64_t pid, int64_t uid, shared_ptr<RTMEventHandler> rtmhandler, string rtchost, unsigned short rtcport, shared_ptr<RTCEventHandler> rtchandler):
     RTMProxy(rtmhost,rtmport, pid, uid, rtmhandler),
 	rtc(new RTCClient(rtchost,rtcport)),
 	player(new AudioPlayer()),
 	recorder(new AudioRecorder())
 {
+	eventHandler = rtchandler;
 	rtm->SetRTCEventHandler(make_shared<InternalEventHandler>(rtchandler, this));
-    rtc->SetVideoCallback([this](int64_t rid, int64_t uid, int64_t seq, int64_t flags, int64_t timestamp, int64_t rotation, int64_t version, int32_t facing, int32_t captureLevel, vector<unsigned char> data, vector<unsigned char> sps, vector<unsigned char> pps) {
-        auto mapiter = userMaps.find(uid);
-        if (mapiter != userMaps.end())
-        {
-            if (mapiter->second->captureLevel != captureLevel)
-            {
-                mapiter->second->captureLevel = captureLevel;
-                if (mapiter->second->hTimer != NULL)
-                {
-                    HANDLE hComplete = CreateEvent(NULL, true, false, NULL);
-                    DeleteTimerQueueTimer(NULL, mapiter->second->hTimer, hComplete);
-                    WaitForSingleObject(hComplete, INFINITE);
-                    CloseHandle(hComplete);
-                }
-                int frameRate = 0;
-                if (captureLevel == 1)
-                {
-                    frameRate = 15;
-                }
-                else
-                {
-                    frameRate = 30;
-                }
-                CreateTimerQueueTimer(&(mapiter->second->hTimer), NULL, TimerProc, mapiter->second, 0, 1000 / frameRate, WT_EXECUTEDEFAULT);
-            }
-
-            if (mapiter->second->decoder->IsInited())
-            {
-                unique_lock<mutex> lck(mapiter->second->dataMutex);
-
-                auto iter = upper_bound(mapiter->second->frameQueue.begin(), mapiter->second->frameQueue.end(), seq,
-                    [](const long long a, const pair<long long, vector<BYTE>>& b) {return a < b.first; });
-
-                mapiter->second->frameQueue.emplace(iter, make_pair(seq, data));
-
-                if (mapiter->second->frameQueue.size() > 3)
-                {
-                    mapiter->second->isReady = true;
-                }
-
-            }
-            else
-            {
-                if (sps.size() > 0 && pps.size() > 0)
-                {
-                    mapiter->second->decoder->Decode(sps.data(), sps.size());
-                    mapiter->second->decoder->Decode(pps.data(), pps.size());
-                    mapiter->second->decoder->SetInited(true);
-                }
-            }
-        }
+	rtc->SetNetworkQualityCallback([rtchandler](const NetworkMonitor::Stats& stats) {
+		rtchandler->OnNetworkQuality(stats.uplink, stats.downlink);
+		});
+	rtc->SetKeyFrameRequestCallback([rtchandler](int64_t rid, int64_t uid) {
+		rtchandler->OnKeyFrameRequest(rid, uid);
+		});
+	rtc->SetVideoLossCallback([this](int64_t rid, int64_t uid) {
+		shared_ptr<UserData> userData = rid != 0 ? userMaps.Find(uid) : GetP2PUser();
+		// asked for once per loss, however many packets the backlog drops
+		if (userData != nullptr && !userData->videoLost.exchange(true))
+			rtc->RequestKeyFrame(rid, uid);
+		});
+    rtc->SetVideoCallback([this](int64_t rid, int64_t uid, int64_t seq, int64_t flags, int64_t timestamp, int64_t rotation, int64_t version, int32_t facing, int32_t captureLevel, MediaBuffer data, MediaBuffer sps, MediaBuffer pps) {
+        CacheParameterSets(uid, sps, pps);
+        shared_ptr<UserData> userData = userMaps.Find(uid);
+        if (userData != nullptr)
+            OnVideoFrame(*userData, rid, seq, timestamp, captureLevel, move(data), sps, pps);
         });
 
-	rtc->SetP2PVideoCallback([this](int64_t uid, int64_t seq, int64_t flags, int64_t timestamp, int64_t rotation, int64_t version, int32_t facing, int32_t captureLevel, vector<unsigned char> data, vector<unsigned char> sps, vector<unsigned char> pps) {
-		if (p2pUserData != nullptr)
-		{
-			if (p2pUserData->captureLevel != captureLevel)
-			{
-				p2pUserData->captureLevel = captureLevel;
-				if (p2pUserData->hTimer != NULL)
-				{
-					HANDLE hComplete = CreateEvent(NULL, true, false, NULL);
-					DeleteTimerQueueTimer(NULL, p2pUserData->hTimer, hComplete);
-					WaitForSingleObject(hComplete, INFINITE);
-					CloseHandle(hComplete);
-				}
-				int frameRate = 0;
-				if (captureLevel == 1)
-				{
-					frameRate = 15;
-				}
-				else
-				{
-					frameRate = 30;
-				}
-				CreateTimerQueueTimer(&(p2pUserData->hTimer), NULL, TimerProc, p2pUserData, 0, 1000 / frameRate, WT_EXECUTEDEFAULT);
-			}
-
-			if (p2pUserData->decoder->IsInited())
-			{
-				unique_lock<mutex> lck(p2pUserData->dataMutex);
-
-				auto iter = upper_bound(p2pUserData->frameQueue.begin(), p2pUserData->frameQueue.end(), seq,
-					[](const long long a, const pair<long long, vector<BYTE>>& b) {return a < b.first; });
-
-				p2pUserData->frameQueue.emplace(iter, make_pair(seq, data));
-
-				if (p2pUserData->frameQueue.size() > 3)
-				{
-					p2pUserData->isReady = true;
-				}
-
-			}
-			else
-			{
-				if (sps.size() > 0 && pps.size() > 0)
-				{
-					p2pUserData->decoder->Decode(sps.data(), sps.size());
-					p2pUserData->decoder->Decode(pps.data(), pps.size());
-					p2pUserData->decoder->SetInited(true);
-				}
-			}
-		}
+	rtc->SetP2PVideoCallback([this](int64_t uid, int64_t seq, int64_t flags, int64_t timestamp, int64_t rotation, int64_t version, int32_t facing, int32_t captureLevel, MediaBuffer data, MediaBuffer sps, MediaBuffer pps) {
+		CacheParameterSets(uid, sps, pps);
+		shared_ptr<UserData> userData = GetP2PUser();
+		if (userData != nullptr)
+			OnVideoFrame(*userData, 0, seq, timestamp, captureLevel, move(data), sps, pps);
 		});
 
-    rtc->SetAudioCallback([this](int64_t uid, int64_t rid, int64_t seq, int64_t timestamp, vector<unsigned char>data) {
-        player->PutAudioData(uid, timestamp, (char*)data.data(), data.size());
+    rtc->SetAudioCallback([this](int64_t uid, int64_t rid, int64_t seq, int64_t timestamp, MediaBuffer data) {
+        player->PutAudioData(uid, timestamp, (const char*)data.data(), data.size());
         });
-	rtc->SetP2PAudioCallback([this](int64_t uid, int64_t seq, int64_t timestamp, vector<unsigned char>data) {
-		player->PutAudioData(uid, timestamp, (char*)data.data(), data.size());
+	rtc->SetP2PAudioCallback([this](int64_t uid, int64_t seq, int64_t timestamp, MediaBuffer data) {
+		if (p2pFirstAudio == 0 && p2pAcceptTime != 0)
+			p2pFirstAudio = chrono::steady_clock::now().time_since_epoch().count() / 1000000;
+		player->PutAudioData(uid, timestamp, (const char*)data.data(), data.size());
 		});
     recorder->SetAudioCallback([this](shared_ptr<vector<BYTE>> data) {
+        MediaBuffer buffer(data, data->data(), data->size());
         if (p2pStatus == 2)
         {
 			if (!muted)
-				rtc->SendP2PAudioData(audioSeq++, chrono::steady_clock::now().time_since_epoch().count() / 1000000, *data);
+				rtc->SendP2PAudioData(audioSeq++, chrono::steady_clock::now().time_since_epoch().count() / 1000000, buffer);
         }
-        else
+        else if (p2pStatus == 0 && currentRid != 0)
         {
+            // a ringing call or a join in progress only has the devices open, nothing goes out yet
             if (!muted)
-                rtc->SendAudioData(currentRid, audioSeq++, chrono::steady_clock::now().time_since_epoch().count() / 1000000, *data);
+                rtc->SendAudioData(currentRid, audioSeq++, chrono::steady_clock::now().time_since_epoch().count() / 1000000, buffer);
         }
         });
+	rtc->SetResumeCallback([this](int errorCode) {
+		if (errorCode == 0)
+		{
+			if (p2pStatus == 2)
+			{
+				// the peer's stream picks up again from a keyframe
+				rtc->RequestKeyFrame(0, p2pPeerUid);
+				return;
+			}
+			ResubscribeVideo();
+			// pushes may have been lost with the connection
+			ResyncRoster();
+			return;
+		}
+		if (p2pStatus != 0)
+			return;
+		// the cached token was turned down, get a fresh one through RTM
+		int64_t rid = currentRid;
+		rtm->EnterRTCRoom(rid, [this, rid](int errorCode, string token) {
+			if (errorCode != 0)
+			{
+				rtc->CancelRefresh();
+				return;
+			}
+			rtc->EnterRTCRoom(currentPid, rid, currentUid, token, [this](int errorCode, bool microphone) {
+				if (errorCode == 0)
+					ResubscribeVideo();
+				else
+					rtc->CancelRefresh();
+				});
+			});
+		});
+	// a quiet room sends no push that would ask for a failed fetch again
+	CreateTimerQueueTimer(&rosterTimer, NULL, RosterProc, this, kRosterRetryInterval, kRosterRetryInterval, WT_EXECUTEDEFAULT);
 }
 
 RTCProxy::~RTCProxy()
 {
+	// rtc is destroyed last, its threads must not reach the members going before it
+	rtm->SetRTCEventHandler(nullptr);
+	rtc->Shutdown();
+	if (rosterTimer != NULL)
+	{
+		HANDLE hComplete = CreateEvent(NULL, true, false, NULL);
+		DeleteTimerQueueTimer(NULL, rosterTimer, hComplete);
+		WaitForSingleObject(hComplete, INFINITE);
+		CloseHandle(hComplete);
+	}
+    StopLastNTimer();
+    for (auto& tile : tiles)
+        RetireRenderer(tile.spare);
     recorder->Stop();
     player->Stop();
 }
 
 void RTCProxy::StartAudio()
 {
+	audioStarted = true;
 	player->Start();
 	recorder->Start();
 }
 
 void RTCProxy::StopAudio()
 {
+	audioStarted = false;
+	audioWarmed = false;
 	recorder->Stop();
 	player->Stop();
 }
 
+void RTCProxy::SetAudioPacketDuration(int32_t duration)
+{
+	recorder->SetPacketDuration(duration);
+}
+
+void RTCProxy::SetMusicMode(bool enable)
+{
+	recorder->SetMusicMode(enable);
+}
+
 void RTCProxy::CreateRTCRoom(int32_t type, int64_t rid, int32_t enableRecord, function<void(int errorCode, bool microphone)> callback)
 {
     if (!busy)
     {
+        // the gate and the audio devices get ready while RTM hands out the token
+        rtc->Prepare();
+        WarmAudio();
         rtm->CreateRTCRoom(type, rid, enableRecord, [this, rid, callback](int errorCode, string token) {
             if (errorCode == 0)
             {
-                currentRid = rid;
-				rtc->EnterRTCRoom(currentPid, rid, currentUid, token, [this,callback](int errorCode, bool microphone) {
-					busy = true;
-					callback(errorCode, microphone); 
-					});
+                EnterGate(rid, token, false, callback);
             }
             else
             {
+                ReleaseWarmAudio();
                 callback(errorCode, false);
             }
             });
@@ -183,96 +183,575 @@ void RTCProxy::EnterRTCRoom(int64_t rid, function<void(int errorCode, bool micro
 {
     if (!busy)
     {
+        rtc->Prepare();
+        WarmAudio();
+        // pulled into the room, RTM already sent the token along
+        string token = TakePulledToken(rid);
+        if (token.size() > 0)
+        {
+            EnterGate(rid, token, true, callback);
+            return;
+        }
         rtm->EnterRTCRoom(rid, [this, rid, callback](int errorCode, string token) {
             if (errorCode == 0)
             {
-                rtc->EnterRTCRoom(currentPid, rid, currentUid, token, [rid, this, callback](int errorCode, bool microphone) {
-                    if (errorCode == 0)
-                    {
-                        currentRid = rid;
-						busy = true;
-                    }
-                    callback(errorCode, microphone);
-                    });
+                EnterGate(rid, token, false, callback);
             }
             else
             {
+                ReleaseWarmAudio();
                 callback(errorCode, false);
             }
             });
     }
 }
 
+void RTCProxy::EnterGate(int64_t rid, string token, bool pulled, function<void(int errorCode, bool microphone)> callback)
+{
+	rtc->EnterRTCRoom(currentPid, rid, currentUid, token, [this, rid, pulled, callback](int errorCode, bool microphone) {
+		if (errorCode == 0)
+		{
+			currentRid = rid;
+			busy = true;
+			roster.Reset(rid);
+			ResyncRoster();
+			callback(errorCode, microphone);
+			return;
+		}
+		if (pulled)
+		{
+			// the pushed token may have gone stale in the meantime, get a fresh one
+			rtm->EnterRTCRoom(rid, [this, rid, callback](int errorCode, string token) {
+				if (errorCode == 0)
+				{
+					EnterGate(rid, token, false, callback);
+				}
+				else
+				{
+					ReleaseWarmAudio();
+					callback(errorCode, false);
+				}
+				});
+			return;
+		}
+		ReleaseWarmAudio();
+		callback(errorCode, microphone);
+		});
+}
+
+string RTCProxy::TakePulledToken(int64_t rid)
+{
+	unique_lock<mutex> lck(tokenMutex);
+	string token;
+	if (pulledRid == rid)
+		token.swap(pulledToken);
+	pulledRid = 0;
+	return token;
+}
+
+void RTCProxy::WarmAudio()
+{
+	// the app's own StartAudio owns the devices, they are only closed again if we opened them
+	if (!audioStarted && !audioWarmed.exchange(true))
+	{
+		player->Start();
+		recorder->Start();
+	}
+}
+
+void RTCProxy::ReleaseWarmAudio()
+{
+	if (audioWarmed.exchange(false) && !audioStarted)
+	{
+		recorder->Stop();
+		player->Stop();
+	}
+}
+
 void RTCProxy::ExitRTCRoom(function<void(int errorCode)> callback)
 {
+	rtc->ClearSession();
 	rtm->ExitRTCRoom(currentPid, [callback,this](int errorCode) {
+		LeaveRoom();
+		callback(errorCode);
+		});
+}
+
+void RTCProxy::LeaveRoom()
+{
+	currentRid = 0;
+	roster.Clear();
+	ClearTiles();
+	for (auto& userData : userMaps.Clear())
+		RetireUser(userData);
+	{
+		// packets still in flight may have cached more
+		unique_lock<mutex> lck(parameterMutex);
+		parameterSets.clear();
+	}
+	ReleaseWarmAudio();
+	busy = false;
+}
+
+void RTCProxy::SubscribeVideo(int64_t rid, int64_t uid, HWND__* hwnd, uint32_t width, uint32_t height, function<void(int errorCode)> callback)
+{
+	unordered_set<int64_t> uids;
+	uids.insert(uid);
+	// already subscribed, keep the renderer we have
+	shared_ptr<UserData> userData = userMaps.Find(uid);
+	bool inserted = false;
+	int32_t freedTile = -1;
+	if (userData == nullptr || userData->onTile)
+	{
+		shared_ptr<UserData> created = CreateUser(uid, hwnd, width, height);
 		{
-			unique_lock<mutex> lck(drmutex);
-			for (auto item : userMaps)
+			// off its tile and into the app's window in one step, the next LastN tick can't take it back
+			unique_lock<mutex> lck(tileMutex);
+			for (size_t i = 0; i < tiles.size(); i++)
 			{
-				if (item.second->hTimer != NULL)
+				if (tiles[i].uid == uid)
 				{
-					HANDLE hComplete = CreateEvent(NULL, true, false, NULL);
-					DeleteTimerQueueTimer(NULL, item.second->hTimer, hComplete);
-					WaitForSingleObject(hComplete, INFINITE);
-					CloseHandle(hComplete);
+					FreeTile(tiles[i]);
+					freedTile = (int32_t)i;
 				}
-				delete item.second->decoder;
-				delete item.second->renderer;
-				delete item.second;
 			}
-			userMaps.clear();
+			inserted = userMaps.Insert(uid, created);
+		}
+		if (inserted)
+			userData = created;
+		else
+		{
+			RetireUser(created);
+			userData = userMaps.Find(uid);
+		}
+	}
+	if (freedTile >= 0)
+		eventHandler->OnVideoTileChanged(freedTile, 0);
+	rtm->SubscribeVideo(rid, uids, [this, callback, rid, uid, userData, inserted](int errorCode) {
+		if (errorCode != 0)
+		{
+			// a repeated subscribe leaves the working one alone; an unsubscribe
+			// and a newer subscribe may have come in between
+			if (inserted)
+				RetireUser(userMaps.Remove(uid, userData));
+		}
+		else
+		{
+			// don't wait for the sender's next scheduled keyframe
+			rtc->RequestKeyFrame(rid, uid);
 		}
-		busy = false;
 		callback(errorCode);
 		});
 }
 
-void RTCProxy::SubscribeVideo(int64_t rid, int64_t uid, HWND__* hwnd, uint32_t width, uint32_t height, function<void(int errorCode)> callback)
+shared_ptr<RTCProxy::UserData> RTCProxy::CreateUser(int64_t uid, HWND__* hwnd, uint32_t width, uint32_t height)
 {
-	unordered_set<int64_t> uids;
-	uids.insert(uid);
-	unique_lock<mutex> lck(drmutex);
-	UserData* userData = new UserData();
+	shared_ptr<UserData> userData = make_shared<UserData>();
 	userData->decoder = new OpenH264Decoder(640, 480);
-	userData->renderer = new D3D12Renderer(width, height, hwnd);
+	userData->renderer = nullptr;
 	userData->isReady = false;
 	userData->hTimer = NULL;
-	auto p = make_pair(uid, userData);
-	userMaps.emplace(p);
-	rtm->SubscribeVideo(rid, uids, [this, callback, uid](int errorCode) {
-		if (errorCode != 0)
+	userData->uid = uid;
+	userData->proxy = this;
+	userData->subscribeTime = chrono::steady_clock::now().time_since_epoch().count() / 1000000;
+	if (hwnd != nullptr)
+		AttachRenderer(*userData, hwnd, width, height);
+
+	// parameter sets seen earlier let the first keyframe decode without waiting for its own
+	unique_lock<mutex> lck(parameterMutex);
+	auto iter = parameterSets.find(uid);
+	if (iter != parameterSets.end())
+	{
+		LoadParameterSets(*userData, iter->second.sps.data(), iter->second.sps.size(), iter->second.pps.data(), iter->second.pps.size());
+		userData->decoderReadyDelay = 0;
+	}
+	return userData;
+}
+
+bool RTCProxy::LoadParameterSets(UserData& userData, const unsigned char* sps, size_t spsLength, const unsigned char* pps, size_t ppsLength)
+{
+	if (userData.decoder->IsInited()
+		&& userData.spsInUse.size() == spsLength && equal(userData.spsInUse.begin(), userData.spsInUse.end(), sps)
+		&& userData.ppsInUse.size() == ppsLength && equal(userData.ppsInUse.begin(), userData.ppsInUse.end(), pps))
+		return false;
+	userData.decoder->Decode(sps, (int)spsLength);
+	userData.decoder->Decode(pps, (int)ppsLength);
+	userData.decoder->SetInited(true);
+	userData.spsInUse.assign(sps, sps + spsLength);
+	userData.ppsInUse.assign(pps, pps + ppsLength);
+	return true;
+}
+
+void RTCProxy::AttachRenderer(UserData& userData, HWND__* hwnd, uint32_t width, uint32_t height)
+{
+	userData.renderer = new D3D12Renderer(width, height, hwnd);
+	// ready before the first packet can show up
+	userData.renderer->OnInit();
+	userData.renderer->ChangeTextureSize(640, 480);
+}
+
+void RTCProxy::ForgetParameterSets(int64_t uid)
+{
+	unique_lock<mutex> lck(parameterMutex);
+	parameterSets.erase(uid);
+}
+
+void RTCProxy::CacheParameterSets(int64_t uid, const MediaBuffer& sps, const MediaBuffer& pps)
+{
+	if (sps.size() == 0 || pps.size() == 0)
+		return;
+	unique_lock<mutex> lck(parameterMutex);
+	ParameterSets& sets = parameterSets[uid];
+	if (sets.sps.size() == sps.size() && equal(sets.sps.begin(), sets.sps.end(), sps.data())
+		&& sets.pps.size() == pps.size() && equal(sets.pps.begin(), sets.pps.end(), pps.data()))
+		return;
+	sets.sps.assign(sps.data(), sps.data() + sps.size());
+	sets.pps.assign(pps.data(), pps.data() + pps.size());
+}
+
+void RTCProxy::OnVideoFrame(UserData& userData, int64_t rid, int64_t seq, int64_t timestamp, int32_t captureLevel, MediaBuffer data, const MediaBuffer& sps, const MediaBuffer& pps)
+{
+	if (userData.captureLevel != captureLevel)
+	{
+		userData.captureLevel = captureLevel;
+		userData.StartTimer(captureLevel == 1 ? 15 : 30);
+	}
+
+	unique_lock<mutex> lck(userData.dataMutex);
+	// its tile went to someone else
+	if (userData.renderer == nullptr)
+		return;
+	int64_t now = chrono::steady_clock::now().time_since_epoch().count() / 1000000;
+	if (userData.firstPacketDelay < 0)
+		userData.firstPacketDelay = now - userData.subscribeTime;
+
+	bool keyframe = sps.size() > 0 && pps.size() > 0;
+	if (userData.state == VideoState::Paused)
+	{
+		// nothing is decoded; the newest keyframe is kept to show on resume
+		if (keyframe)
 		{
-			unique_lock<mutex> lck(drmutex);
-			auto iter = userMaps.find(uid);
-			delete iter->second->decoder;
-			delete iter->second->renderer;
-			delete iter->second;
-			userMaps.erase(uid);
+			userData.pausedKey = move(data);
+			userData.pausedSps = sps;
+			userData.pausedPps = pps;
 		}
-		else
+		userData.skippedFrames++;
+		return;
+	}
+	// the first keyframe, or one after the sender restarted its encoder with other settings
+	if (keyframe && LoadParameterSets(userData, sps.data(), sps.size(), pps.data(), pps.size()) && userData.decoderReadyDelay < 0)
+		userData.decoderReadyDelay = now - userData.subscribeTime;
+	if (!userData.decoder->IsInited())
+		return;
+
+	if (userData.state == VideoState::Thumbnail)
+	{
+		// keyframes decode on their own, so skipping everything in between is safe;
+		// none is asked for, the sender's keyframe would go to every subscriber
+		if (!keyframe || now - userData.lastThumbnail < kThumbnailInterval)
 		{
-			auto iter = userMaps.find(uid);
-			iter->second->renderer->OnInit();
-			iter->second->renderer->ChangeTextureSize(640, 480);
+			userData.skippedFrames++;
+			return;
 		}
-		callback(errorCode);
+		if (ShowKeyFrame(userData, data))
+			userData.lastThumbnail = now;
+		return;
+	}
+
+	// held back so long that whatever is queued is stale, or a packet was
+	// dropped before it got here and the keyframe was asked for then
+	bool lost = userData.videoLost.exchange(false);
+	if (lost || userData.frameQueue.size() >= kMaxQueuedFrames)
+		DropToKeyFrame(userData, rid, keyframe || lost);
+
+	if (userData.firstFrameDelay < 0 || userData.waitingKey)
+	{
+		// nothing before the first keyframe decodes; that one goes on screen
+		// right away instead of waiting for the queue to fill
+		if (!keyframe || !ShowKeyFrame(userData, data))
+		{
+			userData.skippedFrames++;
+			return;
+		}
+		userData.waitingKey = false;
+		if (userData.firstFrameDelay < 0)
+			userData.firstFrameDelay = chrono::steady_clock::now().time_since_epoch().count() / 1000000 - userData.subscribeTime;
+		return;
+	}
+
+	auto iter = upper_bound(userData.frameQueue.begin(), userData.frameQueue.end(), seq,
+		[](const long long a, const VideoFrame& b) {return a < b.seq; });
+
+	userData.frameQueue.emplace(iter, VideoFrame{ seq, timestamp, move(data) });
+
+	if (userData.frameQueue.size() > 3)
+	{
+		userData.isReady = true;
+	}
+}
+
+void RTCProxy::DropToKeyFrame(UserData& userData, int64_t rid, bool keyframe)
+{
+	userData.skippedFrames += userData.frameQueue.size();
+	userData.frameQueue.clear();
+	userData.isReady = false;
+	userData.waitingKey = true;
+	if (!keyframe)
+		rtc->RequestKeyFrame(rid, userData.uid);
+}
+
+bool RTCProxy::ShowKeyFrame(UserData& userData, const MediaBuffer& data)
+{
+	vector<BYTE> result = userData.decoder->Decode(data.data(), (int)data.size());
+	userData.decodedFrames++;
+	if (result.size() == 0)
+		return false;
+	userData.renderer->DrawFrame(result);
+	userData.sync.OnPresented(false);
+	return true;
+}
+
+bool RTCProxy::SetVideoState(int64_t uid, VideoState state)
+{
+	int64_t rid = currentRid;
+	shared_ptr<UserData> userData = userMaps.Find(uid);
+	if (userData == nullptr)
+	{
+		userData = GetP2PUser();
+		if (userData == nullptr || userData->uid != uid)
+			return false;
+		rid = 0;
+	}
+
+	{
+		unique_lock<mutex> lck(userData->dataMutex);
+		VideoState previous = userData->state;
+		if (previous == state)
+			return true;
+		userData->state = state;
+		userData->frameQueue.clear();
+		userData->isReady = false;
+		if (state != VideoState::Active)
+		{
+			userData->lastThumbnail = 0;
+			return true;
+		}
+
+		// back on screen: the kept keyframe goes up at once, the stream carries on from the next one
+		if (previous == VideoState::Paused && userData->pausedKey.size() > 0 && userData->renderer != nullptr)
+		{
+			LoadParameterSets(*userData, userData->pausedSps.data(), userData->pausedSps.size(), userData->pausedPps.data(), userData->pausedPps.size());
+			ShowKeyFrame(*userData, userData->pausedKey);
+		}
+		userData->pausedKey = MediaBuffer();
+		userData->pausedSps = MediaBuffer();
+		userData->pausedPps = MediaBuffer();
+		userData->waitingKey = true;
+	}
+	rtc->RequestKeyFrame(rid, uid);
+	return true;
+}
+
+bool RTCProxy::GetVideoDecodeStats(int64_t uid, VideoDecodeStats& stats)
+{
+	shared_ptr<UserData> userData = userMaps.Find(uid);
+	if (userData == nullptr)
+	{
+		userData = GetP2PUser();
+		if (userData == nullptr || userData->uid != uid)
+			return false;
+	}
+	unique_lock<mutex> lck(userData->dataMutex);
+	stats.state = userData->state;
+	stats.decoded = userData->decodedFrames;
+	stats.skipped = userData->skippedFrames;
+	return true;
+}
+
+bool RTCProxy::GetFirstFrameStats(int64_t uid, FirstFrameStats& stats)
+{
+	shared_ptr<UserData> userData = userMaps.Find(uid);
+	if (userData == nullptr)
+	{
+		userData = GetP2PUser();
+		if (userData == nullptr || userData->uid != uid)
+			return false;
+	}
+	unique_lock<mutex> lck(userData->dataMutex);
+	stats.firstPacket = userData->firstPacketDelay;
+	stats.decoderReady = userData->decoderReadyDelay;
+	stats.firstFrame = userData->firstFrameDelay;
+	return true;
+}
+
+void RTCProxy::RetireUser(shared_ptr<UserData> userData)
+{
+	if (userData == nullptr)
+		return;
+	// the sender's next subscription may come after it changed resolution
+	shared_ptr<UserData> p2pUser = GetP2PUser();
+	if (userMaps.Find(userData->uid) == nullptr && (p2pUser == nullptr || p2pUser->uid != userData->uid))
+		ForgetParameterSets(userData->uid);
+	// already unreachable from the media callbacks; the reaper waits out the ones in flight
+	UserData* raw = userData.get();
+	reaper.Retire(move(userData), [raw]() { raw->StopTimer(); });
+}
+
+void RTCProxy::PrewarmP2P(int32_t type, int64_t peerUid, HWND__* hwnd, uint32_t width, uint32_t height)
+{
+	int64_t start = chrono::steady_clock::now().time_since_epoch().count() / 1000000;
+	p2pAcceptTime = 0;
+	p2pFirstAudio = 0;
+
+	WarmAudio();
+	if (type == 2)
+	{
+		// the callee has no window until it accepts, the renderer is added then
+		shared_ptr<UserData> userData = CreateUser(peerUid, hwnd, width, height);
+		shared_ptr<UserData> previous;
+		{
+			unique_lock<mutex> lck(drmutex);
+			shared_ptr<UserData>& slot = hwnd != nullptr ? p2pUserData : p2pWarmUser;
+			previous = move(slot);
+			slot = userData;
+		}
+		RetireUser(previous);
+	}
+	p2pPrewarmTime = chrono::steady_clock::now().time_since_epoch().count() / 1000000 - start;
+}
+
+void RTCProxy::ReleaseP2P()
+{
+	shared_ptr<UserData> userData;
+	shared_ptr<UserData> warmUser;
+	{
+		unique_lock<mutex> lck(drmutex);
+		userData = move(p2pUserData);
+		warmUser = move(p2pWarmUser);
+	}
+	RetireUser(userData);
+	RetireUser(warmUser);
+	ReleaseWarmAudio();
+	rtc->ClearP2PSession(0);
+}
+
+void RTCProxy::EnterP2PGate(int64_t callId)
+{
+	p2pCallId = callId;
+	rtc->SetP2PRequest(currentPid, currentUid, p2pType, p2pPeerUid, callId, [this, callId](int errorCode) {
+		// media flows without it, only a lost connection can't be resumed
+		if (errorCode != 0)
+			fprintf(stderr, "p2p call %lld not registered with the gate: %d\n", (long long)callId, errorCode);
+		else if (p2pStatus != 2 || p2pCallId != callId)
+			rtc->ClearP2PSession(callId);	// ended during the round trip
 		});
 }
 
+bool RTCProxy::GetP2PCallStats(P2PCallStats& stats)
+{
+	int64_t acceptTime = p2pAcceptTime;
+	if (acceptTime == 0)
+		return false;
+	stats.prewarm = p2pPrewarmTime;
+	int64_t firstAudio = p2pFirstAudio;
+	stats.firstAudio = firstAudio != 0 ? firstAudio - acceptTime : -1;
+	stats.firstVideo = -1;
+	shared_ptr<UserData> userData = GetP2PUser();
+	if (userData != nullptr)
+	{
+		unique_lock<mutex> lck(userData->dataMutex);
+		if (userData->firstFrameDelay >= 0)
+			stats.firstVideo = max<int64_t>(userData->subscribeTime + userData->firstFrameDelay - acceptTime, 0);
+	}
+	return true;
+}
+
+shared_ptr<RTCProxy::UserData> RTCProxy::GetP2PUser()
+{
+	unique_lock<mutex> lck(drmutex);
+	return p2pUserData;
+}
+
+RTCProxy::UserData::~UserData()
+{
+	StopTimer();
+	delete decoder;
+	delete renderer;
+}
+
+void RTCProxy::UserData::StartTimer(int32_t frameRate)
+{
+	unique_lock<mutex> lck(timerMutex);
+	if (closed)
+		return;
+	if (hTimer != NULL)
+	{
+		HANDLE hComplete = CreateEvent(NULL, true, false, NULL);
+		DeleteTimerQueueTimer(NULL, hTimer, hComplete);
+		WaitForSingleObject(hComplete, INFINITE);
+		CloseHandle(hComplete);
+	}
+	CreateTimerQueueTimer(&hTimer, NULL, TimerProc, this, 0, 1000 / frameRate, WT_EXECUTEDEFAULT);
+}
+
+void RTCProxy::UserData::StopTimer()
+{
+	unique_lock<mutex> lck(timerMutex);
+	closed = true;
+	if (hTimer != NULL)
+	{
+		HANDLE hComplete = CreateEvent(NULL, true, false, NULL);
+		DeleteTimerQueueTimer(NULL, hTimer, hComplete);
+		WaitForSingleObject(hComplete, INFINITE);
+		CloseHandle(hComplete);
+		hTimer = NULL;
+	}
+}
+
 void RTCProxy::TimerProc(void* lpParameter, unsigned char TimerOrWaitFired)
 {
 	UserData* userData = (UserData*)lpParameter;
 	unique_lock<mutex> lck(userData->dataMutex);
-	if (userData->isReady)
+	// the renderer went to another tile user, the reaper stops this timer
+	if (userData->isReady && userData->renderer != nullptr)
 	{
-		vector<BYTE> data = userData->frameQueue.front().second;
-		userData->frameQueue.pop_front();
-		vector<BYTE> result = userData->decoder->Decode(data.data(), data.size());
+		int64_t now = chrono::steady_clock::now().time_since_epoch().count() / 1000000;
+		long long audioTimestamp = 0;
+		long long audioPlayTime = 0;
+		if (userData->proxy->player->GetUserPlayout(userData->uid, audioTimestamp, audioPlayTime))
+			userData->sync.UpdateAudioClock(audioTimestamp, audioPlayTime);
+		int32_t nudge = userData->sync.TakeAudioNudge();
+		if (nudge != 0)
+			userData->proxy->player->AdjustUserDelay(userData->uid, nudge);
 
-		if (result.size() > 0)
+		// late frames still have to go through the decoder to keep the reference chain
+		int32_t dropped = 0;
+		while (userData->frameQueue.size() > 0)
 		{
-			userData->renderer->DrawFrame(result);
+			AVSynchronizer::Action action = userData->sync.Check(userData->frameQueue.front().timestamp, now);
+			if (action == AVSynchronizer::Action::Hold)
+				break;
+			if (action == AVSynchronizer::Action::Drop && dropped >= 3)
+				action = AVSynchronizer::Action::Present;
+
+			MediaBuffer data = move(userData->frameQueue.front().data);
+			userData->frameQueue.pop_front();
+			vector<BYTE> result = userData->decoder->Decode(data.data(), (int)data.size());
+			userData->decodedFrames++;
+
+			if (action == AVSynchronizer::Action::Drop)
+			{
+				userData->sync.OnPresented(true);
+				dropped++;
+				continue;
+			}
+
+			if (result.size() > 0)
+			{
+				userData->renderer->DrawFrame(result);
+			}
+			userData->sync.OnPresented(false);
+			break;
 		}
 
 		if (userData->frameQueue.size() == 0)
@@ -289,24 +768,397 @@ void RTCProxy::UnsubscribeVideo(int64_t rid, int64_t uid, function<void(int erro
     rtm->UnsubscribeVideo(rid, uids, [this,callback,uid](int errorCode) {
         if (errorCode == 0)
         {
-            unique_lock<mutex> lck(drmutex);
-            auto iter = userMaps.find(uid);
-            if (iter->second->hTimer != NULL)
-            {
-                HANDLE hComplete = CreateEvent(NULL, true, false, NULL);
-                DeleteTimerQueueTimer(NULL, iter->second->hTimer, hComplete);
-                WaitForSingleObject(hComplete, INFINITE);
-                CloseHandle(hComplete);
-            }
-            delete iter->second->decoder;
-            delete iter->second->renderer;
-            delete iter->second;
-            userMaps.erase(uid);
+            RetireUser(userMaps.Remove(uid));
         }
         callback(errorCode);
         });
 }
 
+void RTCProxy::SetVideoTiles(vector<HWND__*> windows, uint32_t width, uint32_t height)
+{
+	StopLastNTimer();
+	TileWork work;
+	{
+		unique_lock<mutex> lck(tileMutex);
+		work.rid = currentRid;
+		for (size_t i = 0; i < tiles.size(); i++)
+			SetTile(i, 0, work);
+		// a window that stays keeps its swap chain, it can take only one; the others go to the reaper
+		vector<Tile> previous;
+		previous.swap(tiles);
+		for (HWND__* hwnd : windows)
+		{
+			Tile tile;
+			tile.hwnd = hwnd;
+			for (auto& old : previous)
+			{
+				if (old.hwnd == hwnd && old.spare != nullptr && width == tileWidth && height == tileHeight)
+				{
+					tile.spare = old.spare;
+					old.spare = nullptr;
+					break;
+				}
+			}
+			tiles.push_back(tile);
+		}
+		for (auto& old : previous)
+			RetireRenderer(old.spare);
+		tileWidth = width;
+		tileHeight = height;
+		selector.Reset();
+		selector.SetVisible(windows.size());
+	}
+	RunTileWork(work);
+	if (windows.size() > 0)
+		CreateTimerQueueTimer(&lastNTimer, NULL, LastNProc, this, 0, kLastNInterval, WT_EXECUTEDEFAULT);
+}
+
+void RTCProxy::PinVideo(int64_t uid, bool pinned)
+{
+	selector.Pin(uid, pinned);
+}
+
+LastNSelector::Stats RTCProxy::GetLastNStats()
+{
+	return selector.GetStats();
+}
+
+void RTCProxy::StopLastNTimer()
+{
+	if (lastNTimer != NULL)
+	{
+		if (inLastNProc)
+		{
+			// called back from the timer, which can't wait for itself; it touches nothing after the callbacks
+			DeleteTimerQueueTimer(NULL, lastNTimer, NULL);
+		}
+		else
+		{
+			HANDLE hComplete = CreateEvent(NULL, true, false, NULL);
+			DeleteTimerQueueTimer(NULL, lastNTimer, hComplete);
+			WaitForSingleObject(hComplete, INFINITE);
+			CloseHandle(hComplete);
+		}
+		lastNTimer = NULL;
+	}
+}
+
+void RTCProxy::LastNProc(void* lpParameter, unsigned char TimerOrWaitFired)
+{
+	inLastNProc = true;
+	((RTCProxy*)lpParameter)->UpdateTiles();
+	inLastNProc = false;
+}
+
+void RTCProxy::UpdateTiles()
+{
+	vector<pair<long long, AudioLevel>> streams;
+	player->GetUserLevels(streams);
+	// muted users count too, their video is what a quiet room shows
+	vector<int64_t> members = roster.GetMembers();
+
+	TileWork work;
+	{
+		unique_lock<mutex> lck(tileMutex);
+		// checked under the lock, ExitRTCRoom clears the tiles after resetting it
+		if (currentRid == 0)
+			return;
+		work.rid = currentRid;
+		SelectTiles(members, streams, work);
+	}
+	RunTileWork(work);
+}
+
+bool RTCProxy::IsTileCandidate(int64_t uid)
+{
+	if (uid == currentUid)
+		return false;
+	// users the app subscribed itself are left alone
+	shared_ptr<UserData> userData = userMaps.Find(uid);
+	return userData == nullptr || userData->onTile;
+}
+
+void RTCProxy::SelectTiles(const vector<int64_t>& members, const vector<pair<long long, AudioLevel>>& streams, TileWork& work)
+{
+	vector<int64_t> candidates;
+	for (int64_t uid : members)
+	{
+		if (IsTileCandidate(uid))
+			candidates.push_back(uid);
+	}
+	vector<pair<int64_t, float>> levels;
+	for (auto& stream : streams)
+	{
+		if (IsTileCandidate(stream.first))
+			levels.emplace_back(stream.first, stream.second.vu);
+	}
+	vector<int64_t> selection = selector.Update(candidates, levels, chrono::steady_clock::now().time_since_epoch().count() / 1000000);
+
+	// users that dropped out go first, their renderers are handed to the newcomers
+	for (size_t i = 0; i < tiles.size(); i++)
+	{
+		if (tiles[i].uid != 0 && find(selection.begin(), selection.end(), tiles[i].uid) == selection.end())
+			SetTile(i, 0, work);
+	}
+	for (int64_t uid : selection)
+	{
+		bool onTile = false;
+		size_t empty = tiles.size();
+		for (size_t i = 0; i < tiles.size(); i++)
+		{
+			onTile = onTile || tiles[i].uid == uid;
+			if (tiles[i].uid == 0 && empty == tiles.size())
+				empty = i;
+		}
+		if (!onTile && empty < tiles.size())
+			SetTile(empty, uid, work);
+	}
+}
+
+void RTCProxy::SetTile(size_t index, int64_t uid, TileWork& work)
+{
+	Tile& tile = tiles[index];
+	if (tile.uid != 0)
+		work.unsubscribe.insert(FreeTile(tile));
+	if (uid != 0)
+	{
+		shared_ptr<UserData> userData = CreateUser(uid, nullptr, 0, 0);
+		userData->onTile = true;
+		if (tile.spare != nullptr)
+		{
+			userData->renderer = tile.spare;
+			tile.spare = nullptr;
+		}
+		else
+			AttachRenderer(*userData, tile.hwnd, tileWidth, tileHeight);
+
+		if (userMaps.Insert(uid, userData))
+		{
+			tile.uid = uid;
+			work.subscribe.push_back(uid);
+		}
+		else
+		{
+			// the app subscribed the user in the meantime
+			tile.spare = DetachRenderer(*userData);
+			RetireUser(userData);
+		}
+	}
+	work.changes.emplace_back((int32_t)index, tile.uid);
+}
+
+void RTCProxy::RunTileWork(TileWork& work)
+{
+	if (work.unsubscribe.size() > 0)
+		rtm->UnsubscribeVideo(work.rid, work.unsubscribe, [](int errorCode) {});
+	for (int64_t uid : work.subscribe)
+	{
+		int64_t rid = work.rid;
+		unordered_set<int64_t> uids;
+		uids.insert(uid);
+		rtm->SubscribeVideo(rid, uids, [this, rid, uid](int errorCode) {
+			if (errorCode == 0)
+				rtc->RequestKeyFrame(rid, uid);
+			else
+				OnTileSubscribeFailed(uid);
+			});
+	}
+	for (auto& change : work.changes)
+		eventHandler->OnVideoTileChanged(change.first, change.second);
+}
+
+void RTCProxy::OnTileSubscribeFailed(int64_t uid)
+{
+	int32_t index = -1;
+	{
+		unique_lock<mutex> lck(tileMutex);
+		for (size_t i = 0; i < tiles.size() && index < 0; i++)
+		{
+			if (tiles[i].uid == uid)
+				index = (int32_t)i;
+		}
+		// the tile moved on or the room is gone
+		if (index < 0)
+			return;
+		// nothing would ever come; the next tick gives the tile to someone else
+		FreeTile(tiles[index]);
+		selector.Block(uid, chrono::steady_clock::now().time_since_epoch().count() / 1000000);
+	}
+	eventHandler->OnVideoTileChanged(index, 0);
+}
+
+void RTCProxy::ClearTiles()
+{
+	vector<int32_t> emptied;
+	{
+		unique_lock<mutex> lck(tileMutex);
+		for (size_t i = 0; i < tiles.size(); i++)
+		{
+			if (tiles[i].uid == 0)
+				continue;
+			FreeTile(tiles[i]);
+			emptied.push_back((int32_t)i);
+		}
+		selector.Reset();
+	}
+	for (int32_t index : emptied)
+		eventHandler->OnVideoTileChanged(index, 0);
+}
+
+int64_t RTCProxy::FreeTile(Tile& tile)
+{
+	shared_ptr<UserData> userData = userMaps.Remove(tile.uid);
+	if (userData != nullptr)
+	{
+		D3D12Renderer* renderer = DetachRenderer(*userData);
+		if (tile.spare == nullptr)
+			tile.spare = renderer;
+		else
+			RetireRenderer(renderer);
+		RetireUser(userData);
+	}
+	int64_t uid = tile.uid;
+	tile.uid = 0;
+	return uid;
+}
+
+D3D12Renderer* RTCProxy::DetachRenderer(UserData& userData)
+{
+	// a draw in progress holds dataMutex, later timer runs find no renderer
+	unique_lock<mutex> lck(userData.dataMutex);
+	D3D12Renderer* renderer = userData.renderer;
+	userData.renderer = nullptr;
+	return renderer;
+}
+
+void RTCProxy::RetireRenderer(D3D12Renderer* renderer)
+{
+	if (renderer != nullptr)
+		reaper.Retire(shared_ptr<D3D12Renderer>(renderer), nullptr);
+}
+
+void RTCProxy::ResyncRoster()
+{
+	int64_t rid = roster.GetRid();
+	if (rid == 0)
+		return;
+	int64_t generation = roster.BeginResync();
+	rtm->GetRTCRoomMembers(rid, [this, rid, generation](int errorCode, RTMClient::RTCRoomMembers roomMembers) {
+		if (errorCode != 0)
+		{
+			roster.AbortResync(generation);
+			return;
+		}
+		if (roster.Seed(generation, roomMembers.uids, roomMembers.administrators, roomMembers.owner))
+			eventHandler->OnRosterChanged(rid, 0, RTCEventHandler::RosterChange::Resynced, roster.GetStats().version);
+		});
+}
+
+void RTCProxy::RosterProc(void* lpParameter, unsigned char TimerOrWaitFired)
+{
+	RTCProxy* proxy = (RTCProxy*)lpParameter;
+	if (proxy->roster.ResyncDue())
+		proxy->ResyncRoster();
+}
+
+void RTCProxy::OnRosterDelta(int64_t rid, int64_t uid, bool entered)
+{
+	bool fits = entered ? roster.OnEnter(rid, uid) : roster.OnExit(rid, uid);
+	if (rid != roster.GetRid())
+		return;
+	RoomRoster::Stats stats = roster.GetStats();
+	eventHandler->OnRosterChanged(rid, uid, entered ? RTCEventHandler::RosterChange::Entered : RTCEventHandler::RosterChange::Exited, stats.version);
+	if (!fits)
+	{
+		ResyncRoster();
+		return;
+	}
+
+	// a lost delta that happens to fit shows up in the count; checked now and then, not per push
+	int64_t now = chrono::steady_clock::now().time_since_epoch().count() / 1000000;
+	int64_t last = lastRosterCheck;
+	if (now - last < kRosterCheckInterval || !lastRosterCheck.compare_exchange_strong(last, now))
+		return;
+	rtm->GetRTCRoomMemberCount(rid, [this, rid, stats](int errorCode, int32_t count) {
+		if (errorCode == 0 && !roster.CheckCount(rid, count, stats.deltas))
+			ResyncRoster();
+		});
+}
+
+bool RTCProxy::IsRoomMember(int64_t uid)
+{
+	return roster.IsMember(uid);
+}
+
+RoomRoster::Role RTCProxy::GetMemberRole(int64_t uid)
+{
+	return roster.GetRole(uid);
+}
+
+vector<int64_t> RTCProxy::GetRoomMembers()
+{
+	return roster.GetMembers();
+}
+
+RoomRoster::Stats RTCProxy::GetRosterStats()
+{
+	return roster.GetStats();
+}
+
+void RTCProxy::ResubscribeVideo()
+{
+	// decoders, renderers and jitter buffers are kept; only the gate forgot the subscriptions
+	vector<int64_t> keys = userMaps.Keys();
+	unordered_set<int64_t> uids(keys.begin(), keys.end());
+	if (uids.size() > 0)
+		rtm->SubscribeVideo(currentRid, uids, [](int errorCode) {});
+}
+
+RTCProxy::RTCSessionStats RTCProxy::GetRTCSessionStats()
+{
+	RTCClient::SessionStats session = rtc->GetSessionStats();
+	RTCSessionStats stats;
+	stats.resumes = session.resumes;
+	stats.lastOutage = session.lastOutage;
+	stats.lastMediaGap = session.lastMediaGap;
+	return stats;
+}
+
+NetworkMonitor::Stats RTCProxy::GetNetworkStats()
+{
+	return rtc->GetNetworkStats();
+}
+
+bool RTCProxy::GetAVSyncStats(int64_t uid, AVSynchronizer::Stats& stats)
+{
+	shared_ptr<UserData> userData = userMaps.Find(uid);
+	if (userData != nullptr)
+	{
+		stats = userData->sync.GetStats();
+		return true;
+	}
+	userData = GetP2PUser();
+	if (userData != nullptr && userData->uid == uid)
+	{
+		stats = userData->sync.GetStats();
+		return true;
+	}
+	return false;
+}
+
+bool RTCProxy::GetLocalAudioLevel(AudioLevel& level)
+{
+	if (!audioStarted && !audioWarmed)
+		return false;
+	level = recorder->GetLevel();
+	return true;
+}
+
+bool RTCProxy::GetUserAudioLevel(int64_t uid, AudioLevel& level)
+{
+	return player->GetUserLevel(uid, level);
+}
+
 void RTCProxy::Mute()
 {
     muted = true;
@@ -358,27 +1210,22 @@ void RTCProxy::RequestP2PRTC(int32_t type, int64_t peerUid, HWND__* hwnd, uint32
     {
         p2pStatus = 1;
 		busy = true;
-		rtm->RequestP2PRTC(type, peerUid, [type, this, callback, hwnd, width, height](int errorCode, int64_t callId) {
+		p2pPeerUid = peerUid;
+		p2pType = type;
+		// renderer, decoder and audio devices get ready while the peer's phone rings
+		PrewarmP2P(type, peerUid, hwnd, width, height);
+		rtm->RequestP2PRTC(type, peerUid, [type, this, callback](int errorCode, int64_t callId) {
 			if (errorCode != 0)
 			{
 				p2pStatus = 0;
+				ReleaseP2P();
 				busy = false;
 				callback(errorCode);
 			}
 			else
 			{
 				if (type == 2)
-				{
 					p2pCallId = callId;
-					UserData* userData = new UserData();
-					userData->decoder = new OpenH264Decoder(640, 480);
-					userData->renderer = new D3D12Renderer(width, height, hwnd);
-					userData->isReady = false;
-					userData->hTimer = NULL;
-					userData->renderer->OnInit();
-					userData->renderer->ChangeTextureSize(640, 480);
-					p2pUserData = userData;
-				}
 				callback(errorCode);
 			}
 			});
@@ -398,20 +1245,7 @@ void RTCProxy::CancelP2PRTC(int64_t callId, function<void(int errorCode)> callba
 			{
 				p2pStatus = 0;
 				p2pCallId = 0;
-				if (p2pUserData != nullptr)
-				{
-					if (p2pUserData->hTimer != NULL)
-					{
-						HANDLE hComplete = CreateEvent(NULL, true, false, NULL);
-						DeleteTimerQueueTimer(NULL, p2pUserData->hTimer, hComplete);
-						WaitForSingleObject(hComplete, INFINITE);
-						CloseHandle(hComplete);
-					}
-					delete p2pUserData->decoder;
-					delete p2pUserData->renderer;
-					delete p2pUserData;
-					p2pUserData = nullptr;
-				}
+				ReleaseP2P();
 				busy = false;
 				callback(errorCode);
 			}
@@ -432,20 +1266,8 @@ void RTCProxy::CloseP2PRTC(int64_t callId, function<void(int errorCode)> callbac
 			{
 				p2pCallId = 0;
 				p2pStatus = 0;
-				if (p2pUserData != nullptr)
-				{
-					if (p2pUserData->hTimer != NULL)
-					{
-						HANDLE hComplete = CreateEvent(NULL, true, false, NULL);
-						DeleteTimerQueueTimer(NULL, p2pUserData->hTimer, hComplete);
-						WaitForSingleObject(hComplete, INFINITE);
-						CloseHandle(hComplete);
-					}
-					delete p2pUserData->decoder;
-					delete p2pUserData->renderer;
-					delete p2pUserData;
-					p2pUserData = nullptr;
-				}
+				player->RemoveUser(p2pPeerUid);
+				ReleaseP2P();
 				busy = false;
 				callback(errorCode);
 			}
@@ -457,23 +1279,42 @@ void RTCProxy::AcceptP2PRTC(int64_t callId, HWND__* hwnd, uint32_t width, uint32
 {
 	if (p2pStatus == 3)
 	{
-		rtm->AcceptP2PRTC(callId, [this, callback, hwnd, width, height](int errorCode) {
+		// the decoder was built while ringing; the renderer comes up during the accept round trip
+		shared_ptr<UserData> userData;
+		{
+			unique_lock<mutex> lck(drmutex);
+			userData = move(p2pWarmUser);
+		}
+		if (userData != nullptr)
+			AttachRenderer(*userData, hwnd, width, height);
+		else
+			userData = CreateUser(p2pPeerUid, hwnd, width, height);
+		int64_t acceptTime = chrono::steady_clock::now().time_since_epoch().count() / 1000000;
+		{
+			unique_lock<mutex> lck(userData->dataMutex);
+			userData->subscribeTime = acceptTime;
+		}
+		rtm->AcceptP2PRTC(callId, [this, callId, callback, userData, acceptTime](int errorCode) {
 			if (errorCode != 0)
 			{
+				// the call is gone, so is everything opened for it while ringing
+				p2pStatus = 0;
+				RetireUser(userData);
+				ReleaseP2P();
+				busy = false;
 				callback(errorCode);
 			}
 			else
 			{
-				UserData* userData = new UserData();
-				userData->decoder = new OpenH264Decoder(640, 480);
-				userData->renderer = new D3D12Renderer(width, height, hwnd);
-				userData->isReady = false;
-				userData->hTimer = NULL;
-				userData->renderer->OnInit();
-				userData->renderer->ChangeTextureSize(640, 480);
-				p2pUserData = userData;
+				{
+					unique_lock<mutex> lck(drmutex);
+					p2pUserData = userData;
+				}
 
+				p2pAcceptTime = acceptTime;
 				p2pStatus = 2;
+				rtc->RequestKeyFrame(0, p2pPeerUid);
+				EnterP2PGate(callId);
 				callback(errorCode);
 			}
 			});
@@ -492,6 +1333,7 @@ void RTCProxy::RefuseP2PRTC(int64_t callId, function<void(int errorCode)> callba
 			else
 			{
 				p2pStatus = 0;
+				ReleaseP2P();
 				callback(errorCode);
 			}
 			});
@@ -509,36 +1351,70 @@ RTCProxy::InternalEventHandler::~InternalEventHandler() = default;
 
 void RTCProxy::InternalEventHandler::OnUserEnterRTCRoom(int64_t uid, int64_t rid, int64_t mtime)
 {
+	rtcProxy->OnRosterDelta(rid, uid, true);
 	userEventHandler->OnUserEnterRTCRoom(uid, rid, mtime);
 }
 
 void RTCProxy::InternalEventHandler::OnUserExitRTCRoom(int64_t uid, int64_t rid, int64_t mtime)
 {
+	rtcProxy->selector.Remove(uid);
+	rtcProxy->player->RemoveUser(uid);
+	rtcProxy->ForgetParameterSets(uid);
+	rtcProxy->OnRosterDelta(rid, uid, false);
 	userEventHandler->OnUserExitRTCRoom(uid, rid, mtime);
 }
 
 void RTCProxy::InternalEventHandler::OnRTCRoomClosed(int64_t rid)
 {
+	if (rid == rtcProxy->currentRid)
+	{
+		rtcProxy->rtc->ClearSession();
+		rtcProxy->LeaveRoom();
+	}
 	userEventHandler->OnRTCRoomClosed(rid);
 }
 
 void RTCProxy::InternalEventHandler::OnInviteIntoRTCRoom(int64_t fromUid, int64_t rid)
 {
+	// likely followed by EnterRTCRoom; a p2p call keeps its connection as it is
+	if (rtcProxy->p2pStatus == 0)
+		rtcProxy->rtc->Prepare();
 	userEventHandler->OnInviteIntoRTCRoom(fromUid, rid);
 }
 
 void RTCProxy::InternalEventHandler::OnKickOutFromRTCRoom(int64_t fromUid, int64_t rid)
 {
+	if (rid == rtcProxy->currentRid)
+	{
+		rtcProxy->rtc->ClearSession();
+		rtcProxy->LeaveRoom();
+	}
 	userEventHandler->OnKickOutFromRTCRoom(fromUid, rid);
 }
 
 void RTCProxy::InternalEventHandler::OnPullIntoRTCRoom(int64_t rid, string token)
 {
+	{
+		unique_lock<mutex> lck(rtcProxy->tokenMutex);
+		rtcProxy->pulledRid = rid;
+		rtcProxy->pulledToken = token;
+	}
+	if (rtcProxy->p2pStatus == 0)
+		rtcProxy->rtc->Prepare();
 	userEventHandler->OnPullIntoRTCRoom(rid, token);
 }
 
 void RTCProxy::InternalEventHandler::OnAdminCommand(AdminCommand command, vector<int64_t> uids)
 {
+	if (command == AdminCommand::PromoteAdmin || command == AdminCommand::DepriveAdmin)
+	{
+		RoomRoster::Role role = command == AdminCommand::PromoteAdmin ? RoomRoster::Role::Administrator : RoomRoster::Role::Member;
+		for (int64_t uid : uids)
+		{
+			if (rtcProxy->roster.SetRole(uid, role))
+				userEventHandler->OnRosterChanged(rtcProxy->currentRid, uid, RosterChange::RoleChanged, rtcProxy->roster.GetStats().version);
+		}
+	}
 	userEventHandler->OnAdminCommand(command, uids);
 }
 
@@ -549,8 +1425,17 @@ void RTCProxy::InternalEventHandler::OnRoomEvent(int64_t rid, RoomEvent roomEven
 
 void RTCProxy::InternalEventHandler::OnPushP2PRTCRequest(int64_t callId, int64_t peerUid, int32_t type)
 {
-	rtcProxy->p2pStatus = 3;
+	// one call at a time, the one going on keeps its state and devices
+	int8_t idle = 0;
+	if (!rtcProxy->p2pStatus.compare_exchange_strong(idle, 3))
+	{
+		rtcProxy->rtm->RefuseP2PRTC(callId, [](int errorCode) {});
+		return;
+	}
+	rtcProxy->p2pPeerUid = peerUid;
+	rtcProxy->p2pType = type;
 	rtcProxy->busy = true;
+	rtcProxy->PrewarmP2P(type, peerUid, nullptr, 0, 0);
 	userEventHandler->OnPushP2PRTCRequest(callId, peerUid, type);
 }
 
@@ -559,21 +1444,30 @@ void RTCProxy::InternalEventHandler::OnPushP2PRTCEvent(int64_t callId, int64_t p
 	if (p2pEvent == 1 && rtcProxy->p2pStatus == 3)
 	{
 		rtcProxy->p2pStatus = 0;
+		rtcProxy->ReleaseP2P();
 	}
 	else if (p2pEvent == 2 && rtcProxy->p2pStatus == 2)
 	{
 		rtcProxy->p2pStatus = 0;
+		rtcProxy->player->RemoveUser(peerUid);
+		rtcProxy->ReleaseP2P();
 	}
 	else if (p2pEvent == 3 && rtcProxy->p2pStatus == 1)
 	{
+		rtcProxy->p2pAcceptTime = chrono::steady_clock::now().time_since_epoch().count() / 1000000;
+		rtcProxy->p2pStatus = 2;
+		rtcProxy->rtc->RequestKeyFrame(0, peerUid);
+		rtcProxy->EnterP2PGate(callId);
 	}
 	else if (p2pEvent == 4 && rtcProxy->p2pStatus == 1)
 	{
 		rtcProxy->p2pStatus = 0;
+		rtcProxy->ReleaseP2P();
 	}
 	else if (p2pEvent == 5 && rtcProxy->p2pStatus == 1)
 	{
 		rtcProxy->p2pStatus = 0;
+		rtcProxy->ReleaseP2P();
 	}
 	userEventHandler->OnPushP2PRTCEvent(callId, peerUid, type, p2pEvent);
 }
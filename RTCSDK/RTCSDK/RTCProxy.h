@@ -8,6 +8,13 @@
 
 #include "RTCEventHandler.h"
 #include "RTMProxy.h"
+#include "AVSynchronizer.h"
+#include "MediaBuffer.h"
+#include "LastNSelector.h"
+#include "NetworkMonitor.h"
+#include "RoomRoster.h"
+#include "Reaper.h"
+#include "SubscriberTable.h"
 
 class RTCClient;
 class RTMClient;
@@ -22,32 +29,124 @@ using namespace std;
 
 class RTCProxy: public RTMProxy
 {
+public:
+	// how much of a subscribed stream is decoded
+	enum class VideoState : int32_t
+	{
+		Active,			// every frame
+		Thumbnail,		// the sender's own keyframes only, at most one a second
+		Paused			// nothing, the newest keyframe is kept for the resume
+	};
+
+private:
 	shared_ptr<RTCClient> rtc;
 
 	shared_ptr<AudioPlayer> player;
 	shared_ptr<AudioRecorder> recorder;
 
 	int64_t audioSeq = 0;
-	int64_t currentRid = 0;
+	atomic<int64_t> currentRid = 0;		// 0 outside a room
 
 	bool muted = false;
-	mutex drmutex;
+	mutex drmutex;		// p2pUserData, p2pWarmUser
 
 	atomic<int8_t> p2pStatus = 0;// 0 not using 1 calling 2 communicating 3 on calling
 	atomic<int64_t> p2pCallId = 0;
+	atomic<int32_t> p2pType = 0;
 	atomic<bool> busy = false;
+	atomic<bool> audioStarted = false;	// by the app through StartAudio
+	atomic<bool> audioWarmed = false;	// opened for a p2p call, closed with it
+	atomic<int64_t> p2pPrewarmTime = -1;	// ms spent getting ready while ringing
+	atomic<int64_t> p2pAcceptTime = 0;
+	atomic<int64_t> p2pFirstAudio = 0;
+	// token that came with OnPullIntoRTCRoom, saves EnterRTCRoom the RTM round trip
+	int64_t pulledRid = 0;
+	string pulledToken;
+	mutex tokenMutex;
+	RoomRoster roster;
+	atomic<int64_t> lastRosterCheck = 0;
+	void* rosterTimer = NULL;			// retries a failed member list fetch
+	struct VideoFrame
+	{
+		int64_t seq;
+		int64_t timestamp;
+		MediaBuffer data;
+	};
 	struct UserData
 	{
 		OpenH264Decoder* decoder;
 		D3D12Renderer* renderer;
 		bool isReady;
-		list<pair<int64_t, vector<unsigned char>>> frameQueue;
+		list<VideoFrame> frameQueue;
 		void* hTimer;
 		mutex dataMutex;
 		int32_t captureLevel;
+		int64_t uid;
+		RTCProxy* proxy;
+		AVSynchronizer sync;
+		bool closed = false;	// no timer may start once set
+		mutex timerMutex;		// hTimer and closed
+		int64_t subscribeTime = 0;
+		int64_t firstPacketDelay = -1;		// ms after subscribeTime, dataMutex
+		int64_t decoderReadyDelay = -1;
+		int64_t firstFrameDelay = -1;
+		VideoState state = VideoState::Active;	// dataMutex
+		bool waitingKey = false;			// resumed, nothing decodes before the next keyframe
+		atomic<bool> videoLost = false;		// set on the receiving thread when a packet was dropped
+		int64_t lastThumbnail = 0;
+		MediaBuffer pausedKey;
+		MediaBuffer pausedSps;
+		MediaBuffer pausedPps;
+		vector<unsigned char> spsInUse;		// last fed to the decoder
+		vector<unsigned char> ppsInUse;
+		int64_t decodedFrames = 0;
+		int64_t skippedFrames = 0;
+		bool onTile = false;				// set before it is published, the LastN selector owns it
+
+		~UserData();
+		// (re)starts the render timer unless the user is being torn down
+		void StartTimer(int32_t frameRate);
+		// returns after the last TimerProc run for this user has finished
+		void StopTimer();
 	};
-	unordered_map<int64_t, UserData*> userMaps;
-	UserData* p2pUserData;
+	// looked up for every video packet without a lock
+	SubscriberTable<UserData> userMaps;
+	shared_ptr<UserData> p2pUserData;
+	shared_ptr<UserData> p2pWarmUser;		// callee's decoder, waits for the window passed to AcceptP2PRTC
+	// decoders, renderers and render timers are released here, off the RTM threads
+	Reaper reaper;
+	// latest sps and pps per sender, so a new subscription can start decoding at once
+	struct ParameterSets
+	{
+		vector<unsigned char> sps;
+		vector<unsigned char> pps;
+	};
+	unordered_map<int64_t, ParameterSets> parameterSets;
+	mutex parameterMutex;
+	atomic<int64_t> p2pPeerUid = 0;
+	shared_ptr<RTCEventHandler> eventHandler;
+
+	// large rooms: the windows from SetVideoTiles show the selector's picks, nobody else is subscribed
+	struct Tile
+	{
+		HWND__* hwnd = nullptr;
+		int64_t uid = 0;					// 0 while empty
+		D3D12Renderer* spare = nullptr;		// kept while empty, a window takes only one swap chain
+	};
+	vector<Tile> tiles;
+	// collected under tileMutex, carried out once it is released
+	struct TileWork
+	{
+		int64_t rid = 0;
+		unordered_set<int64_t> unsubscribe;
+		vector<int64_t> subscribe;
+		vector<pair<int32_t, int64_t>> changes;		// tile, uid for OnVideoTileChanged
+	};
+	uint32_t tileWidth = 0;
+	uint32_t tileHeight = 0;
+	LastNSelector selector;
+	mutex tileMutex;
+	void* lastNTimer = NULL;			// app thread only
 
 	class InternalEventHandler : public RTCEventHandler
 	{
@@ -71,6 +170,57 @@ class RTCProxy: public RTMProxy
 	};
 
 	static void TimerProc(void* lpParameter, unsigned char TimerOrWaitFired);
+	static void LastNProc(void* lpParameter, unsigned char TimerOrWaitFired);
+	static void RosterProc(void* lpParameter, unsigned char TimerOrWaitFired);
+	void StopLastNTimer();
+	void UpdateTiles();
+	// tileMutex held
+	bool IsTileCandidate(int64_t uid);
+	// tileMutex held; members from the roster, streams from the player
+	void SelectTiles(const vector<int64_t>& members, const vector<pair<long long, AudioLevel>>& streams, TileWork& work);
+	// tileMutex held; uid 0 empties the tile
+	void SetTile(size_t index, int64_t uid, TileWork& work);
+	// tileMutex not held, the app may call back in from OnVideoTileChanged
+	void RunTileWork(TileWork& work);
+	void OnTileSubscribeFailed(int64_t uid);
+	// leaves the tiles empty with their renderers kept, the room is gone so nothing is unsubscribed
+	void ClearTiles();
+	// the user's renderer stays with the tile; returns who was on it
+	int64_t FreeTile(Tile& tile);
+	// the renderer outlives the user; its render timer is left for the reaper to stop
+	D3D12Renderer* DetachRenderer(UserData& userData);
+	// the swap chain is released on the reaper thread
+	void RetireRenderer(D3D12Renderer* renderer);
+	void ResubscribeVideo();
+	// fetches the member list again, pushes coming in meanwhile are replayed over it
+	void ResyncRoster();
+	void OnRosterDelta(int64_t rid, int64_t uid, bool entered);
+	// without hwnd the renderer is left out until AttachRenderer
+	shared_ptr<UserData> CreateUser(int64_t uid, HWND__* hwnd, uint32_t width, uint32_t height);
+	void AttachRenderer(UserData& userData, HWND__* hwnd, uint32_t width, uint32_t height);
+	void EnterGate(int64_t rid, string token, bool pulled, function<void(int errorCode, bool microphone)> callback);
+	// whatever the room set up goes, after an exit, a kick or the room closing
+	void LeaveRoom();
+	string TakePulledToken(int64_t rid);
+	void WarmAudio();
+	void ReleaseWarmAudio();
+	void PrewarmP2P(int32_t type, int64_t peerUid, HWND__* hwnd, uint32_t width, uint32_t height);
+	// once connected, so the gate can resume the call after a network loss
+	void EnterP2PGate(int64_t callId);
+	// drops whatever the p2p call set up, warmed or connected
+	void ReleaseP2P();
+	void CacheParameterSets(int64_t uid, const MediaBuffer& sps, const MediaBuffer& pps);
+	void ForgetParameterSets(int64_t uid);
+	// dataMutex held, or the user not published yet; false when the decoder already has these
+	bool LoadParameterSets(UserData& userData, const unsigned char* sps, size_t spsLength, const unsigned char* pps, size_t ppsLength);
+	// dataMutex held; decodes one keyframe and draws it
+	bool ShowKeyFrame(UserData& userData, const MediaBuffer& data);
+	// dataMutex held; empties the queue, nothing decodes until a keyframe comes, asked for unless this frame is one
+	void DropToKeyFrame(UserData& userData, int64_t rid, bool keyframe);
+	// rid 0 for the p2p peer
+	void OnVideoFrame(UserData& userData, int64_t rid, int64_t seq, int64_t timestamp, int32_t captureLevel, MediaBuffer data, const MediaBuffer& sps, const MediaBuffer& pps);
+	void RetireUser(shared_ptr<UserData> userData);
+	shared_ptr<UserData> GetP2PUser();
 public:
 
 	struct RTCRoomMembers
@@ -80,6 +230,36 @@ public:
 		int64_t owner;
 	};
 
+	// ms after SubscribeVideo (or accepting a p2p call), -1 until it happened
+	struct FirstFrameStats
+	{
+		int64_t firstPacket = -1;
+		int64_t decoderReady = -1;		// 0 when cached parameter sets were used
+		int64_t firstFrame = -1;
+	};
+
+	// ms after the call was accepted (AcceptP2PRTC called, or the peer accepting ours)
+	struct P2PCallStats
+	{
+		int64_t prewarm = -1;			// spent opening devices and building the decoder while ringing
+		int64_t firstAudio = -1;		// first peer audio packet
+		int64_t firstVideo = -1;		// first peer video frame on screen
+	};
+
+	struct VideoDecodeStats
+	{
+		VideoState state = VideoState::Active;
+		int64_t decoded = 0;		// frames through the decoder
+		int64_t skipped = 0;		// frames dropped undecoded, paused or thumbnail
+	};
+
+	struct RTCSessionStats
+	{
+		int32_t resumes = 0;		// times the gate session was resumed after a network loss
+		int64_t lastOutage = 0;		// ms
+		int64_t lastMediaGap = 0;	// ms without incoming media around the last resume
+	};
+
 	RTCProxy(string rtmhost, unsigned short rtmport, int64_t pid, int64_t uid, shared_ptr<RTMEventHandler> rtmhandler, string rtchost, unsigned short rtcport, shared_ptr<RTCEventHandler> rtchandler);
 	virtual ~RTCProxy();
 
@@ -103,9 +283,38 @@ public:
 	void AcceptP2PRTC(int64_t callId, HWND__* hwnd, uint32_t width, uint32_t height, function<void(int errorCode)> callback);
 	void RefuseP2PRTC(int64_t callId, function<void(int errorCode)> callback);
 
+	bool GetAVSyncStats(int64_t uid, AVSynchronizer::Stats& stats);
+	RTCSessionStats GetRTCSessionStats();
+	bool GetFirstFrameStats(int64_t uid, FirstFrameStats& stats);
+	// for windows that are minimized, covered or shown small; false when uid isn't subscribed
+	bool SetVideoState(int64_t uid, VideoState state);
+	bool GetVideoDecodeStats(int64_t uid, VideoDecodeStats& stats);
+
+	// Large room mode: one tile per window, filled with the pinned users, then
+	// the latest speakers, then other members; the rest of the room's video
+	// is not subscribed. OnVideoTileChanged says who is on which tile. An empty
+	// list ends it.
+	void SetVideoTiles(vector<HWND__*> windows, uint32_t width, uint32_t height);
+	void PinVideo(int64_t uid, bool pinned);
+	LastNSelector::Stats GetLastNStats();
+
+	// Members of the current room, seeded on entering and kept up to date from
+	// the enter and exit pushes; OnRosterChanged reports every change.
+	bool IsRoomMember(int64_t uid);
+	RoomRoster::Role GetMemberRole(int64_t uid);
+	vector<int64_t> GetRoomMembers();
+	RoomRoster::Stats GetRosterStats();
+	// false until the current or last call was accepted
+	bool GetP2PCallStats(P2PCallStats& stats);
+	NetworkMonitor::Stats GetNetworkStats();
+	bool GetLocalAudioLevel(AudioLevel& level);
+	bool GetUserAudioLevel(int64_t uid, AudioLevel& level);
+
 	void Mute();
 	void Unmute();
 	void StartAudio();
 	void StopAudio();
+	void SetAudioPacketDuration(int32_t duration);
+	void SetMusicMode(bool enable);
 };
 
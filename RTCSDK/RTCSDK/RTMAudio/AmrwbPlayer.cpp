@@ -1,57 +1,114 @@
 #include "AmrwbPlayer.h"
 #include <voiceConverter.h>
-#include <vector>
+#include <stdio.h>
+
+namespace
+{
+    const char kAmrwbMagic[] = "#!AMR-WB\n";
+    const size_t kAmrwbMagicLength = sizeof(kAmrwbMagic) - 1;
+    const int32_t kChunkFrames = 50;            // 20 ms frames, one second per conversion
+
+    // storage size of a frame including its header byte, indexed by frame type
+    const size_t kFrameSizes[16] = { 18, 24, 33, 37, 41, 47, 51, 59, 61, 6, 1, 1, 1, 1, 1, 1 };
+}
 
 AmrwbPlayer::AmrwbPlayer()
 {
-	WavePlayer::SetCompleteCallback([this]() {
-		if (wavdata)
-		{
-			free(wavdata);
-			wavdata = nullptr;
-			wavsize = 0;
-		}
-		if (completeCallback)
-			completeCallback();
-		});
-	WavePlayer::SetStartedCallback([this]() {
-		if (startedCallback)
-			startedCallback();
-		});
-	WavePlayer::SetStopedCallback([this]() {
-		if (wavdata)
-		{
-			free(wavdata);
-			wavdata = nullptr;
-			wavsize = 0;
-		}
-		});
 }
 
 AmrwbPlayer::~AmrwbPlayer()
 {
-	if (wavdata)
-	{
-		free(wavdata);
-		wavdata = nullptr;
-		wavsize = 0;
-	}
+    Shutdown();
+    FreeChunk();
+}
+
+bool AmrwbPlayer::Open()
+{
+    FreeChunk();
+    if (source.size() < kAmrwbMagicLength || memcmp(source.data(), kAmrwbMagic, kAmrwbMagicLength) != 0)
+        return false;
+    amrOffset = kAmrwbMagicLength;
+    ZeroMemory(&format, sizeof(format));
+
+    // the first chunk tells us the output format
+    return DecodeChunk();
+}
+
+bool AmrwbPlayer::DecodeChunk()
+{
+    while (amrOffset < source.size())
+    {
+        FreeChunk();
+
+        size_t end = amrOffset;
+        for (int32_t i = 0; i < kChunkFrames && end < source.size(); i++)
+        {
+            unsigned char ft = ((unsigned char)source[end] >> 3) & 0x0f;
+            end += kFrameSizes[ft];
+        }
+        if (end > source.size())
+            end = source.size();
+
+        // the converter only accepts whole files, so every chunk gets the magic
+        vector<char> chunk(kAmrwbMagicLength + end - amrOffset);
+        memcpy(chunk.data(), kAmrwbMagic, kAmrwbMagicLength);
+        memcpy(chunk.data() + kAmrwbMagicLength, source.data() + amrOffset, end - amrOffset);
+        amrOffset = end;
+
+        int status = 0;
+        int wavsize = 0;
+        wavChunk = convert_amrwb_to_wav(chunk.data(), int(chunk.size()), status, wavsize);
+        if (wavChunk == nullptr)
+        {
+            fprintf(stderr, "amr-wb decode error status: %d\n", status);
+            continue;
+        }
+
+        WAVEFORMATEX chunkFormat;
+        if (!ParseWave(wavChunk, wavsize, chunkFormat, chunkPcm, chunkLength))
+        {
+            fprintf(stderr, "amr-wb decode produced no wave data\n");
+            continue;
+        }
+        if (format.nChannels == 0)
+            format = chunkFormat;
+        chunkOffset = 0;
+        if (chunkLength > 0)
+            return true;
+    }
+    FreeChunk();
+    return false;
 }
 
-bool AmrwbPlayer::Start(void* data, size_t len)
+void AmrwbPlayer::FreeChunk()
 {
-	int status;
-	wavsize = 0;
-	wavdata = convert_amrwb_to_wav((char*)data, len, status, wavsize);
-    return WavePlayer::Start(wavdata, wavsize);
+    if (wavChunk)
+    {
+        free_memory(wavChunk);
+        wavChunk = nullptr;
+    }
+    chunkPcm = nullptr;
+    chunkLength = 0;
+    chunkOffset = 0;
 }
 
-void AmrwbPlayer::SetCompleteCallback(function<void()> callback)
+size_t AmrwbPlayer::ReadPcm(char* buffer, size_t bytes)
 {
-	completeCallback = callback;
+    size_t filled = 0;
+    while (filled < bytes)
+    {
+        if (chunkOffset == chunkLength && !DecodeChunk())
+            break;
+        size_t length = min(bytes - filled, chunkLength - chunkOffset);
+        memcpy(buffer + filled, chunkPcm + chunkOffset, length);
+        chunkOffset += length;
+        filled += length;
+    }
+    return filled;
 }
 
-void AmrwbPlayer::SetStartedCallback(function<void()> callback)
+void AmrwbPlayer::Close()
 {
-	startedCallback = callback;
+    FreeChunk();
+    amrOffset = 0;
 }
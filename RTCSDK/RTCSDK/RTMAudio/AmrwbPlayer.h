@@ -1,17 +1,23 @@
 #pragma once
 #include "WavePlayer.h"
+
+// Decodes the AMR-WB message about a second at a time while it plays instead
+// of converting the whole file up front.
 class AmrwbPlayer : public WavePlayer
 {
-	function<void()> completeCallback;
-	function<void()> startedCallback;
+	size_t amrOffset = 0;
+	char* wavChunk = nullptr;
+	const char* chunkPcm = nullptr;
+	size_t chunkLength = 0;
+	size_t chunkOffset = 0;
 
-	char* wavdata=nullptr;
-	int wavsize;
+	bool DecodeChunk();
+	void FreeChunk();
+protected:
+	bool Open() override;
+	size_t ReadPcm(char* buffer, size_t bytes) override;
+	void Close() override;
 public:
 	AmrwbPlayer();
 	~AmrwbPlayer();
-	bool Start(void* data, size_t len) override;
-	void SetCompleteCallback(function<void()> callback) override;
-	void SetStartedCallback(function<void()> callback) override;
 };
-
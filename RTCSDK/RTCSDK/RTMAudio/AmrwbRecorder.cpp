@@ -1,13 +1,141 @@
 #include "AmrwbRecorder.h"
+
+#include "framework.h"
 #include <voiceConverter.h>
 
+namespace
+{
+    const size_t kChunkSamples = 16000;    // 1 s at 16 kHz, 50 AMR-WB frames
+    const char kAmrwbMagic[] = "#!AMR-WB\n";
+    const size_t kAmrwbMagicLength = sizeof(kAmrwbMagic) - 1;
+
+    void PutUint32(char* p, uint32_t v)
+    {
+        p[0] = char(v); p[1] = char(v >> 8); p[2] = char(v >> 16); p[3] = char(v >> 24);
+    }
+
+    void PutUint16(char* p, uint16_t v)
+    {
+        p[0] = char(v); p[1] = char(v >> 8);
+    }
+}
+
+AmrwbRecorder::AmrwbRecorder()
+{
+    keepWave = false;
+}
+
+AmrwbRecorder::~AmrwbRecorder()
+{
+    // the base destructor would only run WaveRecorder::Stop
+    if (IsStarted())
+    {
+        std::string empty;
+        Stop(empty);
+    }
+}
+
+void AmrwbRecorder::OnStart()
+{
+    unique_lock<mutex> lck(encodeMutex);
+    encoded.clear();
+    pending.clear();
+    chunk.clear();
+    chunk.reserve(kChunkSamples);
+    finishing = false;
+    if (encodeThread == nullptr)
+        encodeThread = new thread([this]() {EncodeLoop(); });
+}
+
+void AmrwbRecorder::OnFrame(const int16_t* pcm, size_t samples)
+{
+    chunk.insert(chunk.end(), pcm, pcm + samples);
+    if (chunk.size() >= kChunkSamples)
+    {
+        {
+            unique_lock<mutex> lck(encodeMutex);
+            pending.push_back(move(chunk));
+        }
+        encodeCondition.notify_one();
+        chunk = vector<int16_t>();
+        chunk.reserve(kChunkSamples);
+    }
+}
+
+void AmrwbRecorder::EncodeLoop()
+{
+    unique_lock<mutex> lck(encodeMutex);
+    while (true)
+    {
+        encodeCondition.wait(lck, [this]() {return pending.size() > 0 || finishing; });
+        if (pending.size() == 0)
+            break;
+        vector<int16_t> pcm = move(pending.front());
+        pending.pop_front();
+        lck.unlock();
+        EncodeChunk(pcm);
+        lck.lock();
+    }
+}
+
+void AmrwbRecorder::EncodeChunk(const vector<int16_t>& pcm)
+{
+    uint32_t dataSize = uint32_t(pcm.size() * sizeof(int16_t));
+    vector<char> wav(44 + dataSize);
+    char* header = wav.data();
+    memcpy(header, "RIFF", 4);
+    PutUint32(header + 4, 36 + dataSize);
+    memcpy(header + 8, "WAVEfmt ", 8);
+    PutUint32(header + 16, 16);
+    PutUint16(header + 20, WAVE_FORMAT_PCM);
+    PutUint16(header + 22, 1);
+    PutUint32(header + 24, 16000);
+    PutUint32(header + 28, 16000 * sizeof(int16_t));
+    PutUint16(header + 32, sizeof(int16_t));
+    PutUint16(header + 34, 16);
+    memcpy(header + 36, "data", 4);
+    PutUint32(header + 40, dataSize);
+    memcpy(header + 44, pcm.data(), dataSize);
+
+    int status = 0;
+    int amrsize = 0;
+    char* amrdata = convert_wav_to_amrwb(wav.data(), int(wav.size()), status, amrsize);
+    if (amrdata == nullptr)
+    {
+        fprintf(stderr, "amr-wb encode error status: %d\n", status);
+        return;
+    }
+
+    // every chunk comes back as a complete file, keep the magic only once
+    const char* frames = amrdata;
+    size_t length = amrsize;
+    if (encoded.size() > 0 && length >= kAmrwbMagicLength && memcmp(frames, kAmrwbMagic, kAmrwbMagicLength) == 0)
+    {
+        frames += kAmrwbMagicLength;
+        length -= kAmrwbMagicLength;
+    }
+    encoded.append(frames, length);
+    free_memory(amrdata);
+}
+
 void AmrwbRecorder::Stop(std::string& audioData)
 {
-	WaveRecorder::Stop(audioData);
+    WaveRecorder::Stop(audioData);
+    if (encodeThread == nullptr)
+        return;
+
+    {
+        unique_lock<mutex> lck(encodeMutex);
+        if (chunk.size() > 0)
+            pending.push_back(move(chunk));
+        chunk.clear();
+        finishing = true;
+    }
+    encodeCondition.notify_one();
+    encodeThread->join();
+    delete encodeThread;
+    encodeThread = nullptr;
 
-	int status = 0;
-	int amrsize = 0;
-	char* amrdata = convert_wav_to_amrwb((char*)audioData.data(), audioData.length(), status, amrsize);
-	if (amrdata)
-		audioData.assign(amrdata, amrsize); 
+    audioData.swap(encoded);
+    encoded.clear();
 }
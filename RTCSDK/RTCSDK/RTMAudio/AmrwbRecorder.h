@@ -1,8 +1,32 @@
 #pragma once
 #include "WaveRecorder.h"
+
+#include <condition_variable>
+#include <deque>
+#include <string>
+
+// Encodes AMR-WB in the background while recording. The converter only takes
+// whole WAV buffers, so PCM is handed to a worker in one-second chunks and the
+// AMR frames of every chunk are appended; Stop() only has the last chunk left.
 class AmrwbRecorder : public WaveRecorder
 {
+	vector<int16_t> chunk;
+	deque<vector<int16_t>> pending;
+	std::string encoded;
+	bool finishing = false;
+	std::thread* encodeThread = nullptr;
+	mutex encodeMutex;
+	condition_variable encodeCondition;
+
+	void EncodeLoop();
+	void EncodeChunk(const vector<int16_t>& pcm);
+protected:
+	void OnStart() override;
+	void OnFrame(const int16_t* pcm, size_t samples) override;
 public:
+	AmrwbRecorder();
+	~AmrwbRecorder();
 	void Stop(std::string& audioData) override;
+	const char* GetCodec() override { return "amr-wb"; }
 };
 
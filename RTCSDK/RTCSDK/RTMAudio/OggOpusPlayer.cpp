@@ -0,0 +1,176 @@
+#include "OggOpusPlayer.h"
+
+#include "framework.h"
+#include <opus/opus.h>
+
+namespace
+{
+    const size_t kPageHeaderLength = 27;
+    const int32_t kMaxFrameSamples = 5760;      // 120 ms at 48 kHz
+
+    uint32_t GetLE(const unsigned char* p, int bytes)
+    {
+        uint32_t v = 0;
+        for (int i = bytes - 1; i >= 0; i--)
+            v = (v << 8) | p[i];
+        return v;
+    }
+}
+
+OggOpusPlayer::OggOpusPlayer()
+{
+}
+
+OggOpusPlayer::~OggOpusPlayer()
+{
+    Shutdown();
+    Close();
+}
+
+bool OggOpusPlayer::NextPage()
+{
+    const unsigned char* data = (const unsigned char*)source.data();
+    size_t size = source.size();
+    if (pageOffset + kPageHeaderLength > size || memcmp(data + pageOffset, "OggS", 4) != 0)
+        return false;
+
+    int32_t count = data[pageOffset + 26];
+    size_t body = pageOffset + kPageHeaderLength + count;
+    if (body > size)
+        return false;
+
+    size_t bodyLength = 0;
+    for (int32_t i = 0; i < count; i++)
+        bodyLength += data[pageOffset + kPageHeaderLength + i];
+    if (body + bodyLength > size)
+        return false;
+
+    lacing = data + pageOffset + kPageHeaderLength;
+    segmentCount = count;
+    segmentIndex = 0;
+    bodyOffset = body;
+    pageOffset = body + bodyLength;
+    return true;
+}
+
+bool OggOpusPlayer::NextPacket()
+{
+    // a packet ends on the first lacing value below 255 and may span pages
+    packet.clear();
+    while (true)
+    {
+        if (segmentIndex == segmentCount && !NextPage())
+            return false;
+
+        while (segmentIndex < segmentCount)
+        {
+            unsigned char length = lacing[segmentIndex++];
+            packet.insert(packet.end(), source.data() + bodyOffset, source.data() + bodyOffset + length);
+            bodyOffset += length;
+            if (length < 255)
+                return true;
+        }
+    }
+}
+
+bool OggOpusPlayer::Open()
+{
+    Close();
+    pageOffset = 0;
+    segmentCount = 0;
+    segmentIndex = 0;
+
+    if (!NextPacket() || packet.size() < 19 || memcmp(packet.data(), "OpusHead", 8) != 0)
+        return false;
+
+    // mapping family 0 only, which is all OggOpusRecorder writes
+    channels = packet[9];
+    if (channels < 1 || channels > 2 || packet[18] != 0)
+    {
+        fprintf(stderr, "unsupported opus channel layout: %d\n", channels);
+        return false;
+    }
+    uint32_t inputRate = GetLE(&packet[12], 4);
+    int32_t sampleRate = (inputRate == 0 || inputRate > 16000) ? 48000 : 16000;
+    preSkip = GetLE(&packet[10], 2) * sampleRate / 48000;
+
+    if (!NextPacket() || packet.size() < 8 || memcmp(packet.data(), "OpusTags", 8) != 0)
+        return false;
+
+    int err = OPUS_OK;
+    decoder = opus_decoder_create(sampleRate, channels, &err);
+    if (err != OPUS_OK)
+    {
+        fprintf(stderr, "create decoder failed.");
+        decoder = nullptr;
+        return false;
+    }
+
+    ZeroMemory(&format, sizeof(format));
+    format.wFormatTag = WAVE_FORMAT_PCM;
+    format.nChannels = channels;
+    format.nSamplesPerSec = sampleRate;
+    format.wBitsPerSample = 16;
+    format.nBlockAlign = channels * sizeof(int16_t);
+    format.nAvgBytesPerSec = sampleRate * format.nBlockAlign;
+
+    decoded.resize(size_t(kMaxFrameSamples) * channels);
+    decodedSamples = 0;
+    decodedOffset = 0;
+    return true;
+}
+
+bool OggOpusPlayer::DecodePacket()
+{
+    while (NextPacket())
+    {
+        if (packet.empty())
+            continue;
+        int frames = opus_decode(decoder, packet.data(), opus_int32(packet.size()), decoded.data(), kMaxFrameSamples, 0);
+        if (frames < 0)
+        {
+            fprintf(stderr, "opus decode error: %d\n", frames);
+            continue;
+        }
+        decodedSamples = size_t(frames) * channels;
+        decodedOffset = 0;
+        if (preSkip > 0)
+        {
+            int32_t skip = min(preSkip, frames);
+            preSkip -= skip;
+            decodedOffset = size_t(skip) * channels;
+        }
+        if (decodedOffset < decodedSamples)
+            return true;
+    }
+    return false;
+}
+
+size_t OggOpusPlayer::ReadPcm(char* buffer, size_t bytes)
+{
+    if (decoder == nullptr)
+        return 0;
+
+    size_t filled = 0;
+    while (filled < bytes)
+    {
+        if (decodedOffset == decodedSamples && !DecodePacket())
+            break;
+        size_t length = min(bytes - filled, (decodedSamples - decodedOffset) * sizeof(int16_t));
+        memcpy(buffer + filled, decoded.data() + decodedOffset, length);
+        decodedOffset += length / sizeof(int16_t);
+        filled += length;
+    }
+    return filled;
+}
+
+void OggOpusPlayer::Close()
+{
+    if (decoder)
+    {
+        opus_decoder_destroy(decoder);
+        decoder = nullptr;
+    }
+    decodedSamples = 0;
+    decodedOffset = 0;
+}
@@ -0,0 +1,35 @@
+#pragma once
+#include "WavePlayer.h"
+
+struct OpusDecoder;
+
+// Pulls Opus packets out of the Ogg pages one at a time and decodes them as
+// the waveOut buffers drain, so nothing but the compressed message is kept.
+class OggOpusPlayer : public WavePlayer
+{
+	OpusDecoder* decoder = nullptr;
+	int32_t channels = 0;
+	int32_t preSkip = 0;
+
+	size_t pageOffset = 0;
+	size_t bodyOffset = 0;
+	const unsigned char* lacing = nullptr;
+	int32_t segmentCount = 0;
+	int32_t segmentIndex = 0;
+	vector<unsigned char> packet;
+
+	vector<int16_t> decoded;
+	size_t decodedSamples = 0;
+	size_t decodedOffset = 0;
+
+	bool NextPage();
+	bool NextPacket();
+	bool DecodePacket();
+protected:
+	bool Open() override;
+	size_t ReadPcm(char* buffer, size_t bytes) override;
+	void Close() override;
+public:
+	OggOpusPlayer();
+	~OggOpusPlayer();
+};
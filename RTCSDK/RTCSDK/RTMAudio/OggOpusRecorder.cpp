@@ -0,0 +1,175 @@
+#include "OggOpusRecorder.h"
+
+#include "framework.h"
+#include <opus/opus.h>
+#include <chrono>
+
+namespace
+{
+    const int32_t kBitrate = 16000;
+    const int32_t kPagePackets = 50;            // one page per second of audio
+    const int32_t kGranulePerFrame = 960;       // Ogg Opus granules are always 48 kHz
+    const unsigned char kBeginOfStream = 0x02;
+    const unsigned char kEndOfStream = 0x04;
+
+    struct OggCrcTable
+    {
+        uint32_t table[256];
+        OggCrcTable()
+        {
+            for (uint32_t i = 0; i < 256; i++)
+            {
+                uint32_t r = i << 24;
+                for (int j = 0; j < 8; j++)
+                    r = (r & 0x80000000) ? (r << 1) ^ 0x04c11db7 : (r << 1);
+                table[i] = r;
+            }
+        }
+    };
+
+    uint32_t OggCrc(const unsigned char* data, size_t length, uint32_t crc)
+    {
+        static const OggCrcTable crcTable;
+        for (size_t i = 0; i < length; i++)
+            crc = (crc << 8) ^ crcTable.table[((crc >> 24) & 0xff) ^ data[i]];
+        return crc;
+    }
+
+    void PutLE(unsigned char* p, uint64_t v, int bytes)
+    {
+        for (int i = 0; i < bytes; i++)
+            p[i] = (unsigned char)(v >> (8 * i));
+    }
+}
+
+OggOpusRecorder::OggOpusRecorder()
+{
+    keepWave = false;
+}
+
+OggOpusRecorder::~OggOpusRecorder()
+{
+    // the base destructor would only run WaveRecorder::Stop
+    if (IsStarted())
+    {
+        std::string empty;
+        Stop(empty);
+    }
+}
+
+void OggOpusRecorder::OnStart()
+{
+    int err = OPUS_OK;
+    encoder = opus_encoder_create(16000, 1, OPUS_APPLICATION_VOIP, &err);
+    if (err != OPUS_OK)
+    {
+        fprintf(stderr, "create encoder failed.");
+        encoder = nullptr;
+        return;
+    }
+    opus_encoder_ctl(encoder, OPUS_SET_BITRATE(kBitrate));
+    opus_int32 lookahead = 0;
+    opus_encoder_ctl(encoder, OPUS_GET_LOOKAHEAD(&lookahead));
+
+    encoded.clear();
+    pageBody.clear();
+    segments.clear();
+    pagePackets = 0;
+    pageSequence = 0;
+    granule = 0;
+    serial = (uint32_t)chrono::steady_clock::now().time_since_epoch().count();
+    packet.resize(4000);
+
+    unsigned char head[19];
+    memcpy(head, "OpusHead", 8);
+    head[8] = 1;                                // version
+    head[9] = 1;                                // channels
+    PutLE(head + 10, lookahead * 3, 2);         // pre-skip at 48 kHz
+    PutLE(head + 12, 16000, 4);                 // input sample rate
+    PutLE(head + 16, 0, 2);                     // output gain
+    head[18] = 0;                               // mapping family
+    AddPacket(head, sizeof(head));
+    FlushPage(kBeginOfStream);
+
+    const char* vendor = opus_get_version_string();
+    uint32_t vendorLength = (uint32_t)strlen(vendor);
+    vector<unsigned char> tags(8 + 4 + vendorLength + 4);
+    memcpy(tags.data(), "OpusTags", 8);
+    PutLE(tags.data() + 8, vendorLength, 4);
+    memcpy(tags.data() + 12, vendor, vendorLength);
+    PutLE(tags.data() + 12 + vendorLength, 0, 4);
+    AddPacket(tags.data(), tags.size());
+    FlushPage(0);
+    // the header pages carry 0; audio counts from the pre-skip, which the player trims off again
+    granule = lookahead * 3;
+}
+
+void OggOpusRecorder::OnFrame(const int16_t* pcm, size_t samples)
+{
+    if (encoder == nullptr)
+        return;
+
+    int length = opus_encode(encoder, pcm, int(samples), packet.data(), int(packet.size()));
+    if (length < OPUS_OK)
+    {
+        fprintf(stderr, "opus encode erro err: %d!\n", length);
+        return;
+    }
+    AddPacket(packet.data(), length);
+    granule += kGranulePerFrame;
+    if (pagePackets >= kPagePackets)
+        FlushPage(0);
+}
+
+void OggOpusRecorder::AddPacket(const unsigned char* data, size_t length)
+{
+    size_t lacing = length / 255 + 1;
+    if (segments.size() + lacing > 255)
+        FlushPage(0);
+
+    for (size_t i = 0; i < length / 255; i++)
+        segments.push_back(255);
+    segments.push_back((unsigned char)(length % 255));
+    pageBody.insert(pageBody.end(), data, data + length);
+    pagePackets++;
+}
+
+void OggOpusRecorder::FlushPage(unsigned char headerType)
+{
+    unsigned char header[27];
+    memcpy(header, "OggS", 4);
+    header[4] = 0;
+    header[5] = headerType;
+    PutLE(header + 6, granule, 8);
+    PutLE(header + 14, serial, 4);
+    PutLE(header + 18, pageSequence++, 4);
+    PutLE(header + 22, 0, 4);
+    header[26] = (unsigned char)segments.size();
+
+    uint32_t crc = OggCrc(header, sizeof(header), 0);
+    crc = OggCrc(segments.data(), segments.size(), crc);
+    crc = OggCrc(pageBody.data(), pageBody.size(), crc);
+    PutLE(header + 22, crc, 4);
+
+    encoded.append((char*)header, sizeof(header));
+    encoded.append((char*)segments.data(), segments.size());
+    encoded.append((char*)pageBody.data(), pageBody.size());
+
+    segments.clear();
+    pageBody.clear();
+    pagePackets = 0;
+}
+
+void OggOpusRecorder::Stop(std::string& audioData)
+{
+    WaveRecorder::Stop(audioData);
+    if (encoder == nullptr)
+        return;
+
+    FlushPage(kEndOfStream);
+    opus_encoder_destroy(encoder);
+    encoder = nullptr;
+
+    audioData.swap(encoded);
+    encoded.clear();
+}
@@ -0,0 +1,33 @@
+#pragma once
+#include "WaveRecorder.h"
+
+#include <string>
+
+struct OpusEncoder;
+
+// Encodes each 20 ms block to Opus as it is captured and packs the packets
+// into Ogg pages (RFC 7845), so the message is ready as soon as Stop() returns.
+class OggOpusRecorder : public WaveRecorder
+{
+	OpusEncoder* encoder = nullptr;
+	std::string encoded;
+	vector<unsigned char> pageBody;
+	vector<unsigned char> segments;
+	int32_t pagePackets = 0;
+	uint32_t serial = 0;
+	uint32_t pageSequence = 0;
+	int64_t granule = 0;
+	vector<unsigned char> packet;
+
+	void AddPacket(const unsigned char* data, size_t length);
+	void FlushPage(unsigned char headerType);
+protected:
+	void OnStart() override;
+	void OnFrame(const int16_t* pcm, size_t samples) override;
+public:
+	OggOpusRecorder();
+	~OggOpusRecorder();
+	void Stop(std::string& audioData) override;
+	const char* GetCodec() override { return "opus"; }
+};
+
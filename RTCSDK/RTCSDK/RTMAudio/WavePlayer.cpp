@@ -1,6 +1,11 @@
 #include "WavePlayer.h"
 #include <thread>
 
+namespace
+{
+	const DWORD kBufferMilliseconds = 200;
+}
+
 void WavePlayer::waveOutProc(
 	HWAVEOUT  hwo,
 	UINT      uMsg,
@@ -27,9 +32,18 @@ void WavePlayer::waveOutProc(
 
 WavePlayer::WavePlayer():
 	waveout(NULL),
-	data(nullptr),
-	len(0)
+	exhausted(false),
+	hasPending(false),
+	pcm(nullptr),
+	pcmLength(0),
+	pcmOffset(0)
 {
+	ZeroMemory(&format, sizeof(format));
+	for (int i = 0; i < kBufferCount; i++)
+	{
+		ZeroMemory(&headers[i], sizeof(WAVEHDR));
+		queued[i] = false;
+	}
 	for (auto& ev : events)
 	{
 		ev = CreateEvent(nullptr, true, false, nullptr);
@@ -45,29 +59,64 @@ WavePlayer::WavePlayer():
 				}
 				else if (res == WAIT_OBJECT_0)
 				{
-					if (waveout == NULL)
+					ResetEvent(events[0]);
 					{
-						UINT deviceNum = waveOutGetNumDevs();
-						if (deviceNum == 0)
+						unique_lock<mutex> lck(pendingMutex);
+						if (!hasPending)
 							continue;
+						source.swap(pending);
+						hasPending = false;
+					}
+					// a new message replaces whatever is still playing
+					if (waveout != NULL)
+					{
+						waveOutReset(waveout);
+						CloseDevice();
+					}
+					if (!Open())
+					{
+						fprintf(stderr, "unsupported voice message\n");
+						Close();
+						continue;
+					}
 
-						MMRESULT res = waveOutOpen(&waveout, 0, (LPCWAVEFORMATEX)(data + 20), (DWORD_PTR)waveOutProc, (DWORD_PTR)this, CALLBACK_FUNCTION);
-						WAVEHDR wavehdr;
-						wavehdr.lpData = (LPSTR)(data);
-						wavehdr.dwBufferLength = len;
-						wavehdr.dwFlags = 0;
-						waveOutPrepareHeader(waveout, &wavehdr, sizeof(WAVEHDR));
-						res = waveOutWrite(waveout, &wavehdr, sizeof(WAVEHDR));
+					UINT deviceNum = waveOutGetNumDevs();
+					if (deviceNum == 0)
+					{
+						Close();
+						continue;
+					}
+
+					MMRESULT res = waveOutOpen(&waveout, 0, &format, (DWORD_PTR)waveOutProc, (DWORD_PTR)this, CALLBACK_FUNCTION);
+					if (res != MMSYSERR_NOERROR)
+					{
+						waveout = NULL;
+						Close();
+						continue;
+					}
+
+					size_t bufferSize = format.nAvgBytesPerSec * kBufferMilliseconds / 1000;
+					bufferSize -= bufferSize % format.nBlockAlign;
+					exhausted = false;
+					for (int i = 0; i < kBufferCount; i++)
+					{
+						buffers[i].resize(bufferSize);
+						if (!QueueBuffer(i))
+							break;
+					}
+					if (QueuedCount() == 0)
+					{
+						CloseDevice();
+						if (completeCallback)
+							completeCallback();
 					}
-					ResetEvent(events[0]);
 				}
 				else if (res == WAIT_OBJECT_0 + 1)
 				{
 					if (waveout != NULL)
 					{
 						waveOutReset(waveout);
-						waveOutClose(waveout);
-						waveout = NULL;
+						CloseDevice();
 					}
 					if (stopedCallback)
 						stopedCallback();
@@ -75,14 +124,27 @@ WavePlayer::WavePlayer():
 				}
 				else if (res == WAIT_OBJECT_0 + 2)
 				{
+					ResetEvent(events[2]);
 					if (waveout != NULL)
 					{
-						waveOutClose(waveout);
-						waveout = NULL;
-						if (completeCallback)
-							completeCallback();
+						// refill whatever the device has handed back
+						for (int i = 0; i < kBufferCount; i++)
+						{
+							if (queued[i] && (headers[i].dwFlags & WHDR_DONE))
+							{
+								waveOutUnprepareHeader(waveout, &headers[i], sizeof(WAVEHDR));
+								queued[i] = false;
+								if (!exhausted)
+									QueueBuffer(i);
+							}
+						}
+						if (QueuedCount() == 0)
+						{
+							CloseDevice();
+							if (completeCallback)
+								completeCallback();
+						}
 					}
-					ResetEvent(events[2]);
 				}
 				else if (res == WAIT_OBJECT_0 + 3)
 				{
@@ -100,26 +162,138 @@ WavePlayer::WavePlayer():
 
 WavePlayer::~WavePlayer()
 {
-	SetEvent(events[3]);
-	th->join();
+	Shutdown();
 	for (auto& ev : events)
 	{
 		CloseHandle(ev);
 	}
 }
 
+void WavePlayer::Shutdown()
+{
+	if (th == nullptr)
+		return;
+	SetEvent(events[3]);
+	th->join();
+	delete th;
+	th = nullptr;
+	if (waveout != NULL)
+	{
+		waveOutReset(waveout);
+		CloseDevice();
+	}
+}
+
 WavePlayer* WavePlayer::GetInstance()
 {
 	static WavePlayer* a = new WavePlayer();
 	return a;
 }
 
+bool WavePlayer::QueueBuffer(int index)
+{
+	size_t length = ReadPcm(buffers[index].data(), buffers[index].size());
+	if (length == 0)
+	{
+		exhausted = true;
+		return false;
+	}
+
+	WAVEHDR& header = headers[index];
+	ZeroMemory(&header, sizeof(WAVEHDR));
+	header.lpData = buffers[index].data();
+	header.dwBufferLength = (DWORD)length;
+	waveOutPrepareHeader(waveout, &header, sizeof(WAVEHDR));
+	if (waveOutWrite(waveout, &header, sizeof(WAVEHDR)) != MMSYSERR_NOERROR)
+	{
+		waveOutUnprepareHeader(waveout, &header, sizeof(WAVEHDR));
+		exhausted = true;
+		return false;
+	}
+	queued[index] = true;
+	return true;
+}
+
+int32_t WavePlayer::QueuedCount()
+{
+	int32_t count = 0;
+	for (int i = 0; i < kBufferCount; i++)
+	{
+		if (queued[i])
+			count++;
+	}
+	return count;
+}
+
+void WavePlayer::CloseDevice()
+{
+	for (int i = 0; i < kBufferCount; i++)
+	{
+		if (queued[i])
+		{
+			waveOutUnprepareHeader(waveout, &headers[i], sizeof(WAVEHDR));
+			queued[i] = false;
+		}
+	}
+	waveOutClose(waveout);
+	waveout = NULL;
+	Close();
+}
+
+bool WavePlayer::ParseWave(const char* data, size_t size, WAVEFORMATEX& format, const char*& pcm, size_t& pcmLength)
+{
+	// walk the RIFF chunks for fmt and data instead of assuming a 44 byte header
+	if (size < 12 || memcmp(data, "RIFF", 4) != 0 || memcmp(data + 8, "WAVE", 4) != 0)
+		return false;
+
+	bool hasFormat = false;
+	size_t offset = 12;
+	while (offset + 8 <= size)
+	{
+		const char* chunk = data + offset;
+		uint32_t chunkSize = *(const uint32_t*)(chunk + 4);
+		size_t body = offset + 8;
+		size_t available = size - body;
+		if (memcmp(chunk, "fmt ", 4) == 0 && chunkSize >= 16 && available >= 16)
+		{
+			ZeroMemory(&format, sizeof(format));
+			memcpy(&format, chunk + 8, 16);
+			hasFormat = true;
+		}
+		else if (memcmp(chunk, "data", 4) == 0)
+		{
+			pcm = data + body;
+			pcmLength = min<size_t>(chunkSize, available);
+			return hasFormat;
+		}
+		offset = body + chunkSize + (chunkSize & 1);
+	}
+	return false;
+}
+
+bool WavePlayer::Open()
+{
+	pcmOffset = 0;
+	return ParseWave(source.data(), source.size(), format, pcm, pcmLength);
+}
+
+size_t WavePlayer::ReadPcm(char* buffer, size_t bytes)
+{
+	size_t length = min(bytes, pcmLength - pcmOffset);
+	memcpy(buffer, pcm + pcmOffset, length);
+	pcmOffset += length;
+	return length;
+}
+
 bool WavePlayer::Start(void* data, size_t len)
 {
 	if (!data || len == 0)
 		return false;
-	this->data = (char*)data;
-	this->len = len;
+	{
+		unique_lock<mutex> lck(pendingMutex);
+		pending.assign((char*)data, (char*)data + len);
+		hasPending = true;
+	}
 	return SetEvent(events[0]);
 }
 
@@ -141,4 +315,4 @@ void WavePlayer::SetStopedCallback(function<void()> callback)
 bool WavePlayer::Stop()
 {
 	return SetEvent(events[1]);
-}
\ No newline at end of file
+}
@@ -1,14 +1,21 @@
 #pragma once
 #include <functional>
 #include <thread>
+#include <vector>
+#include <mutex>
 #include <Windows.h>
 #include <mmeapi.h>
 
 using namespace std;
 
 
+// Plays through a small ring of waveOut buffers that are refilled from
+// ReadPcm() as the device returns them, so only a few hundred milliseconds of
+// PCM are ever held. Subclasses decode compressed messages chunk by chunk.
 class WavePlayer
 {
+	static const int kBufferCount = 3;
+
 	HWAVEOUT waveout;
 	thread* th;
 	HANDLE events[5];// 0 for star 1 for stop 2 for complete 3 for exit 4 for started
@@ -16,10 +23,37 @@ class WavePlayer
 	function<void()> startedCallback;
 	function<void()> stopedCallback;
 
-	char* data;
-	size_t len;
+	WAVEHDR headers[kBufferCount];
+	vector<char> buffers[kBufferCount];
+	bool queued[kBufferCount];
+	bool exhausted;
+
+	mutex pendingMutex;
+	vector<char> pending;
+	bool hasPending;
+
+	const char* pcm;
+	size_t pcmLength;
+	size_t pcmOffset;
+
+	bool QueueBuffer(int index);
+	int32_t QueuedCount();
+	void CloseDevice();
 
 	static void CALLBACK waveOutProc(HWAVEOUT hwo, UINT uMsg, DWORD_PTR dwInstance, DWORD_PTR dwParam1, DWORD_PTR dwParam2);
+protected:
+	vector<char> source;
+	WAVEFORMATEX format;
+
+	static bool ParseWave(const char* data, size_t size, WAVEFORMATEX& format, const char*& pcm, size_t& pcmLength);
+	// Joins the player thread; subclasses call it before their state goes away.
+	void Shutdown();
+
+	// Called on the player thread with the message in source; fills format.
+	virtual bool Open();
+	// Called on the player thread; returns 0 once the message is exhausted.
+	virtual size_t ReadPcm(char* buffer, size_t bytes);
+	virtual void Close() {}
 public:
 	WavePlayer();
 	virtual ~WavePlayer();
@@ -31,4 +65,3 @@ public:
 	virtual void SetStopedCallback(function<void()> callback);
 	virtual bool Stop();
 };
-
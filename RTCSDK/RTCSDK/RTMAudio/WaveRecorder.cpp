@@ -1,7 +1,7 @@
 #include "WaveRecorder.h"
 
 #include "framework.h"
-#include <samplerate.h>
+#include <Resampler.h>
 #include <iostream>
 
 WaveRecorder::WaveRecorder() :
@@ -60,10 +60,11 @@ WaveRecorder::~WaveRecorder()
 void WaveRecorder::TimerProc(PVOID lpParameter, BOOLEAN TimerOrWaitFired)
 {
     WaveRecorder* thiz = (WaveRecorder*)lpParameter;
-    int a = thiz->capture->SamplesPerSecond();
-    int b = thiz->capture->BytesPerSample();
-    size_t sizeInByte = thiz->capture->SamplesPerSecond() * 20 * thiz->capture->BytesPerSample() * thiz->capture->ChannelCount() / 1000;
-    static shared_ptr<BYTE> pcmData = shared_ptr<BYTE>(new BYTE[sizeInByte]);
+    const size_t captureFrames = thiz->capture->SamplesPerSecond() * 20 / 1000;
+    const size_t frameSize = thiz->sampleRate * 20 / 1000;
+    size_t sizeInByte = captureFrames * thiz->capture->BytesPerSample() * thiz->capture->ChannelCount();
+    vector<BYTE> pcmData(sizeInByte);
+    vector<float> monoData(thiz->resampler->MaxOutputFrames(captureFrames));
 
     thiz->duration = 0;
     HANDLE tEvent = CreateEvent(nullptr, true, false, nullptr);
@@ -78,62 +79,28 @@ void WaveRecorder::TimerProc(PVOID lpParameter, BOOLEAN TimerOrWaitFired)
         ResetEvent(tEvent);
         size_t readed = 0;
         if (thiz->capture)
-            readed = thiz->capture->GetAudioData(pcmData.get(), sizeInByte);
-        // resample
+            readed = thiz->capture->GetAudioData(pcmData.data(), sizeInByte);
         if (readed != sizeInByte)
             continue;
 
-        if (thiz->capture->ChannelCount() == 2)
-        {
-            for (int i = 0; i != thiz->capture->SamplesPerSecond() * 20 / 1000; i++)
-            {
-                ((float*)(pcmData.get()))[i] = ((float*)pcmData.get())[i * 2];
-            }
-        }
+        // resample and fold to mono
+        size_t generated = thiz->resampler->Process((float*)pcmData.data(), captureFrames, monoData.data(), frameSize);
+        if (generated != frameSize)
+            continue;
 
-        if (thiz->needResample)
-        {
-            SRC_DATA srcData;
-            srcData.data_in = (float*)pcmData.get();
-            srcData.input_frames = thiz->capture->SamplesPerSecond() * 20 / 1000;
-            int32_t resampleSize = sizeInByte * thiz->sampleRate / thiz->capture->SamplesPerSecond();
-            static shared_ptr<BYTE> resampleData = shared_ptr<BYTE>(new BYTE[resampleSize]);
-            srcData.output_frames = thiz->sampleRate * 20 / 1000;
-            srcData.data_out = (float*)resampleData.get();
-            srcData.end_of_input = 0;
-            srcData.src_ratio = double(thiz->sampleRate) / double(thiz->capture->SamplesPerSecond());
-            src_process(thiz->resampler, &srcData);
+        thiz->meter.Process(monoData.data(), frameSize);
+        LevelMeter::FloatToInt16(monoData.data(), (int16_t*)pcmData.data(), frameSize);
 
-            for (int i = 0; i != srcData.output_frames_gen; i++)
-            {
-                ((int16_t*)(pcmData.get()))[i] = INT16_MAX * (((float*)resampleData.get())[i]);
-            }
-
-        }
-        else
+        if (thiz->keepWave)
         {
-            for (int i = 0; i != thiz->sampleRate / 1000 * 20; i++)
-            {
-                ((int16_t*)(pcmData.get()))[i] = INT16_MAX * (((float*)pcmData.get())[i]);
-            }
+            UINT written;
+            thiz->file.Write(frameSize * sizeof(int16_t), pcmData.data(), &written);
         }
-
-        UINT written;
-        thiz->file.Write(16 * 20 * 2, pcmData.get(), &written);
+        thiz->OnFrame((int16_t*)pcmData.data(), frameSize);
         thiz->duration += 20;
 
-        int max = 0;
         if (thiz->OnAudioReady)
-        {
-            for (int i = 0; i != 16 * 20; i++)
-            {
-                int x = abs(((int16_t*)(pcmData.get()))[i]);
-                if (max < x)
-                    max = x;
-            }
-            double db = 20 * log10(double(max) / INT16_MAX);
-            thiz->OnAudioReady(db);
-        }
+            thiz->OnAudioReady(thiz->meter.GetLevel().peak);
     }
     DeleteTimerQueueTimer(NULL, hTimer, NULL);
     CloseHandle(tEvent);
@@ -155,7 +122,6 @@ bool WaveRecorder::Start()
     unique_lock<mutex> lck(startedMutex);
     if (!started)
     {
-        started = true;
         if (capture)
         {
 
@@ -164,14 +130,13 @@ bool WaveRecorder::Start()
             {
                 sampleRate = 16000;
                 needResample = true;
-                int err = 0;
-                resampler = src_new(SRC_SINC_FASTEST, 1, &err);
             }
             else if (sampleRate != 16000)
             {
                 fprintf(stderr, "unsupported sample rate %d\n", sampleRate);
                 return false;
             }
+            resampler = new Resampler(capture->SamplesPerSecond(), sampleRate, capture->ChannelCount(), 1);
 
             WAVEFORMATEX wfxInput;
             ZeroMemory(&wfxInput, sizeof(wfxInput));
@@ -184,17 +149,36 @@ bool WaveRecorder::Start()
             //LPTSTR str = new WCHAR[32];
             //lstrcpyW(str, L"tmp.wav");
             //file.Open(str, &wfxInput, WAVEFILE_WRITE);
-            HRESULT res = file.Open(NULL, &wfxInput, WAVEFILE_WRITE);
-            if (FAILED(res))
+            if (keepWave)
             {
-                DWORD err = GetLastError();
-                return false;
+                HRESULT res = file.Open(NULL, &wfxInput, WAVEFILE_WRITE);
+                if (FAILED(res))
+                {
+                    DWORD err = GetLastError();
+                    delete resampler;
+                    resampler = nullptr;
+                    needResample = false;
+                    return false;
+                }
             }
 
             //delete[] str;
             bool s = capture->Start();
             if (!s)
+            {
+                if (keepWave)
+                {
+                    file.Close();
+                    file.Release();
+                }
+                delete resampler;
+                resampler = nullptr;
+                needResample = false;
                 return false;
+            }
+            // the subclass's encoder comes up last, a failed start leaves nothing running
+            OnStart();
+            started = true;
             if (!hTimer)
             {
                 running = true;
@@ -203,7 +187,6 @@ bool WaveRecorder::Start()
         }
         else
         {
-            started = false;
             return false;
         }
     }
@@ -227,13 +210,12 @@ void WaveRecorder::Stop(std::string& audioData)
         if (capture)
             capture->Stop();
 
-        if (needResample)
-        {
-            src_delete(resampler);
-            resampler = nullptr;
-            needResample = false;
-        }
+        delete resampler;
+        resampler = nullptr;
+        meter.Reset();
+        needResample = false;
 
+        if (keepWave)
         {
             file.Close();
             DWORD readed = 0;
@@ -264,3 +246,14 @@ int32_t WaveRecorder::GetSampleRate()
     return sampleRate;
 }
 
+AudioLevel WaveRecorder::GetLevel()
+{
+    return meter.GetLevel();
+}
+
+bool WaveRecorder::IsStarted()
+{
+    unique_lock<mutex> lck(startedMutex);
+    return started;
+}
+
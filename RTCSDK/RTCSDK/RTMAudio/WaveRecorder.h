@@ -5,9 +5,10 @@
 #pragma once
 #include <functional>
 #include "CWaveFile.h"
+#include <LevelMeter.h>
 
 struct OpusEncoder;
-typedef struct SRC_STATE_tag SRC_STATE;
+class Resampler;
 
 class WaveRecorder
 {
@@ -24,11 +25,19 @@ class WaveRecorder
 
 	CWaveFile file;
 
-	SRC_STATE* resampler;
+	Resampler* resampler;
+	LevelMeter meter;
 
 	int32_t duration = 0;
 
 	static void WINAPI TimerProc(PVOID lpParameter, BOOLEAN TimerOrWaitFired);
+protected:
+	// subclasses that encode while recording turn this off so the raw PCM isn't kept
+	bool keepWave = true;
+
+	// called on the capture thread for every 20 ms block of 16 kHz mono PCM
+	virtual void OnStart() {}
+	virtual void OnFrame(const int16_t* pcm, size_t samples) {}
 public:
 	WaveRecorder();
 	virtual ~WaveRecorder();
@@ -38,5 +47,8 @@ public:
 	virtual void Stop(std::string& audioData);
 	int32_t GetDuration();
 	int32_t GetSampleRate();
+	AudioLevel GetLevel();
+	bool IsStarted();
+	virtual const char* GetCodec() { return "wav"; }
 };
 
@@ -14,7 +14,9 @@
 #include "./RTMUnitis/RTMFile.h"
 #include "./RTMUnitis/RTMAudio.h"
 #include "./RTMAudio/AmrwbRecorder.h"
+#include "./RTMAudio/OggOpusRecorder.h"
 #include "./RTMAudio/AmrwbPlayer.h"
+#include "./RTMAudio/OggOpusPlayer.h"
 
 using namespace fpnn;
 using namespace std;
@@ -209,6 +211,8 @@ public:
 
 	bool StartRecordAudio();
 	void StopRecordAudio(RTMAudio& recordata);
+	bool SetRecordAudioCodec(string codec);
+	AudioLevel GetRecordAudioLevel();
 
 	bool StartPlayAudio(RTMAudio recordata);
 	bool StopPlayAudio();
@@ -278,8 +282,8 @@ public:
 		RTM_EC_IN_BLACKLIST,
 	};
 
-	AmrwbRecorder rtmWaveRecorder;
-	AmrwbPlayer rtmWavePlayer;
+	unique_ptr<WaveRecorder> rtmWaveRecorder = make_unique<AmrwbRecorder>();
+	unique_ptr<WavePlayer> rtmWavePlayer = make_unique<AmrwbPlayer>();
 };
 
 void printQuestJson(std::string method, FPQuestPtr quest);
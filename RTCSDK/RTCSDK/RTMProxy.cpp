@@ -3524,6 +3524,23 @@ void RTMProxy::StopRecordAudio(RTMAudio& recordata)
     rtm->StopRecordAudio(recordata);
 }
 
+bool RTMProxy::SetRecordAudioCodec(string codec)
+{
+    if (!rtm)
+        return false;
+
+    return rtm->SetRecordAudioCodec(codec);
+}
+
+bool RTMProxy::GetRecordAudioLevel(AudioLevel& level)
+{
+    if (!rtm)
+        return false;
+
+    level = rtm->GetRecordAudioLevel();
+    return true;
+}
+
 
 bool RTMProxy::StartPlayAudio(RTMAudio recordata)
 {
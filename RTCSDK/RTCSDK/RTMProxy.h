@@ -8,6 +8,7 @@
 
 #include "RTMEventHandler.h"
 #include "./RTMUnitis/RTMAudio.h"
+#include <LevelMeter.h>
 
 using namespace std;
 
@@ -231,6 +232,8 @@ public:
 
 	bool StartRecordAudio();
 	void StopRecordAudio(RTMAudio& recordata);
+	bool SetRecordAudioCodec(string codec);
+	bool GetRecordAudioLevel(AudioLevel& level);
 	bool StartPlayAudio(RTMAudio recordata);
 	bool StopPlayAudio();
 };
@@ -4,23 +4,53 @@
 
 bool RTMClient::StartRecordAudio()
 {
-	return rtmWaveRecorder.Start();
+	return rtmWaveRecorder->Start();
 }
 
 void RTMClient::StopRecordAudio(RTMAudio& recordata)
 {
-	rtmWaveRecorder.Stop(recordata.audioData);
-	recordata.audioDur = rtmWaveRecorder.GetDuration();
-	recordata.audioSampleRate = rtmWaveRecorder.GetSampleRate();
+	rtmWaveRecorder->Stop(recordata.audioData);
+	recordata.audioCodec = rtmWaveRecorder->GetCodec();
+	recordata.audioDur = rtmWaveRecorder->GetDuration();
+	recordata.audioSampleRate = rtmWaveRecorder->GetSampleRate();
+}
+
+AudioLevel RTMClient::GetRecordAudioLevel()
+{
+	return rtmWaveRecorder->GetLevel();
+}
+
+bool RTMClient::SetRecordAudioCodec(string codec)
+{
+	if (rtmWaveRecorder->IsStarted())
+		return false;
+	if (codec == rtmWaveRecorder->GetCodec())
+		return true;
+
+	if (codec == "amr-wb")
+		rtmWaveRecorder = make_unique<AmrwbRecorder>();
+	else if (codec == "opus")
+		rtmWaveRecorder = make_unique<OggOpusRecorder>();
+	else
+		return false;
+	return true;
 }
 	 
 
 bool RTMClient::StartPlayAudio(RTMAudio recordata)
 {
-	return rtmWavePlayer.Start((void*)recordata.audioData.c_str(), recordata.audioData.length());
+	bool opus = recordata.audioCodec == "opus";
+	if (opus != (dynamic_cast<OggOpusPlayer*>(rtmWavePlayer.get()) != nullptr))
+	{
+		if (opus)
+			rtmWavePlayer = make_unique<OggOpusPlayer>();
+		else
+			rtmWavePlayer = make_unique<AmrwbPlayer>();
+	}
+	return rtmWavePlayer->Start((void*)recordata.audioData.c_str(), recordata.audioData.length());
 }
 
 bool RTMClient::StopPlayAudio()
 {
-	return rtmWavePlayer.Stop();
+	return rtmWavePlayer->Stop();
 }
\ No newline at end of file
@@ -5,7 +5,7 @@ struct RTMAudio
 {
     std::string audioCodec = "amr-wb";
     std::string audioLang = "zh-CN";
-    std::string audioData;  // Current is AMR-WB
+    std::string audioData;  // AMR-WB or Ogg Opus, see audioCodec
     int64_t audioDur = 0;   // Duration in ms
     int32_t audioSampleRate = 16000;
 };
\ No newline at end of file
@@ -0,0 +1,86 @@
+#include "Reaper.h"
+#include <algorithm>
+
+namespace
+{
+    const int64_t kLingerPoll = 10;             // ms between checks on objects still held elsewhere
+}
+
+Reaper::Reaper()
+{
+    reaper = thread([this]() {Run(); });
+}
+
+Reaper::~Reaper()
+{
+    {
+        unique_lock<mutex> lck(reaperMutex);
+        running = false;
+    }
+    reaperCondition.notify_one();
+    reaper.join();
+}
+
+void Reaper::Retire(shared_ptr<void> entry, function<void()> drain)
+{
+    {
+        unique_lock<mutex> lck(reaperMutex);
+        incoming.push_back({ move(entry), move(drain), TimePoint() });
+        stats.retired++;
+    }
+    reaperCondition.notify_one();
+}
+
+Reaper::Stats Reaper::GetStats()
+{
+    unique_lock<mutex> lck(reaperMutex);
+    return stats;
+}
+
+void Reaper::Run()
+{
+    unique_lock<mutex> lck(reaperMutex);
+    while (true)
+    {
+        if (lingering.size() > 0)
+            reaperCondition.wait_for(lck, chrono::milliseconds(kLingerPoll), [this]() {return !running || incoming.size() > 0; });
+        else
+            reaperCondition.wait(lck, [this]() {return !running || incoming.size() > 0; });
+
+        list<Item> batch;
+        batch.swap(incoming);
+        bool stopping = !running;
+        lck.unlock();
+
+        for (auto& item : batch)
+        {
+            if (item.drain)
+                item.drain();
+            item.drained = chrono::steady_clock::now();
+        }
+        lingering.splice(lingering.end(), batch);
+
+        // nothing new can take a reference once an object is detached, so a
+        // count of one stays one
+        int64_t released = 0;
+        int64_t linger = 0;
+        TimePoint now = chrono::steady_clock::now();
+        for (auto iter = lingering.begin(); iter != lingering.end();)
+        {
+            if (iter->entry.use_count() > 1 && !stopping)
+            {
+                ++iter;
+                continue;
+            }
+            linger = max<int64_t>(linger, chrono::duration_cast<chrono::milliseconds>(now - iter->drained).count());
+            iter = lingering.erase(iter);
+            released++;
+        }
+
+        lck.lock();
+        stats.released += released;
+        stats.maxLinger = max(stats.maxLinger, linger);
+        if (stopping && incoming.size() == 0)
+            break;
+    }
+}
@@ -0,0 +1,54 @@
+#pragma once
+#include <stdint.h>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+using namespace std;
+
+// Tears objects down on a background thread so the caller can detach them
+// and return right away. Retire runs drain once on the reaper thread (stop
+// timers, flush queues), then waits until nobody else holds the object and
+// lets it go there, so destructors that block on the GPU or on timer
+// completion never run on a network or UI thread.
+class Reaper
+{
+public:
+	struct Stats
+	{
+		int64_t retired = 0;
+		int64_t released = 0;
+		int64_t maxLinger = 0;		// ms the slowest object waited for its last other owner
+	};
+
+	Reaper();
+	~Reaper();
+
+	// drain must not hold its own reference to entry
+	void Retire(shared_ptr<void> entry, function<void()> drain);
+	Stats GetStats();
+
+private:
+	typedef chrono::steady_clock::time_point TimePoint;
+
+	struct Item
+	{
+		shared_ptr<void> entry;
+		function<void()> drain;
+		TimePoint drained;
+	};
+
+	list<Item> incoming;
+	list<Item> lingering;		// drained, still referenced elsewhere; reaper thread only
+	bool running = true;
+	Stats stats;
+	mutex reaperMutex;
+	condition_variable reaperCondition;
+	thread reaper;
+
+	void Run();
+};
@@ -0,0 +1,175 @@
+#include "RoomRoster.h"
+
+int64_t RoomRoster::Reset(int64_t roomId)
+{
+    unique_lock<mutex> lck(rosterMutex);
+    rid = roomId;
+    members.clear();
+    pending.clear();
+    seeded = false;
+    failed = false;
+    stats.members = 0;
+    stats.version++;
+    return ++generation;
+}
+
+int64_t RoomRoster::BeginResync()
+{
+    unique_lock<mutex> lck(rosterMutex);
+    seeded = false;
+    failed = false;
+    pending.clear();
+    return ++generation;
+}
+
+void RoomRoster::AbortResync(int64_t abortGeneration)
+{
+    unique_lock<mutex> lck(rosterMutex);
+    if (abortGeneration == generation)
+        failed = true;
+}
+
+bool RoomRoster::Seed(int64_t seedGeneration, const vector<int64_t>& uids, const vector<int64_t>& administrators, int64_t owner)
+{
+    unique_lock<mutex> lck(rosterMutex);
+    if (seedGeneration != generation || rid == 0)
+        return false;
+    members.clear();
+    for (int64_t uid : uids)
+        members[uid] = Role::Member;
+    // the lists come separately and may name users who already left
+    for (int64_t uid : administrators)
+    {
+        auto iter = members.find(uid);
+        if (iter != members.end())
+            iter->second = Role::Administrator;
+    }
+    auto iter = members.find(owner);
+    if (iter != members.end())
+        iter->second = Role::Owner;
+    for (auto& delta : pending)
+        Apply(delta.uid, delta.entered);
+    pending.clear();
+    seeded = true;
+    stats.members = (int32_t)members.size();
+    stats.resyncs++;
+    stats.version++;
+    return true;
+}
+
+bool RoomRoster::ResyncDue()
+{
+    unique_lock<mutex> lck(rosterMutex);
+    return rid != 0 && !seeded && failed;
+}
+
+void RoomRoster::Clear()
+{
+    Reset(0);
+}
+
+void RoomRoster::Apply(int64_t uid, bool entered)
+{
+    if (entered)
+        members.emplace(uid, Role::Member);
+    else
+        members.erase(uid);
+}
+
+bool RoomRoster::OnEnter(int64_t roomId, int64_t uid)
+{
+    unique_lock<mutex> lck(rosterMutex);
+    if (roomId != rid || rid == 0)
+        return true;
+    stats.deltas++;
+    if (!seeded)
+    {
+        pending.push_back({ uid, true });
+        return !failed;
+    }
+    bool fits = members.count(uid) == 0;
+    Apply(uid, true);
+    stats.members = (int32_t)members.size();
+    stats.version++;
+    if (!fits)
+        stats.mismatches++;
+    return fits;
+}
+
+bool RoomRoster::OnExit(int64_t roomId, int64_t uid)
+{
+    unique_lock<mutex> lck(rosterMutex);
+    if (roomId != rid || rid == 0)
+        return true;
+    stats.deltas++;
+    if (!seeded)
+    {
+        pending.push_back({ uid, false });
+        return !failed;
+    }
+    bool fits = members.count(uid) > 0;
+    Apply(uid, false);
+    stats.members = (int32_t)members.size();
+    stats.version++;
+    if (!fits)
+        stats.mismatches++;
+    return fits;
+}
+
+bool RoomRoster::SetRole(int64_t uid, Role role)
+{
+    unique_lock<mutex> lck(rosterMutex);
+    auto iter = members.find(uid);
+    // the owner stays owner, promotions only concern the others
+    if (iter == members.end() || iter->second == Role::Owner || iter->second == role)
+        return false;
+    iter->second = role;
+    stats.version++;
+    return true;
+}
+
+bool RoomRoster::CheckCount(int64_t roomId, int64_t count, int64_t deltas)
+{
+    unique_lock<mutex> lck(rosterMutex);
+    if (roomId != rid || !seeded || deltas != stats.deltas || (int64_t)members.size() == count)
+        return true;
+    stats.mismatches++;
+    return false;
+}
+
+int64_t RoomRoster::GetRid()
+{
+    unique_lock<mutex> lck(rosterMutex);
+    return rid;
+}
+
+bool RoomRoster::IsMember(int64_t uid)
+{
+    unique_lock<mutex> lck(rosterMutex);
+    return members.count(uid) > 0;
+}
+
+RoomRoster::Role RoomRoster::GetRole(int64_t uid)
+{
+    unique_lock<mutex> lck(rosterMutex);
+    auto iter = members.find(uid);
+    return iter == members.end() ? Role::None : iter->second;
+}
+
+vector<int64_t> RoomRoster::GetMembers()
+{
+    unique_lock<mutex> lck(rosterMutex);
+    vector<int64_t> uids;
+    uids.reserve(members.size());
+    for (auto& item : members)
+        uids.push_back(item.first);
+    return uids;
+}
+
+RoomRoster::Stats RoomRoster::GetStats()
+{
+    unique_lock<mutex> lck(rosterMutex);
+    Stats result = stats;
+    result.seeded = seeded;
+    return result;
+}
@@ -0,0 +1,83 @@
+#pragma once
+#include <stdint.h>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+using namespace std;
+
+// Members of the current room, kept locally so lookups need no request.
+// Seeded from one full member list, then kept up to date from the enter and
+// exit pushes. Pushes that don't fit (an enter for a member, an exit for a
+// stranger) or a member count that disagrees with the server mean a delta
+// was lost, and the owner is told to fetch the list again. Pushes that come
+// in while a fetch is on its way are replayed over its result; enter and
+// exit are idempotent, so it doesn't matter which side of the snapshot they
+// fell on.
+class RoomRoster
+{
+public:
+	enum class Role : int32_t
+	{
+		None,				// not in the room
+		Member,
+		Administrator,
+		Owner
+	};
+
+	struct Stats
+	{
+		int64_t version = 0;		// bumped by every change
+		int32_t members = 0;
+		int64_t deltas = 0;			// pushes applied
+		int64_t resyncs = 0;
+		int64_t mismatches = 0;		// pushes or counts that showed a lost delta
+		bool seeded = false;		// the full list is in; false while a fetch is due or on its way
+	};
+
+	// a fresh room; returns the generation to pass to Seed
+	int64_t Reset(int64_t rid);
+	// starts over from a full list; returns the generation to pass to Seed
+	int64_t BeginResync();
+	// false when the room changed or another resync started since generation;
+	// roles are taken only for uids in the list
+	bool Seed(int64_t generation, const vector<int64_t>& uids, const vector<int64_t>& administrators, int64_t owner);
+	// the fetch failed, ResyncDue reports it until another one starts
+	void AbortResync(int64_t generation);
+	// a room without its full list and no fetch on the way
+	bool ResyncDue();
+	void Clear();
+
+	// false when the push doesn't fit and a resync is due
+	bool OnEnter(int64_t rid, int64_t uid);
+	bool OnExit(int64_t rid, int64_t uid);
+	// false when uid isn't a member or already had the role
+	bool SetRole(int64_t uid, Role role);
+	// false when the server's count disagrees; deltas is Stats::deltas from when
+	// the count was asked for, pushes that came in since make the answer moot
+	bool CheckCount(int64_t rid, int64_t count, int64_t deltas);
+
+	int64_t GetRid();
+	bool IsMember(int64_t uid);
+	Role GetRole(int64_t uid);
+	vector<int64_t> GetMembers();
+	Stats GetStats();
+
+private:
+	struct Delta
+	{
+		int64_t uid;
+		bool entered;
+	};
+
+	unordered_map<int64_t, Role> members;
+	int64_t rid = 0;
+	int64_t generation = 0;
+	bool seeded = false;
+	bool failed = false;		// the last fetch got no list
+	vector<Delta> pending;		// pushes that came in during a resync
+	Stats stats;
+	mutex rosterMutex;
+
+	void Apply(int64_t uid, bool entered);
+};
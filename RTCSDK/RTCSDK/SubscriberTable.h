@@ -0,0 +1,157 @@
+#pragma once
+#include <stdint.h>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+using namespace std;
+
+// uid -> entry map for the media path: Find never takes a lock, writers copy
+// a shard's map, publish the copy and wait until no reader can still be
+// looking at the old one (read-copy-update with two reader counters per
+// shard). Entries are shared_ptr, so one that is removed while a callback
+// still holds it lives until that callback lets go.
+template <typename T>
+class SubscriberTable
+{
+	typedef unordered_map<int64_t, shared_ptr<T>> Map;
+
+	static const size_t kShards = 16;
+
+	struct alignas(64) Shard
+	{
+		atomic<const Map*> current;
+		atomic<uint32_t> epoch;
+		atomic<int32_t> readers[2];
+		mutex writerMutex;
+
+		Shard() : current(new Map()), epoch(0)
+		{
+			readers[0] = 0;
+			readers[1] = 0;
+		}
+		~Shard() { delete current.load(); }
+	};
+
+	Shard shards[kShards];
+
+	static size_t ShardOf(int64_t uid)
+	{
+		uint64_t key = (uint64_t)uid;
+		key ^= key >> 33;
+		key *= 0xff51afd7ed558ccdULL;
+		key ^= key >> 33;
+		return key % kShards;
+	}
+
+	// holds off reclamation of the map it was entered on
+	class ReadGuard
+	{
+		Shard& shard;
+		uint32_t slot;
+	public:
+		ReadGuard(Shard& shard) : shard(shard)
+		{
+			while (true)
+			{
+				uint32_t epoch = shard.epoch.load();
+				slot = epoch & 1;
+				shard.readers[slot]++;
+				if (shard.epoch.load() == epoch)
+					break;
+				// a writer flipped the epoch in between and may not wait for us
+				shard.readers[slot]--;
+			}
+		}
+		~ReadGuard() { shard.readers[slot]--; }
+	};
+
+	// writerMutex held; old is unreachable for new readers once this returns
+	static void Publish(Shard& shard, const Map* next)
+	{
+		const Map* old = shard.current.exchange(next);
+		uint32_t slot = shard.epoch.fetch_add(1) & 1;
+		while (shard.readers[slot].load() != 0)
+			this_thread::yield();
+		delete old;
+	}
+
+public:
+	SubscriberTable() {}
+	SubscriberTable(const SubscriberTable&) = delete;
+	SubscriberTable& operator=(const SubscriberTable&) = delete;
+
+	shared_ptr<T> Find(int64_t uid)
+	{
+		Shard& shard = shards[ShardOf(uid)];
+		ReadGuard guard(shard);
+		const Map* map = shard.current.load();
+		auto iter = map->find(uid);
+		if (iter == map->end())
+			return nullptr;
+		return iter->second;
+	}
+
+	// false when uid is already there, the table is left as it was
+	bool Insert(int64_t uid, shared_ptr<T> entry)
+	{
+		Shard& shard = shards[ShardOf(uid)];
+		unique_lock<mutex> lck(shard.writerMutex);
+		const Map* map = shard.current.load();
+		if (map->find(uid) != map->end())
+			return false;
+		Map* next = new Map(*map);
+		next->emplace(uid, move(entry));
+		Publish(shard, next);
+		return true;
+	}
+
+	// the removed entry, nullptr when there was none; with expected set only
+	// that very entry is taken out
+	shared_ptr<T> Remove(int64_t uid, const shared_ptr<T>& expected = nullptr)
+	{
+		Shard& shard = shards[ShardOf(uid)];
+		unique_lock<mutex> lck(shard.writerMutex);
+		const Map* map = shard.current.load();
+		auto iter = map->find(uid);
+		if (iter == map->end() || (expected != nullptr && iter->second != expected))
+			return nullptr;
+		shared_ptr<T> entry = iter->second;
+		Map* next = new Map(*map);
+		next->erase(uid);
+		Publish(shard, next);
+		return entry;
+	}
+
+	// empties the table and hands back what was in it
+	vector<shared_ptr<T>> Clear()
+	{
+		vector<shared_ptr<T>> entries;
+		for (auto& shard : shards)
+		{
+			unique_lock<mutex> lck(shard.writerMutex);
+			const Map* map = shard.current.load();
+			if (map->size() == 0)
+				continue;
+			for (auto& item : *map)
+				entries.push_back(item.second);
+			Publish(shard, new Map());
+		}
+		return entries;
+	}
+
+	vector<int64_t> Keys()
+	{
+		vector<int64_t> uids;
+		for (auto& shard : shards)
+		{
+			ReadGuard guard(shard);
+			for (auto& item : *shard.current.load())
+				uids.push_back(item.first);
+		}
+		return uids;
+	}
+};
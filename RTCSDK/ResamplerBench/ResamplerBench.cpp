@@ -0,0 +1,209 @@
+// ResamplerBench.cpp : compares Resampler with libsamplerate on the rates the audio devices use.
+// Each case feeds 10 s of a 1 kHz tone in 20 ms blocks, the way AudioPlayer/AudioRecorder do,
+// and reports the time per block, the output frames per block and the SNR of the result.
+
+#include <stdio.h>
+#include <math.h>
+#include <chrono>
+#include <vector>
+
+#include "Resampler.h"
+#include "samplerate.h"
+
+using namespace std;
+
+namespace
+{
+    const double kPi = 3.14159265358979323846;
+    const double kToneHz = 1000.0;
+    const double kAmplitude = 0.5;
+    const int32_t kSeconds = 10;
+    const int32_t kBlocksPerSecond = 50;        // 20 ms, the device period
+    const int32_t kPasses = 5;                  // timed runs, the fastest counts
+    const double kSettle = 0.1;                 // s of output skipped before the SNR, the filters' delay
+
+    struct Case
+    {
+        int32_t inRate;
+        int32_t outRate;
+        int32_t channels;
+    };
+
+    const Case kCases[] = {
+        { 48000, 44100, 2 },
+        { 44100, 48000, 2 },
+        { 48000, 16000, 1 },
+        { 44100, 16000, 1 },
+        { 16000, 48000, 1 },
+        { 16000, 44100, 2 },
+    };
+
+    struct Result
+    {
+        bool ok = false;
+        double usPerBlock = 0;
+        size_t minFrames = 0;
+        size_t maxFrames = 0;
+        double snr = 0;
+    };
+
+    vector<float> MakeTone(int32_t rate, int32_t channels)
+    {
+        size_t frames = (size_t)rate * kSeconds;
+        vector<float> tone(frames * channels);
+        for (size_t i = 0; i < frames; i++)
+        {
+            float sample = (float)(kAmplitude * sin(2 * kPi * kToneHz * i / rate));
+            for (int32_t c = 0; c < channels; c++)
+                tone[i * channels + c] = sample;
+        }
+        return tone;
+    }
+
+    // the tone's share is fitted with a sine and a cosine, so the delay of either converter doesn't matter
+    double MeasureSnr(const vector<float>& output, int32_t rate, int32_t channels)
+    {
+        size_t frames = output.size() / channels;
+        size_t first = (size_t)(rate * kSettle);
+        if (frames <= first)
+            return 0;
+        double ss = 0, sc = 0, cc = 0, ys = 0, yc = 0;
+        for (size_t i = first; i < frames; i++)
+        {
+            double s = sin(2 * kPi * kToneHz * i / rate);
+            double c = cos(2 * kPi * kToneHz * i / rate);
+            double y = output[i * channels];
+            ss += s * s;
+            sc += s * c;
+            cc += c * c;
+            ys += y * s;
+            yc += y * c;
+        }
+        double det = ss * cc - sc * sc;
+        double a = (ys * cc - yc * sc) / det;
+        double b = (yc * ss - ys * sc) / det;
+        double signal = 0, noise = 0;
+        for (size_t i = first; i < frames; i++)
+        {
+            double fit = a * sin(2 * kPi * kToneHz * i / rate) + b * cos(2 * kPi * kToneHz * i / rate);
+            double error = output[i * channels] - fit;
+            signal += fit * fit;
+            noise += error * error;
+        }
+        if (noise <= 0)
+            return 200;
+        return 10 * log10(signal / noise);
+    }
+
+    void Track(Result& result, size_t frames, bool first)
+    {
+        if (first || frames < result.minFrames)
+            result.minFrames = frames;
+        if (first || frames > result.maxFrames)
+            result.maxFrames = frames;
+    }
+
+    Result RunResampler(const Case& test, const vector<float>& input)
+    {
+        Result result;
+        size_t blockFrames = test.inRate / kBlocksPerSecond;
+        size_t blocks = input.size() / test.channels / blockFrames;
+        vector<float> output;
+        double best = 0;
+        for (int32_t pass = 0; pass < kPasses; pass++)
+        {
+            Resampler resampler(test.inRate, test.outRate, test.channels, test.channels);
+            vector<float> block(resampler.MaxOutputFrames(blockFrames) * test.channels);
+            output.clear();
+            auto start = chrono::steady_clock::now();
+            for (size_t i = 0; i < blocks; i++)
+            {
+                size_t frames = resampler.Process(input.data() + i * blockFrames * test.channels, blockFrames, block.data(), resampler.MaxOutputFrames(blockFrames));
+                Track(result, frames, pass == 0 && i == 0);
+                output.insert(output.end(), block.begin(), block.begin() + frames * test.channels);
+            }
+            double us = chrono::duration<double, micro>(chrono::steady_clock::now() - start).count() / blocks;
+            if (pass == 0 || us < best)
+                best = us;
+        }
+        result.ok = true;
+        result.usPerBlock = best;
+        result.snr = MeasureSnr(output, test.outRate, test.channels);
+        return result;
+    }
+
+    Result RunSampleRate(const Case& test, const vector<float>& input, int converter)
+    {
+        Result result;
+        size_t blockFrames = test.inRate / kBlocksPerSecond;
+        size_t blocks = input.size() / test.channels / blockFrames;
+        double ratio = double(test.outRate) / test.inRate;
+        vector<float> block((size_t)(blockFrames * ratio + 64) * test.channels);
+        vector<float> output;
+        double best = 0;
+        for (int32_t pass = 0; pass < kPasses; pass++)
+        {
+            int err = 0;
+            SRC_STATE* state = src_new(converter, test.channels, &err);
+            if (state == nullptr)
+            {
+                fprintf(stderr, "src_new failed: %s\n", src_strerror(err));
+                return result;
+            }
+            output.clear();
+            auto start = chrono::steady_clock::now();
+            for (size_t i = 0; i < blocks; i++)
+            {
+                SRC_DATA data = {};
+                data.data_in = input.data() + i * blockFrames * test.channels;
+                data.input_frames = (long)blockFrames;
+                data.data_out = block.data();
+                data.output_frames = (long)(block.size() / test.channels);
+                data.src_ratio = ratio;
+                err = src_process(state, &data);
+                if (err != 0)
+                {
+                    fprintf(stderr, "src_process failed: %s\n", src_strerror(err));
+                    src_delete(state);
+                    return result;
+                }
+                Track(result, data.output_frames_gen, pass == 0 && i == 0);
+                output.insert(output.end(), block.begin(), block.begin() + data.output_frames_gen * test.channels);
+            }
+            double us = chrono::duration<double, micro>(chrono::steady_clock::now() - start).count() / blocks;
+            if (pass == 0 || us < best)
+                best = us;
+            src_delete(state);
+        }
+        result.ok = true;
+        result.usPerBlock = best;
+        result.snr = MeasureSnr(output, test.outRate, test.channels);
+        return result;
+    }
+
+    void Print(const char* name, const Result& result)
+    {
+        if (!result.ok)
+        {
+            printf("  %-24s failed\n", name);
+            return;
+        }
+        printf("  %-24s %8.2f us/block  %4zu-%-4zu frames/block  SNR %6.1f dB\n",
+            name, result.usPerBlock, result.minFrames, result.maxFrames, result.snr);
+    }
+}
+
+int main()
+{
+    for (const Case& test : kCases)
+    {
+        printf("%d -> %d Hz, %d ch, %d ms blocks, expected %d frames/block\n",
+            test.inRate, test.outRate, test.channels, 1000 / kBlocksPerSecond, test.outRate / kBlocksPerSecond);
+        vector<float> input = MakeTone(test.inRate, test.channels);
+        Print("Resampler", RunResampler(test, input));
+        // the converter the devices used before Resampler
+        Print("SRC_SINC_FASTEST", RunSampleRate(test, input, SRC_SINC_FASTEST));
+        Print("SRC_SINC_MEDIUM_QUALITY", RunSampleRate(test, input, SRC_SINC_MEDIUM_QUALITY));
+    }
+    return 0;
+}